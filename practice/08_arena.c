@@ -0,0 +1,116 @@
+// リージョン（アリーナ）アロケータ
+// ビルド（単体では main を持たないので、使う側と一緒にコンパイルする）:
+// gcc -O2 -pthread -DCUSTOM_MALLOC_NO_MAIN prog.c 08_arena.c 08_custom_malloc.c
+//
+// チャンクは custom_malloc から取る。既定のチャンクサイズ（64KiB）は
+// custom_malloc の mmap 閾値より小さいので sbrk ヒープから切り出されるが、
+// 大きなチャンクを指定すれば mmap の経路に乗り、破棄するとそのまま OS に返る。
+// 確保はチャンク内のポインタを進めるだけ。巻き戻しや全体のリセットは
+// 「今どのチャンクのどこまで使ったか」を書き換えるだけなので O(1)。
+// 後ろのチャンクは解放せずに持っておき、次の確保で使い回す。
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "08_custom_malloc.h"
+#include "08_arena.h"
+
+#define ARENA_ALIGN 8
+#define ARENA_DEFAULT_CHUNK (64 * 1024)
+#define ARENA_ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct arena_chunk {
+    arena_chunk_t* next;
+    size_t capacity;     // data に使えるバイト数
+    size_t used;         // 使用済みのバイト数
+    char data[];
+};
+
+struct arena {
+    arena_chunk_t* first;    // 最初のチャンク（リセットでここへ戻る）
+    arena_chunk_t* current;  // 今確保しているチャンク（これより後ろは再利用待ち）
+    size_t chunk_size;
+    size_t reserved;         // チャンクとして確保している合計バイト数
+};
+
+static arena_chunk_t* arena_new_chunk(arena_t* arena, size_t min_capacity) {
+    size_t capacity = arena->chunk_size;
+    if (capacity < min_capacity) capacity = min_capacity;
+
+    arena_chunk_t* chunk = custom_malloc(sizeof(arena_chunk_t) + capacity);
+    if (chunk == NULL) return NULL;
+    chunk->next = NULL;
+    chunk->capacity = capacity;
+    chunk->used = 0;
+    arena->reserved += sizeof(arena_chunk_t) + capacity;
+    return chunk;
+}
+
+arena_t* arena_create(size_t chunk_size) {
+    arena_t* arena = custom_malloc(sizeof(arena_t));
+    if (arena == NULL) return NULL;
+    arena->chunk_size = chunk_size ? ARENA_ALIGN_UP(chunk_size) : ARENA_DEFAULT_CHUNK;
+    arena->reserved = 0;
+    arena->first = arena_new_chunk(arena, 0);
+    if (arena->first == NULL) {
+        custom_free(arena);
+        return NULL;
+    }
+    arena->current = arena->first;
+    return arena;
+}
+
+void* arena_alloc(arena_t* arena, size_t size) {
+    size = ARENA_ALIGN_UP(size ? size : 1);
+    arena_chunk_t* chunk = arena->current;
+
+    if (chunk->capacity - chunk->used < size) {
+        // 後ろに再利用できるチャンクがあればそれを、なければ新しく確保して挟み込む
+        arena_chunk_t* next = chunk->next;
+        if (next == NULL || next->capacity < size) {
+            arena_chunk_t* fresh = arena_new_chunk(arena, size);
+            if (fresh == NULL) return NULL;
+            fresh->next = next;
+            chunk->next = fresh;
+            next = fresh;
+        }
+        next->used = 0;
+        arena->current = chunk = next;
+    }
+
+    void* ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+// 現在位置を記録する
+arena_mark_t arena_save(arena_t* arena) {
+    arena_mark_t mark = {arena->current, arena->current->used};
+    return mark;
+}
+
+// 記録した位置まで巻き戻す。それ以降に確保したものはまとめて無効になる
+void arena_restore(arena_t* arena, arena_mark_t mark) {
+    arena->current = mark.chunk;
+    arena->current->used = mark.used;
+}
+
+// 全体を空に戻す（チャンクは次の確保のために残す）
+void arena_reset(arena_t* arena) {
+    arena->current = arena->first;
+    arena->current->used = 0;
+}
+
+// チャンクごとヒープへ返して破棄する
+void arena_destroy(arena_t* arena) {
+    arena_chunk_t* chunk = arena->first;
+    while (chunk) {
+        arena_chunk_t* next = chunk->next;
+        custom_free(chunk);
+        chunk = next;
+    }
+    custom_free(arena);
+}
+
+size_t arena_reserved_bytes(arena_t* arena) {
+    return arena->reserved;
+}
@@ -0,0 +1,26 @@
+// リージョン（アリーナ）アロケータ（08_custom_malloc.c のヒープの上に載る）
+// ポインタを進めるだけで確保し、個別には解放しない。
+// まとめて捨てるときは arena_reset（O(1)）か arena_destroy を使う。
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+typedef struct arena arena_t;
+typedef struct arena_chunk arena_chunk_t;
+
+// arena_save で取った位置。arena_restore でそこまで巻き戻す（入れ子にできる）
+typedef struct {
+    arena_chunk_t* chunk;
+    size_t used;
+} arena_mark_t;
+
+arena_t* arena_create(size_t chunk_size);
+void* arena_alloc(arena_t* arena, size_t size);
+arena_mark_t arena_save(arena_t* arena);
+void arena_restore(arena_t* arena, arena_mark_t mark);
+void arena_reset(arena_t* arena);
+void arena_destroy(arena_t* arena);
+size_t arena_reserved_bytes(arena_t* arena);
+
+#endif
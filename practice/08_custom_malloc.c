@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // mremap
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,279 +6,2494 @@
 #include <assert.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "08_custom_malloc.h"
 
-#define ALIGNMENT 8
+#define ALIGNMENT 16 // x86-64 の malloc は max_align_t（16バイト）境界を保証する
 #define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(ALIGNMENT-1))
-#define BLOCK_SIZE sizeof(block_t)
+#define BLOCK_SIZE offsetof(block_t, data) // ヘッダ部分のサイズ（data の手前まで）
+#define FOOTER_SIZE sizeof(size_t)          // 境界タグ（空きブロック末尾のフッタ）のサイズ
+#define MIN_BLOCK_SIZE ALIGN(BLOCK_SIZE + 2 * sizeof(void*) + FOOTER_SIZE) // 空きリストに入れられる最小
+#define EPILOGUE_SIZE BLOCK_SIZE            // 終端ブロックはヘッダだけ
+#define PROLOGUE_SIZE (ALIGNMENT - BLOCK_SIZE) // 領域先頭の詰め物。data を ALIGNMENT 境界に揃える
+#define SEGMENT_OVERHEAD (PROLOGUE_SIZE + EPILOGUE_SIZE)
+#define DEFAULT_MMAP_THRESHOLD (128 * 1024) // これ以上のブロックは個別に mmap する
+#define DEFAULT_TRIM_THRESHOLD (128 * 1024) // ヒープ末尾の空きがこれを超えたら OS に返す
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)      // x86-64 の THP / hugetlb のページサイズ
 // #define custom_malloc(size) debug_malloc(size, __FILE__, __LINE__)
 // #define custom_free(ptr) debug_free(ptr, __FILE__, __LINE__)
+
+// サイズクラス（TLSF風の2段階分類）
+// 第1段階: ブロックサイズの2のべき乗（floor(log2(size))）
+// 第2段階: 各べき乗区間をさらに SL_COUNT 等分
+#define FL_SHIFT 5                       // 最小クラスの下限 2^5 = 32 バイト
+#define FL_COUNT 32                      // 2^5 〜 2^36 バイトまでを区別
+#define SL_SHIFT 2
+#define SL_COUNT (1 << SL_SHIFT)         // 各べき乗区間を4分割
+#define NUM_SIZE_CLASSES (FL_COUNT * SL_COUNT)
+// これより小さいクラスは ALIGNMENT 刻みで1クラス1サイズになるので、木ではなく
+// 双方向リストで持つ（最小ブロックには木のノードが入らない）
+#define LIST_CLASS_LIMIT (1 << (FL_SHIFT + 2))
+
+// バディ方式（CM_FIT_BUDDY）のブロックは 2^BUDDY_MIN_ORDER 〜 2^BUDDY_MAX_ORDER バイト
+#define BUDDY_MIN_ORDER 5                // MIN_BLOCK_SIZE（32 バイト）
+#define BUDDY_MAX_ORDER 20               // 1 MiB のチャンクを半分ずつに割っていく
+#define BUDDY_ORDERS (BUDDY_MAX_ORDER - BUDDY_MIN_ORDER + 1)
+
 // メモリブロックの構造体
+// ヘッダは「ブロック全体のサイズ | フラグ」の1ワードだけ。サイズは ALIGNMENT の倍数なので
+// 下位4ビットをフラグに使う。使用中のブロックはヘッダ直後から末尾まですべて利用者の領域。
 typedef struct block_t {
-    size_t size;          // ブロック全体のサイズ（ヘッダ部分も含む）
-    bool is_free;         // このブロックが空きかどうか
-    struct block_t* next; // 次のブロックへのポインタ（連結リスト用）
-    struct block_t* prev; // 前のブロックへのポインタ（連結リスト用）
-    char data[1];         // 実際のデータ領域の先頭（可変長配列のトリック）
+    size_t header;        // ブロック全体のサイズ（ヘッダ部分も含む） | フラグ
+    char data[];          // 実際のデータ領域の先頭
 } block_t;
 
-// ヒープ管理用の構造体
-typedef struct {
-    block_t* free_list;  // 空きブロックのリストの先頭
-    block_t* used_list;  // 使用中ブロックのリストの先頭
-    size_t total_size;   // ヒープ全体のサイズ
-    size_t used_size;    // 現在使用中のサイズ
-} heap_t;
+#define BLOCK_FREE      ((size_t)1) // このブロックが空き
+#define BLOCK_PREV_FREE ((size_t)2) // メモリ上の直前のブロックが空き（直前にフッタがある）
+#define BLOCK_MMAPPED   ((size_t)4) // 個別に mmap した大きいブロック
+#define BLOCK_FRESH     ((size_t)8) // OS から取ってきたまま一度も使われていない（中身が0）
+#define BLOCK_FLAGS     ((size_t)(ALIGNMENT - 1))
+
+#define SIZE(block) ((block)->header & ~BLOCK_FLAGS)
+#define HAS_FLAG(block, flag) (((block)->header & (flag)) != 0)
+#define SET_FLAG(block, flag) ((block)->header |= (flag))
+#define CLEAR_FLAG(block, flag) ((block)->header &= ~(flag))
+#define SET_SIZE(block, size) ((block)->header = (size) | ((block)->header & BLOCK_FLAGS))
+
+// 空きブロックの末尾のフッタにはサイズを書く（境界タグ）。
+// 直後のブロックのヘッダに BLOCK_PREV_FREE が立っていれば、1ワード戻ると
+// 前のブロックの大きさがわかる。使用中のブロックはフッタを持たない。
+#define FOOTER(block) (*(size_t*)((char*)(block) + SIZE(block) - FOOTER_SIZE))
+#define NEXT_BLOCK(block) ((block_t*)((char*)(block) + SIZE(block)))
+#define PREV_FOOTER(block) (*(size_t*)((char*)(block) - FOOTER_SIZE))
+
+// 空きブロックのリンクは data 領域に置く。
+// LIST_CLASS_LIMIT 未満のクラスは next/prev の双方向リスト。
+// それ以上のクラスは赤黒木で、左右の子に prev/next、加えて親と色を使う。
+// 木の並びは (サイズ, 新しく入った順)。同じサイズなら後から入れたものが左に来るので、
+// リストと同じく「最後に空いたものから使う」ベストフィットになる。
+typedef struct {
+    block_t* next;
+    block_t* prev;
+    block_t* parent;      // 木のときだけ
+    size_t is_red;        // 木のときだけ
+} free_node_t;
+
+#define NODE(block) ((free_node_t*)(block)->data)
+#define TREE_LEFT(block) (NODE(block)->prev)
+#define TREE_RIGHT(block) (NODE(block)->next)
+#define TREE_PARENT(block) (NODE(block)->parent)
+#define TREE_RED(block) (NODE(block)->is_red)
+
+// 確保・解放の回数と量（get_malloc_stats 用）
+typedef struct {
+    size_t requested;          // 要求されたバイト数の累計
+    size_t allocated;          // そのために渡したブロックの累計
+    size_t in_use;             // 利用者が使用中のブロックの合計
+    size_t allocs[FL_COUNT];   // 第1段階クラスごとの確保回数
+    size_t frees[FL_COUNT];    // 第1段階クラスごとの解放回数
+} usage_t;
+
+_Static_assert(CM_STATS_CLASSES == FL_COUNT, "統計のクラスは第1段階クラスと同じ");
+
+// ヒープ管理用の構造体
+typedef struct {
+    block_t* bins[NUM_SIZE_CLASSES]; // サイズクラスごとの空きブロックのリストか木の根
+    uint32_t fl_bitmap;              // 空きのある第1段階クラスのビットマップ
+    uint8_t sl_bitmap[FL_COUNT];     // 第1段階ごとの、空きのある第2段階クラスのビットマップ
+    char* segments;      // 最後に追加した領域の先頭（先頭のワードに1つ前の領域を書く）
+    size_t total_size;   // ヒープ全体のサイズ
+    size_t used_size;    // 現在使用中のサイズ
+    char* heap_end;      // 最後に sbrk した領域の終端（次の領域が連続するかの判定用）
+    size_t mmap_size;    // 個別に mmap しているブロックの合計サイズ
+    size_t mmap_threshold; // このサイズ以上は mmap で確保する
+    size_t trim_threshold; // ヒープ末尾の空きがこれを超えたら縮める
+    bool realloc_in_place; // custom_realloc でその場での伸縮を試みるか
+    size_t realloc_copies; // custom_realloc がコピーにまで至った回数
+    bool dump_blocks;      // print_memory_stats で全ブロックを表示するか
+    size_t free_size;      // 空きブロックの合計
+    size_t free_blocks[FL_COUNT]; // 第1段階クラスごとの空きブロック数
+    usage_t usage;
+    size_t peak_in_use;
+    size_t peak_reserved;  // total_size + mmap_size の最大
+    size_t sbrk_calls;     // 領域を増減した sbrk の回数
+    size_t mmap_calls;
+    size_t munmap_calls;
+    size_t mremap_calls;
+    bool thread_heaps;     // 小さいブロックをスレッドヒープから確保するか
+    size_t theap_size;     // スレッドヒープに渡したスパンの合計
+    int fit_policy;        // 空きブロックの選び方（CM_FIT_*）
+    block_t* rover;        // next-fit で次に探し始めるブロック
+    size_t fit_searches;   // 空きブロックを探した回数
+    size_t fit_steps;      // そのとき調べたブロック（木のノード）の数
+    block_t* buddy_bins[BUDDY_ORDERS]; // バディ方式の次数ごとの空きリスト
+    uint32_t buddy_bitmap; // 空きのある次数のビットマップ
+    size_t buddy_size;     // バディ領域から切り出したチャンクの合計
+    size_t buddy_free;     // バディ領域の空きブロックの合計
+    pthread_mutex_t lock; // 中央ヒープを操作するときのロック
+} heap_t;
+
+// グローバルなヒープ構造体（全スレッドで共有する中央ヒープ）
+static heap_t heap = {
+    .mmap_threshold = DEFAULT_MMAP_THRESHOLD,
+    .trim_threshold = DEFAULT_TRIM_THRESHOLD,
+    .realloc_in_place = true,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// スレッドごとの小ブロックキャッシュ（tcache）
+// ブロックサイズごとの単方向リストで、ロックなしで確保・解放する。
+// 中央ヒープとは TCACHE_BATCH 個ずつまとめてやり取りし、ロックはそのときだけ取る。
+// 中央ヒープから見ると、キャッシュ中のブロックは使用中のまま。
+#define TCACHE_MAX_SIZE 1024                       // キャッシュするブロックサイズの上限
+#define TCACHE_BINS (TCACHE_MAX_SIZE / ALIGNMENT + 1)
+#define TCACHE_BATCH 32                            // 補充・返却をまとめて行う個数
+#define TCACHE_LIMIT (TCACHE_BATCH * 2)            // 1サイズあたりの保持上限
+// キャッシュ内のリンクは data 領域に置く。2ワード目には TCACHE_ENTRY_KEY を書いておき、
+// 解放時にこれが見えたらキャッシュを探して二重解放を検出する（glibc と同じやり方）。
+#define TCACHE_NEXT(block) (((block_t**)(block)->data)[0])
+#define TCACHE_KEY(block) (((uintptr_t*)(block)->data)[1])
+#define TCACHE_ENTRY_KEY ((uintptr_t)0x7cac4e5eed5a17edULL)
+// 分割しきれずに要求より最大 MIN_BLOCK_SIZE 未満大きいブロックもキャッシュを通る
+#define TCACHE_USAGE_BINS (TCACHE_BINS + MIN_BLOCK_SIZE / ALIGNMENT)
+
+typedef struct theap theap_t;
+
+typedef struct {
+    block_t* bins[TCACHE_BINS];    // ブロックサイズ / ALIGNMENT ごとのリスト
+    uint32_t counts[TCACHE_BINS];  // 各リストの長さ
+    bool registered;               // スレッド終了時の返却処理を登録済みか
+    theap_t* theap;                // このスレッドのスレッドヒープ（使っていなければ NULL）
+    // まだ heap.usage に足し込んでいない確保・解放の回数（ブロックサイズ / ALIGNMENT ごと）。
+    // 速い経路では1つ数えるだけにして、量やクラスへの換算は足し込むときに行う。
+    size_t allocs[TCACHE_USAGE_BINS];
+    size_t frees[TCACHE_USAGE_BINS];
+    size_t requested;
+    // ヒーププロファイラ: 次のサンプルまでの残りバイト数と、その乱数
+    ptrdiff_t sample_left;
+    uint64_t sample_random;
+    bool sampling;                 // サンプルを記録中（その中の確保・解放は数えない）
+} tcache_t;
+
+static __thread tcache_t tcache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+// スレッドヒープ（custom_mallopt(CM_THREAD_HEAPS, 1) で有効にする）
+// tcache は他のスレッドが確保したブロックも自分のキャッシュに入れ、あふれた分を
+// 中央ヒープへ返す。producer/consumer のように確保と解放のスレッドが分かれていると、
+// 解放側は返すたび、確保側は補充するたびに中央ヒープのロックを取ることになる。
+// スレッドヒープでは、小さいブロックをスレッドごとのスパン（THEAP_SPAN_SIZE 境界に
+// 揃えた領域）から切り出す。スパンの先頭のワードには持ち主のヒープを書いておくので、
+// 解放するブロックのアドレスを丸めれば持ち主がわかる。
+//   - 持ち主のスレッドなら、ヒープの空きリストに戻す（ロックなし）
+//   - 他のスレッドなら、持ち主の remote リストに CAS で積む（ロックなし）
+// 持ち主は確保のときに空きリストが空なら、remote リストを exchange で丸ごと取り出して
+// 空きリストに移す。取り出すのは持ち主だけで、しかも丸ごとなので ABA は起きない。
+// ブロックは統合も分割もせず、OS にも中央ヒープにも返さない（スラブと同じ考え方）。
+// 終了したスレッドのヒープは捨てずに残し、次に作られたスレッドが引き継ぐ。
+#define THEAP_SPAN_SIZE (64 * 1024)
+#define THEAP_REGION_SIZE ((size_t)16 << 30) // スパンを切り出す領域（アドレス空間だけ予約する）
+#define SPAN_OWNER(block) (*(theap_t**)((uintptr_t)(block) & ~(uintptr_t)(THEAP_SPAN_SIZE - 1)))
+
+struct theap {
+    block_t* bins[TCACHE_BINS]; // ブロックサイズ / ALIGNMENT ごとの空きリスト（TCACHE_NEXT でつなぐ）
+    char* bump;                 // 今のスパンの未使用部分の先頭（次のブロックのヘッダ位置）
+    char* bump_end;
+    block_t* remote;            // 他のスレッドが解放したブロック（アトミックに操作する）
+    theap_t* next_abandoned;    // 持ち主のスレッドが終了したヒープのリスト
+};
+
+static char* theap_region;      // 予約した領域（heap.lock を保持して操作する）
+static char* theap_region_end;
+static char* theap_region_next; // 次に渡すスパン
+static theap_t* theap_abandoned;
+
+// ブロックサイズを (第1段階, 第2段階) のクラスに変換する
+static void size_to_class(size_t size, int* fl, int* sl) {
+    if (size < ((size_t)1 << FL_SHIFT)) {
+        *fl = 0;
+        *sl = 0;
+        return;
+    }
+    int log2 = 63 - __builtin_clzll(size);
+    if (log2 - FL_SHIFT >= FL_COUNT) {
+        // 上限を超える巨大ブロックは最後のクラスにまとめる
+        *fl = FL_COUNT - 1;
+        *sl = SL_COUNT - 1;
+        return;
+    }
+    *fl = log2 - FL_SHIFT;
+    *sl = (int)((size >> (log2 - SL_SHIFT)) & (SL_COUNT - 1));
+}
+
+static int size_to_fl(size_t size) {
+    int fl, sl;
+    size_to_class(size, &fl, &sl);
+    return fl;
+}
+
+// 確保・解放を数える
+static void usage_alloc(usage_t* usage, size_t requested, size_t block_size) {
+    usage->requested += requested;
+    usage->allocated += block_size;
+    usage->in_use += block_size;
+    usage->allocs[size_to_fl(block_size)]++;
+}
+
+static void usage_free(usage_t* usage, size_t block_size) {
+    usage->in_use -= block_size;
+    usage->frees[size_to_fl(block_size)]++;
+}
+
+// 使用量と OS から取っている量の最大を更新する（heap.lock を保持して呼ぶ）
+// tcache の確保がまだ足し込まれていないと in_use は一時的に負になるので、符号付きで比べる。
+static void record_peaks(void) {
+    if ((ptrdiff_t)heap.usage.in_use > (ptrdiff_t)heap.peak_in_use) heap.peak_in_use = heap.usage.in_use;
+    size_t reserved = heap.total_size + heap.mmap_size + heap.theap_size + heap.buddy_size;
+    if (reserved > heap.peak_reserved) heap.peak_reserved = reserved;
+}
+
+// 中央ヒープや mmap から直接渡した確保を数える（heap.lock を保持して呼ぶ）
+static void count_alloc(size_t requested, block_t* block) {
+    usage_alloc(&heap.usage, requested, SIZE(block));
+    record_peaks();
+}
+
+// tcache で数えた回数のうち、ブロックサイズ idx * ALIGNMENT の分を heap.usage へ
+// 足し込む（heap.lock を保持して呼ぶ）。他のサイズの分はそのサイズの補充・返却のときか、
+// tcache_merge_all のときに足し込む。
+static void tcache_merge_usage(tcache_t* tc, size_t idx) {
+    size_t size = idx * ALIGNMENT;
+    int fl = size_to_fl(size);
+    heap.usage.requested += tc->requested;
+    heap.usage.allocated += size * tc->allocs[idx];
+    heap.usage.in_use += size * (tc->allocs[idx] - tc->frees[idx]); // 差分は負にもなる
+    heap.usage.allocs[fl] += tc->allocs[idx];
+    heap.usage.frees[fl] += tc->frees[idx];
+    tc->requested = 0;
+    tc->allocs[idx] = 0;
+    tc->frees[idx] = 0;
+}
+
+static void tcache_merge_all(tcache_t* tc) {
+    for (size_t idx = 0; idx < TCACHE_USAGE_BINS; idx++) {
+        tcache_merge_usage(tc, idx);
+    }
+    record_peaks();
+}
+
+// 木の回転（root はそのサイズクラスの根へのポインタ）
+static void tree_rotate_left(block_t** root, block_t* x) {
+    block_t* y = TREE_RIGHT(x);
+    TREE_RIGHT(x) = TREE_LEFT(y);
+    if (TREE_LEFT(y)) TREE_PARENT(TREE_LEFT(y)) = x;
+    TREE_PARENT(y) = TREE_PARENT(x);
+    if (TREE_PARENT(x) == NULL) {
+        *root = y;
+    } else if (x == TREE_LEFT(TREE_PARENT(x))) {
+        TREE_LEFT(TREE_PARENT(x)) = y;
+    } else {
+        TREE_RIGHT(TREE_PARENT(x)) = y;
+    }
+    TREE_LEFT(y) = x;
+    TREE_PARENT(x) = y;
+}
+
+static void tree_rotate_right(block_t** root, block_t* x) {
+    block_t* y = TREE_LEFT(x);
+    TREE_LEFT(x) = TREE_RIGHT(y);
+    if (TREE_RIGHT(y)) TREE_PARENT(TREE_RIGHT(y)) = x;
+    TREE_PARENT(y) = TREE_PARENT(x);
+    if (TREE_PARENT(x) == NULL) {
+        *root = y;
+    } else if (x == TREE_RIGHT(TREE_PARENT(x))) {
+        TREE_RIGHT(TREE_PARENT(x)) = y;
+    } else {
+        TREE_LEFT(TREE_PARENT(x)) = y;
+    }
+    TREE_RIGHT(y) = x;
+    TREE_PARENT(x) = y;
+}
+
+// 木に挿入する。同じサイズのブロックより左（先に選ばれる側）に入れる。
+static void tree_insert(block_t** root, block_t* block) {
+    block_t* parent = NULL;
+    block_t** link = root;
+    while (*link) {
+        parent = *link;
+        link = SIZE(block) <= SIZE(parent) ? &TREE_LEFT(parent) : &TREE_RIGHT(parent);
+    }
+    TREE_PARENT(block) = parent;
+    TREE_LEFT(block) = NULL;
+    TREE_RIGHT(block) = NULL;
+    TREE_RED(block) = true;
+    *link = block;
+
+    // 赤が連続しないように色を塗り替え・回転する
+    block_t* p;
+    while ((p = TREE_PARENT(block)) != NULL && TREE_RED(p)) {
+        block_t* g = TREE_PARENT(p); // p が赤なら根ではないので祖父がいる
+        if (p == TREE_LEFT(g)) {
+            block_t* uncle = TREE_RIGHT(g);
+            if (uncle && TREE_RED(uncle)) {
+                TREE_RED(p) = false;
+                TREE_RED(uncle) = false;
+                TREE_RED(g) = true;
+                block = g;
+            } else {
+                if (block == TREE_RIGHT(p)) {
+                    block = p;
+                    tree_rotate_left(root, block);
+                    p = TREE_PARENT(block);
+                }
+                TREE_RED(p) = false;
+                TREE_RED(g) = true;
+                tree_rotate_right(root, g);
+            }
+        } else {
+            block_t* uncle = TREE_LEFT(g);
+            if (uncle && TREE_RED(uncle)) {
+                TREE_RED(p) = false;
+                TREE_RED(uncle) = false;
+                TREE_RED(g) = true;
+                block = g;
+            } else {
+                if (block == TREE_LEFT(p)) {
+                    block = p;
+                    tree_rotate_right(root, block);
+                    p = TREE_PARENT(block);
+                }
+                TREE_RED(p) = false;
+                TREE_RED(g) = true;
+                tree_rotate_left(root, g);
+            }
+        }
+    }
+    TREE_RED(*root) = false;
+}
+
+// u の位置を v（NULL でもよい）で置き換える
+static void tree_transplant(block_t** root, block_t* u, block_t* v) {
+    if (TREE_PARENT(u) == NULL) {
+        *root = v;
+    } else if (u == TREE_LEFT(TREE_PARENT(u))) {
+        TREE_LEFT(TREE_PARENT(u)) = v;
+    } else {
+        TREE_RIGHT(TREE_PARENT(u)) = v;
+    }
+    if (v) TREE_PARENT(v) = TREE_PARENT(u);
+}
+
+static bool tree_is_black(block_t* block) {
+    return block == NULL || !TREE_RED(block);
+}
+
+// 黒いノードが抜けた x の側（x は NULL のこともあるので親も渡す）の黒の数を戻す
+static void tree_erase_fixup(block_t** root, block_t* x, block_t* parent) {
+    while (x != *root && tree_is_black(x)) {
+        if (x == TREE_LEFT(parent)) {
+            block_t* w = TREE_RIGHT(parent);
+            if (TREE_RED(w)) {
+                TREE_RED(w) = false;
+                TREE_RED(parent) = true;
+                tree_rotate_left(root, parent);
+                w = TREE_RIGHT(parent);
+            }
+            if (tree_is_black(TREE_LEFT(w)) && tree_is_black(TREE_RIGHT(w))) {
+                TREE_RED(w) = true;
+                x = parent;
+                parent = TREE_PARENT(x);
+            } else {
+                if (tree_is_black(TREE_RIGHT(w))) {
+                    TREE_RED(TREE_LEFT(w)) = false;
+                    TREE_RED(w) = true;
+                    tree_rotate_right(root, w);
+                    w = TREE_RIGHT(parent);
+                }
+                TREE_RED(w) = TREE_RED(parent);
+                TREE_RED(parent) = false;
+                TREE_RED(TREE_RIGHT(w)) = false;
+                tree_rotate_left(root, parent);
+                x = *root;
+            }
+        } else {
+            block_t* w = TREE_LEFT(parent);
+            if (TREE_RED(w)) {
+                TREE_RED(w) = false;
+                TREE_RED(parent) = true;
+                tree_rotate_right(root, parent);
+                w = TREE_LEFT(parent);
+            }
+            if (tree_is_black(TREE_LEFT(w)) && tree_is_black(TREE_RIGHT(w))) {
+                TREE_RED(w) = true;
+                x = parent;
+                parent = TREE_PARENT(x);
+            } else {
+                if (tree_is_black(TREE_LEFT(w))) {
+                    TREE_RED(TREE_RIGHT(w)) = false;
+                    TREE_RED(w) = true;
+                    tree_rotate_left(root, w);
+                    w = TREE_LEFT(parent);
+                }
+                TREE_RED(w) = TREE_RED(parent);
+                TREE_RED(parent) = false;
+                TREE_RED(TREE_LEFT(w)) = false;
+                tree_rotate_right(root, parent);
+                x = *root;
+            }
+        }
+    }
+    if (x) TREE_RED(x) = false;
+}
+
+static block_t* tree_first(block_t* node) {
+    if (node == NULL) return NULL;
+    while (TREE_LEFT(node)) node = TREE_LEFT(node);
+    return node;
+}
+
+// 中間順で次のブロック（表示や統計で木をなめるとき用）
+static block_t* tree_next(block_t* node) {
+    if (TREE_RIGHT(node)) return tree_first(TREE_RIGHT(node));
+    block_t* parent = TREE_PARENT(node);
+    while (parent && node == TREE_RIGHT(parent)) {
+        node = parent;
+        parent = TREE_PARENT(node);
+    }
+    return parent;
+}
+
+static void tree_erase(block_t** root, block_t* z) {
+    block_t* x;
+    block_t* x_parent;
+    bool removed_red = TREE_RED(z);
+
+    if (TREE_LEFT(z) == NULL) {
+        x = TREE_RIGHT(z);
+        x_parent = TREE_PARENT(z);
+        tree_transplant(root, z, x);
+    } else if (TREE_RIGHT(z) == NULL) {
+        x = TREE_LEFT(z);
+        x_parent = TREE_PARENT(z);
+        tree_transplant(root, z, x);
+    } else {
+        // 子が2つなら、右部分木の最小ブロック y を z の位置へ移す
+        block_t* y = tree_first(TREE_RIGHT(z));
+        removed_red = TREE_RED(y);
+        x = TREE_RIGHT(y);
+        if (TREE_PARENT(y) == z) {
+            x_parent = y;
+        } else {
+            x_parent = TREE_PARENT(y);
+            tree_transplant(root, y, x);
+            TREE_RIGHT(y) = TREE_RIGHT(z);
+            TREE_PARENT(TREE_RIGHT(y)) = y;
+        }
+        tree_transplant(root, z, y);
+        TREE_LEFT(y) = TREE_LEFT(z);
+        TREE_PARENT(TREE_LEFT(y)) = y;
+        TREE_RED(y) = TREE_RED(z);
+    }
+    if (!removed_red) {
+        tree_erase_fixup(root, x, x_parent);
+    }
+}
+
+// サイズクラスの中の空きブロックを順にたどる（リストなら先頭から、木なら小さい順）
+static block_t* bin_first(block_t* head) {
+    if (head == NULL || SIZE(head) < LIST_CLASS_LIMIT) return head;
+    return tree_first(head);
+}
+
+static block_t* bin_next(block_t* block) {
+    if (SIZE(block) < LIST_CLASS_LIMIT) return NODE(block)->next;
+    return tree_next(block);
+}
+
+// ファーストフィットとネクストフィット用の、空きブロックのアドレス順の索引
+// 最小ブロック（32 バイト）の data は next/prev とフッタで埋まり、アドレス順のリンクを
+// 足す場所がないので、空きブロックへのポインタをアドレスの昇順に並べた配列を別に持つ。
+// 挿入と削除は二分探索と memmove で、アドレス順の空きリストで挿入位置を探すのと同じく
+// 空きブロック数に比例するが、探すときは使用中のブロックを飛ばして空きだけを見られる。
+// first-fit か next-fit を選んでいる間だけ作り、insert_free_block と remove_free_block で
+// 保つ（heap.lock を保持して操作する）。
+#define FREE_ORDER_REGION_SIZE ((size_t)16 << 30) // アドレス空間だけ予約する
+#define FREE_ORDER_CAPACITY (FREE_ORDER_REGION_SIZE / sizeof(block_t*))
+
+static block_t** free_order; // NULL なら索引を作っていない
+static size_t free_order_count;
+
+// アドレスが block 以上の最初の位置
+static size_t free_order_lower_bound(const block_t* block) {
+    size_t lo = 0, hi = free_order_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((uintptr_t)free_order[mid] < (uintptr_t)block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void free_order_insert(block_t* block) {
+    assert(free_order_count < FREE_ORDER_CAPACITY);
+    size_t i = free_order_lower_bound(block);
+    memmove(&free_order[i + 1], &free_order[i], (free_order_count - i) * sizeof(block_t*));
+    free_order[i] = block;
+    free_order_count++;
+}
+
+static void free_order_remove(block_t* block) {
+    size_t i = free_order_lower_bound(block);
+    assert(i < free_order_count && free_order[i] == block);
+    free_order_count--;
+    memmove(&free_order[i], &free_order[i + 1], (free_order_count - i) * sizeof(block_t*));
+}
+
+// 各領域のブロックをたどって空きブロックを集め、索引を作る
+static bool free_order_build(void) {
+    if (free_order) return true;
+    void* memory = mmap(NULL, FREE_ORDER_REGION_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED) return false;
+    heap.mmap_calls++;
+    free_order = memory;
+    for (char* segment = heap.segments; segment; segment = *(char**)segment) {
+        block_t* block = (block_t*)(segment + PROLOGUE_SIZE);
+        for (; SIZE(block) != 0; block = NEXT_BLOCK(block)) {
+            if (HAS_FLAG(block, BLOCK_FREE)) free_order_insert(block);
+        }
+    }
+    return true;
+}
+
+static void free_order_drop(void) {
+    if (free_order == NULL) return;
+    munmap(free_order, FREE_ORDER_REGION_SIZE);
+    heap.munmap_calls++;
+    free_order = NULL;
+    free_order_count = 0;
+}
+
+// 空きブロックを対応するサイズクラスに追加する。
+// 空きのフラグとフッタ、直後のブロックの BLOCK_PREV_FREE もここで書く。
+static void insert_free_block(block_t* block) {
+    size_t size = SIZE(block);
+    int fl, sl;
+    size_to_class(size, &fl, &sl);
+    block_t** bin = &heap.bins[fl * SL_COUNT + sl];
+
+    SET_FLAG(block, BLOCK_FREE);
+    FOOTER(block) = size;
+    heap.free_size += size;
+    heap.free_blocks[fl]++;
+    SET_FLAG(NEXT_BLOCK(block), BLOCK_PREV_FREE);
+    if (size < LIST_CLASS_LIMIT) {
+        NODE(block)->prev = NULL;
+        NODE(block)->next = *bin;
+        if (*bin) {
+            NODE(*bin)->prev = block;
+        }
+        *bin = block;
+    } else {
+        tree_insert(bin, block);
+    }
+    if (free_order) free_order_insert(block);
+
+    heap.fl_bitmap |= 1u << fl;
+    heap.sl_bitmap[fl] |= 1u << sl;
+}
+
+// 空きブロックをサイズクラスから外し、使用中の扱いに戻す
+static void remove_free_block(block_t* block) {
+    size_t size = SIZE(block);
+    int fl, sl;
+    size_to_class(size, &fl, &sl);
+    block_t** bin = &heap.bins[fl * SL_COUNT + sl];
+
+    if (size < LIST_CLASS_LIMIT) {
+        free_node_t* node = NODE(block);
+        if (node->prev) {
+            NODE(node->prev)->next = node->next;
+        } else {
+            *bin = node->next;
+        }
+        if (node->next) {
+            NODE(node->next)->prev = node->prev;
+        }
+        node->next = NULL;
+        node->prev = NULL;
+    } else {
+        tree_erase(bin, block);
+        memset(NODE(block), 0, sizeof(free_node_t));
+    }
+    if (free_order) free_order_remove(block);
+    // リンクは上で消したので、フッタも消せば BLOCK_FRESH のブロックは全体が 0 に戻る
+    if (HAS_FLAG(block, BLOCK_FRESH)) {
+        FOOTER(block) = 0;
+    }
+    CLEAR_FLAG(block, BLOCK_FREE);
+    CLEAR_FLAG(NEXT_BLOCK(block), BLOCK_PREV_FREE);
+    heap.free_size -= size;
+    heap.free_blocks[fl]--;
+
+    // クラスが空になったらビットを落とす
+    if (*bin == NULL) {
+        heap.sl_bitmap[fl] &= ~(1u << sl);
+        if (heap.sl_bitmap[fl] == 0) {
+            heap.fl_bitmap &= ~(1u << fl);
+        }
+    }
+}
+
+block_t* coalesce_blocks(block_t* block);
+
+// 領域の終端（heap.heap_end の直前）にエピローグ（サイズ0の使用中ブロック）を書く
+static void write_epilogue(void) {
+    block_t* epilogue = (block_t*)(heap.heap_end - EPILOGUE_SIZE);
+    epilogue->header = 0;
+}
+
+// OSから取得した領域をヒープに組み込む（heap.lock を保持して呼ぶ）
+// 領域の先頭の1ワード（プロローグ）には1つ前の領域へのポインタを書き、
+// print_memory_stats が全ブロックをたどれるようにする。最初のブロックは
+// BLOCK_PREV_FREE を持たないので、統合が領域の前へはみ出すことはない。
+// 末尾にはサイズ0の使用中ブロック（エピローグ）を置く。
+// 前回の領域の直後に続いている場合は、前回のエピローグを新しいブロックの先頭として
+// 再利用し、末尾の空きブロックとも統合する。
+// 戻り値はどの空きリストにも入っていない空きブロック。
+static block_t* add_segment(char* memory, size_t size) {
+    block_t* block;
+    if (memory == heap.heap_end) {
+        block = (block_t*)(memory - EPILOGUE_SIZE);
+        block->header = size | (block->header & BLOCK_PREV_FREE);
+    } else {
+        *(char**)memory = heap.segments;
+        heap.segments = memory;
+        block = (block_t*)(memory + PROLOGUE_SIZE);
+        block->header = size - SEGMENT_OVERHEAD;
+    }
+    heap.heap_end = memory + size;
+    heap.total_size += size;
+    record_peaks();
+    write_epilogue();
+
+    SET_FLAG(block, BLOCK_FRESH); // sbrk で増えた領域は 0 で埋まっている
+    return coalesce_blocks(block);
+}
+
+// sbrk で size バイト伸ばし、伸ばした領域の先頭を返す。
+// 他の誰かが brk を半端な量だけ動かしていたら、先頭が ALIGNMENT 境界に来るよう詰め物をする。
+static void* heap_sbrk(size_t size) {
+    size_t pad = -(uintptr_t)sbrk(0) & (ALIGNMENT - 1);
+    if (pad && sbrk(pad) == (void*)-1) return (void*)-1;
+    return sbrk(size);
+}
+
+// 最適な空きブロックを探す（ベストフィット法）
+// 要求サイズと同じクラスがリストなら、中のブロックはすべて同じサイズなので先頭を返す。
+// 木なら、下って要求以上で最小のブロックを O(log n) で探す。
+// そこで見つからなければ、ビットマップで次に空きのあるクラスを O(1) で選び、
+// その中の最小のブロックを返す（上位クラスのブロックはすべて要求を満たす）。
+block_t* find_best_fit(size_t size) {
+    int fl, sl;
+    size_to_class(size, &fl, &sl);
+
+    block_t* current = heap.bins[fl * SL_COUNT + sl];
+    block_t* best_fit = NULL;
+    heap.fit_steps++;
+    if (size < LIST_CLASS_LIMIT) {
+        best_fit = current;
+    } else {
+        while (current != NULL) {
+            heap.fit_steps++;
+            if (SIZE(current) >= size) {
+                best_fit = current; // 候補。もっと小さいものを左で探す
+                current = TREE_LEFT(current);
+            } else {
+                current = TREE_RIGHT(current);
+            }
+        }
+    }
+    if (best_fit) return best_fit;
+
+    // 同じ第1段階の、より大きい第2段階クラス
+    uint32_t sl_map = heap.sl_bitmap[fl] & (~0u << (sl + 1));
+    if (sl_map == 0) {
+        // より大きい第1段階クラス
+        uint32_t fl_map = (fl + 1 < FL_COUNT) ? heap.fl_bitmap & (~0u << (fl + 1)) : 0;
+        if (fl_map == 0) return NULL;
+        fl = __builtin_ctz(fl_map);
+        sl_map = heap.sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+
+    return bin_first(heap.bins[fl * SL_COUNT + sl]);
+}
+
+// アドレスの低い空きブロックから順に見て、最初に収まるものを返す（ファーストフィット法）
+// 索引（free_order）をたどるので、調べるのは空きブロックだけ。
+static block_t* find_first_fit(size_t size) {
+    for (size_t i = 0; i < free_order_count; i++) {
+        heap.fit_steps++;
+        if (SIZE(free_order[i]) >= size) return free_order[i];
+    }
+    return NULL;
+}
+
+// 前回見つけたブロック（heap.rover）のアドレスから見始める（ネクストフィット法）
+// 末尾まで見たら先頭に戻り、rover の手前までを見る。rover は位置の目印なので、
+// 使用中になっていてもよい。統合で消えるときは coalesce_blocks と resize_block が
+// 統合先に付け替える（同じ空きブロックから続けて切り出せるように）。
+static block_t* find_next_fit(size_t size) {
+    size_t start = heap.rover ? free_order_lower_bound(heap.rover) : 0;
+    for (size_t n = 0; n < free_order_count; n++) {
+        size_t i = start + n < free_order_count ? start + n : start + n - free_order_count;
+        heap.fit_steps++;
+        if (SIZE(free_order[i]) >= size) return heap.rover = free_order[i];
+    }
+    return NULL;
+}
+
+// 最大の空きブロックを返す（ワーストフィット法）
+// 残りが大きくなるので、細かい断片は残りにくいが大きいブロックが早く崩れる。
+static block_t* find_worst_fit(size_t size) {
+    heap.fit_steps++;
+    if (heap.fl_bitmap == 0) return NULL;
+    int fl = 31 - __builtin_clz(heap.fl_bitmap);
+    int sl = 31 - __builtin_clz(heap.sl_bitmap[fl]);
+    block_t* block = heap.bins[fl * SL_COUNT + sl];
+    if (SIZE(block) >= LIST_CLASS_LIMIT) {
+        while (TREE_RIGHT(block)) {
+            heap.fit_steps++;
+            block = TREE_RIGHT(block);
+        }
+    }
+    return SIZE(block) >= size ? block : NULL;
+}
+
+// 空きブロックの選び方（custom_mallopt(CM_FIT_POLICY, CM_FIT_*) で切り替える）
+// find は中央ヒープの空きブロックから total_size 以上のものを選ぶ（なければ NULL）。
+// 見つけたブロックを外して分割する処理は、どの方式でも heap_alloc_block が行う。
+typedef struct {
+    const char* name;
+    block_t* (*find)(size_t size);
+    bool buddy; // true なら中央ヒープの代わりにバディ領域から確保する（入らないものは find で）
+    bool address_order; // true なら空きブロックのアドレス順の索引を使う
+} fit_policy_t;
+
+static const fit_policy_t fit_policies[] = {
+    [CM_FIT_BEST] = {"best-fit", find_best_fit, false, false},
+    [CM_FIT_FIRST] = {"first-fit", find_first_fit, false, true},
+    [CM_FIT_NEXT] = {"next-fit", find_next_fit, false, true},
+    [CM_FIT_WORST] = {"worst-fit", find_worst_fit, false, false},
+    [CM_FIT_BUDDY] = {"buddy", find_best_fit, true, false},
+};
+
+// ブロックを分割する関数
+// block は空きリストから外された状態で渡される。残りは空きブロックとして
+// 対応するサイズクラスに登録する。
+void split_block(block_t* block, size_t size) {
+    size_t remaining_size = SIZE(block) - size;
+    
+    // 残りサイズが新しいブロックとして十分な場合のみ分割
+    if (remaining_size >= MIN_BLOCK_SIZE) {
+        block_t* new_block = (block_t*)((char*)block + size);
+        new_block->header = remaining_size | (block->header & BLOCK_FRESH);
+        SET_SIZE(block, size);
+        insert_free_block(new_block);
+    }
+}
+
+// 要求バイト数から、ヘッダを含めたブロック全体のサイズを求める
+static size_t block_size_for(size_t size) {
+    size_t total_size = ALIGN(size + BLOCK_SIZE);
+    return total_size < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : total_size;
+}
+
+static size_t page_size(void) {
+    static size_t size = 0;
+    if (size == 0) size = (size_t)sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+// 負の sbrk で縮めたあとだと、brk のあるページの残りには以前の中身が残っている。
+// 新しい領域は 0 のはず（BLOCK_FRESH）なので、そこだけ消しておく。
+static void clear_stale_page(char* memory, size_t size) {
+    size_t stale = -(uintptr_t)memory & (page_size() - 1);
+    memset(memory, 0, stale < size ? stale : size);
+}
+
+// sbrk でヒープを少なくとも total_size 分伸ばす（heap.lock を保持して呼ぶ）
+// 戻り値はどの空きリストにも入っていない空きブロック
+static block_t* extend_heap(size_t total_size) {
+    size_t request_size = ALIGN(total_size + SEGMENT_OVERHEAD);
+    if (request_size < 4096) request_size = 4096;
+    void* memory = heap_sbrk(request_size);
+    if (memory == (void*)-1) {
+        return NULL;
+    }
+    clear_stale_page(memory, request_size);
+    heap.sbrk_calls++;
+    return add_segment(memory, request_size);
+}
+
+// 領域を先に割り当てておく（ページフォルトを初期化のときに済ませる）
+// MADV_POPULATE_WRITE（Linux 5.14 以降）がなければ、ページごとに1バイト書く。
+static void populate(char* memory, size_t size, size_t page) {
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(memory, size, MADV_POPULATE_WRITE) == 0) return;
+#endif
+    for (size_t offset = 0; offset < size; offset += page) {
+        ((volatile char*)memory)[offset] = 0;
+    }
+}
+
+// ヒープ用の領域を mmap で予約する（init_heap_with から呼ぶ）
+// CM_HEAP_HUGETLB なら予約済みの huge page（/proc/sys/vm/nr_hugepages）を試し、
+// 取れなければ THP にする。THP のときは 2 MiB 境界に揃え、madvise(MADV_HUGEPAGE) してから
+// 割り当てる（MAP_POPULATE で先に割り当てると 4 KiB ページになる）。
+static char* heap_mmap(size_t* size, int flags) {
+    if (flags & CM_HEAP_HUGETLB) {
+#ifdef MAP_HUGETLB
+        size_t length = (*size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+        int populate_flag = (flags & CM_HEAP_POPULATE) ? MAP_POPULATE : 0;
+        char* memory = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate_flag, -1, 0);
+        if (memory != MAP_FAILED) {
+            *size = length;
+            return memory;
+        }
+#endif
+        flags |= CM_HEAP_HUGEPAGE;
+    }
+
+    if (!(flags & CM_HEAP_HUGEPAGE)) {
+        size_t length = (*size + page_size() - 1) & ~(page_size() - 1);
+        int populate_flag = (flags & CM_HEAP_POPULATE) ? MAP_POPULATE : 0;
+        char* memory = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | populate_flag, -1, 0);
+        if (memory == MAP_FAILED) return NULL;
+        *size = length;
+        return memory;
+    }
+
+    // 2 MiB 余分に予約して、境界に揃えた残りを使う
+    size_t length = (*size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+    char* memory = mmap(NULL, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return NULL;
+    char* start = (char*)(((uintptr_t)memory + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (start > memory) munmap(memory, start - memory);
+    munmap(start + length, memory + HUGE_PAGE_SIZE - start);
+    madvise(start, length, MADV_HUGEPAGE);
+    if (flags & CM_HEAP_POPULATE) populate(start, length, HUGE_PAGE_SIZE);
+    *size = length;
+    return start;
+}
+
+// ヒープの初期化関数
+// flags が 0 なら sbrk で伸ばすだけ（ページは使うときに割り当てられる）。
+// CM_HEAP_MMAP / CM_HEAP_HUGEPAGE / CM_HEAP_HUGETLB なら mmap で initial_size を予約し、
+// 足りなくなった分は従来どおり sbrk で別の領域として足す。
+// CM_HEAP_POPULATE を付けると、ページフォルトを初期化のときに済ませる。
+// 呼ばなくても最初の確保で extend_heap がヒープを作るので、init_heap より前の
+// 確保（LD_PRELOAD で差し込んだときの動的リンカや libc の初期化など）もそのまま動く。
+void init_heap_with(size_t initial_size, int flags) {
+    initial_size = ALIGN(initial_size); // サイズをアラインメントに合わせる
+    
+    // OSからメモリを要求
+    char* memory;
+    if (flags & (CM_HEAP_MMAP | CM_HEAP_HUGEPAGE | CM_HEAP_HUGETLB)) {
+        memory = heap_mmap(&initial_size, flags);
+        if (memory == NULL) {
+            perror("Failed to initialize heap");
+            return;
+        }
+    } else {
+        memory = heap_sbrk(initial_size);
+        if (memory == (void*)-1) {
+            perror("Failed to initialize heap"); // メモリ確保失敗時のエラー表示
+            return;
+        }
+        clear_stale_page(memory, initial_size);
+        if (flags & CM_HEAP_POPULATE) populate(memory, initial_size, page_size());
+    }
+    
+    // ヒープ構造体の初期化
+    pthread_mutex_lock(&heap.lock);
+    if (flags & (CM_HEAP_MMAP | CM_HEAP_HUGEPAGE | CM_HEAP_HUGETLB)) {
+        heap.mmap_calls++;
+    } else {
+        heap.sbrk_calls++;
+    }
+    block_t* initial_block = add_segment(memory, initial_size); // 最初のブロック
+    insert_free_block(initial_block); // 空きリストに登録
+    pthread_mutex_unlock(&heap.lock);
+}
+
+// 以前と同じく、sbrk で伸ばして全ページを先に割り当てる
+void init_heap(size_t initial_size) {
+    init_heap_with(initial_size, CM_HEAP_POPULATE);
+}
+
+// ---- バディ方式（custom_mallopt(CM_FIT_POLICY, CM_FIT_BUDDY) で有効にする） ----
+// 予約した領域から BUDDY_CHUNK_SIZE のチャンクを切り出し、要求を2のべき乗に切り上げた
+// 大きさになるまで半分に割っていく。割った片割れ（バディ）のアドレスは、原点からの
+// オフセットとサイズの XOR で求まるので、解放時はバディが同じ大きさで空いている間だけ
+// 統合を繰り返す（境界タグは要らない）。その代わり切り上げの分だけ内部断片化が増える。
+// ブロックの形式はヘッダ1ワードで中央ヒープと同じ。data を ALIGNMENT 境界に揃えるため、
+// 原点は領域の先頭から PROLOGUE_SIZE ずらしてある（最後のチャンクがはみ出す分も予約に含める）。
+// チャンクより大きいものと、整列を指定した確保は中央ヒープから取る。
+// 切り出したチャンクは OS にも中央ヒープにも返さない（スレッドヒープと同じ）。
+#define BUDDY_CHUNK_SIZE ((size_t)1 << BUDDY_MAX_ORDER)
+#define BUDDY_REGION_SIZE ((size_t)16 << 30) // アドレス空間だけ予約する
+
+_Static_assert(MIN_BLOCK_SIZE == (1 << BUDDY_MIN_ORDER), "最小の次数は最小ブロックと同じ");
+
+static char* buddy_origin;     // オフセットの原点（heap.lock を保持して操作する）
+static char* buddy_region_end;
+static char* buddy_next_chunk; // 次に切り出すチャンク
+
+// ブロックがバディ領域にあるか
+static bool buddy_owns(block_t* block) {
+    return (char*)block >= buddy_origin && (char*)block < buddy_region_end;
+}
+
+// バディ領域を予約する（heap.lock を保持して呼ぶ）
+static bool buddy_reserve(void) {
+    if (buddy_origin) return true;
+    size_t length = BUDDY_REGION_SIZE + page_size();
+    char* memory = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED) return false;
+    heap.mmap_calls++;
+    buddy_next_chunk = memory + PROLOGUE_SIZE;
+    buddy_region_end = memory + length;
+    buddy_origin = buddy_next_chunk;
+    return true;
+}
+
+// 次数 order の空きリストの先頭に入れる
+static void buddy_push(block_t* block, int order) {
+    size_t size = (size_t)1 << order;
+    block_t** bin = &heap.buddy_bins[order - BUDDY_MIN_ORDER];
+    block->header = size | BLOCK_FREE;
+    NODE(block)->next = *bin;
+    NODE(block)->prev = NULL;
+    if (*bin) NODE(*bin)->prev = block;
+    *bin = block;
+    heap.buddy_bitmap |= 1u << (order - BUDDY_MIN_ORDER);
+    heap.buddy_free += size;
+    heap.free_blocks[size_to_fl(size)]++;
+}
+
+static void buddy_remove(block_t* block, int order) {
+    size_t size = (size_t)1 << order;
+    block_t** bin = &heap.buddy_bins[order - BUDDY_MIN_ORDER];
+    if (NODE(block)->prev) {
+        NODE(NODE(block)->prev)->next = NODE(block)->next;
+    } else {
+        *bin = NODE(block)->next;
+    }
+    if (NODE(block)->next) NODE(NODE(block)->next)->prev = NODE(block)->prev;
+    block->header = size;
+    if (*bin == NULL) heap.buddy_bitmap &= ~(1u << (order - BUDDY_MIN_ORDER));
+    heap.buddy_free -= size;
+    heap.free_blocks[size_to_fl(size)]--;
+}
+
+// 2のべき乗に切り上げたブロックを確保する（heap.lock を保持して呼ぶ）
+// チャンクより大きいか、予約した領域を使い切ったら NULL
+static block_t* buddy_alloc_block(size_t total_size) {
+    if (total_size > BUDDY_CHUNK_SIZE) return NULL;
+    int order = total_size <= MIN_BLOCK_SIZE ? BUDDY_MIN_ORDER : 64 - __builtin_clzll(total_size - 1);
+
+    // 空きのある最小の次数はビットマップで O(1) で見つかる
+    heap.fit_searches++;
+    heap.fit_steps++;
+    uint32_t map = heap.buddy_bitmap & (~0u << (order - BUDDY_MIN_ORDER));
+    block_t* block;
+    int have;
+    if (map) {
+        have = __builtin_ctz(map) + BUDDY_MIN_ORDER;
+        block = heap.buddy_bins[have - BUDDY_MIN_ORDER];
+        buddy_remove(block, have);
+    } else {
+        if (buddy_region_end - buddy_next_chunk < (ptrdiff_t)BUDDY_CHUNK_SIZE) return NULL;
+        block = (block_t*)buddy_next_chunk;
+        buddy_next_chunk += BUDDY_CHUNK_SIZE;
+        heap.buddy_size += BUDDY_CHUNK_SIZE;
+        record_peaks();
+        have = BUDDY_MAX_ORDER;
+    }
+    // 後ろ半分を空きにしながら割っていく
+    while (have > order) {
+        have--;
+        buddy_push((block_t*)((char*)block + ((size_t)1 << have)), have);
+    }
+    block->header = (size_t)1 << order;
+    return block;
+}
+
+// バディが同じ大きさで空いている間、統合して次数を上げる（heap.lock を保持して呼ぶ）
+static void buddy_free_block(block_t* block) {
+    size_t size = SIZE(block);
+    int order = __builtin_ctzll(size);
+    while (order < BUDDY_MAX_ORDER) {
+        block_t* buddy = (block_t*)(buddy_origin + (((char*)block - buddy_origin) ^ size));
+        if (buddy->header != (size | BLOCK_FREE)) break;
+        buddy_remove(buddy, order);
+        if (buddy < block) block = buddy;
+        size <<= 1;
+        order++;
+    }
+    buddy_push(block, order);
+}
+
+// バディ領域の最大の空きブロック
+static size_t buddy_largest_free(void) {
+    if (heap.buddy_bitmap == 0) return 0;
+    return (size_t)1 << (31 - __builtin_clz(heap.buddy_bitmap) + BUDDY_MIN_ORDER);
+}
+
+// 中央ヒープからブロックを確保する（heap.lock を保持して呼ぶ）
+// 空きブロックの選び方は heap.fit_policy による。
+static block_t* heap_alloc_block(size_t total_size) {
+    heap.fit_searches++;
+    block_t* block = fit_policies[heap.fit_policy].find(total_size);
+
+    if (block != NULL) {
+        remove_free_block(block);
+    } else {
+        block = extend_heap(total_size);
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+
+    split_block(block, total_size);
+    heap.used_size += SIZE(block);
+
+    return block;
+}
+
+// tcache の補充や中央ヒープからの確保（heap.lock を保持して呼ぶ）
+// バディ方式ならバディ領域から取り、入らないときだけ中央ヒープから取る。
+static block_t* policy_alloc_block(size_t total_size) {
+    if (fit_policies[heap.fit_policy].buddy) {
+        block_t* block = buddy_alloc_block(total_size);
+        if (block) return block;
+    }
+    return heap_alloc_block(total_size);
+}
+
+// ヒープ末尾の空きブロックが trim_threshold を超えたら OS に返す（heap.lock を保持して呼ぶ）
+// brk がまだ自分の領域の終端なら、負の sbrk で縮める。
+// 他の誰か（glibc の malloc など）が後ろに brk を伸ばしていたら縮められないので、
+// ブロック内側のページだけ madvise(MADV_DONTNEED) で捨てて RSS を減らす。
+static void trim_heap_top(block_t* block) {
+    if (NEXT_BLOCK(block) != (block_t*)(heap.heap_end - EPILOGUE_SIZE)) return;
+    if (SIZE(block) < heap.trim_threshold + MIN_BLOCK_SIZE) return;
+
+    size_t page = page_size();
+    if (sbrk(0) == heap.heap_end) {
+        size_t release = (SIZE(block) - MIN_BLOCK_SIZE) & ~(page - 1);
+        if (release == 0) return;
+        // 縮めたあとはエピローグに触れないので、先に空きリストから外す
+        remove_free_block(block);
+        if (sbrk(-(intptr_t)release) == (void*)-1) {
+            insert_free_block(block);
+            return;
+        }
+        heap.sbrk_calls++;
+        SET_SIZE(block, SIZE(block) - release);
+        heap.heap_end -= release;
+        heap.total_size -= release;
+        write_epilogue();
+        insert_free_block(block);
+    } else {
+        // ヘッダとリンク、末尾のフッタは残す
+        uintptr_t start = ((uintptr_t)block->data + sizeof(free_node_t) + page - 1) & ~(page - 1);
+        uintptr_t end = ((uintptr_t)block + SIZE(block) - FOOTER_SIZE) & ~(page - 1);
+        if (end > start) {
+            madvise((void*)start, end - start, MADV_DONTNEED);
+        }
+    }
+}
+
+// 中央ヒープへブロックを返す（heap.lock を保持して呼ぶ）
+// バディ領域のブロックは、方式を切り替えたあとでもバディ領域に返す。
+static void heap_free_block(block_t* block) {
+    if (buddy_owns(block)) {
+        buddy_free_block(block);
+        return;
+    }
+    CLEAR_FLAG(block, BLOCK_FRESH);
+
+    heap.used_size -= SIZE(block);
+
+    // 隣接する空きブロックを統合してからサイズクラスの空きリストに追加
+    block = coalesce_blocks(block);
+    insert_free_block(block);
+    trim_heap_top(block);
+}
+
+// 大きいブロックは sbrk ヒープを通さず、個別に mmap する。
+// 解放時に munmap すればすぐに OS に返るので、巨大なバッファが RSS に居座らない。
+// data を ALIGNMENT 境界に揃えるため、ブロックはマップの先頭から PROLOGUE_SIZE ずらして置く。
+static block_t* mmap_alloc_block(size_t total_size) {
+    size_t page = page_size();
+    size_t length = (PROLOGUE_SIZE + total_size + page - 1) & ~(page - 1);
+    char* memory = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+
+    block_t* block = (block_t*)(memory + PROLOGUE_SIZE);
+    block->header = (length - PROLOGUE_SIZE) | BLOCK_MMAPPED | BLOCK_FRESH;
+
+    pthread_mutex_lock(&heap.lock);
+    heap.mmap_size += SIZE(block);
+    heap.mmap_calls++;
+    record_peaks();
+    pthread_mutex_unlock(&heap.lock);
+    return block;
+}
+
+// mmap したブロックは、マップの先頭ページの途中から始まる。
+// ブロックのサイズはブロックの先頭からマップの終端まで。
+static size_t mmap_offset(block_t* block) {
+    return (uintptr_t)block & (page_size() - 1);
+}
+
+static void mmap_free_block(block_t* block) {
+    pthread_mutex_lock(&heap.lock);
+    heap.mmap_size -= SIZE(block);
+    heap.munmap_calls++;
+    usage_free(&heap.usage, SIZE(block));
+    pthread_mutex_unlock(&heap.lock);
+    size_t offset = mmap_offset(block);
+    munmap((char*)block - offset, SIZE(block) + offset);
+}
+
+// data が alignment 境界に来るよう、余分にマップしてから前後の余りを munmap する
+static block_t* mmap_alloc_aligned(size_t alignment, size_t total_size) {
+    size_t page = page_size();
+    size_t span = (total_size + alignment + page - 1) & ~(page - 1);
+    char* memory = mmap(NULL, span, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+
+    uintptr_t data = ((uintptr_t)memory + BLOCK_SIZE + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    block_t* block = (block_t*)(data - BLOCK_SIZE);
+    char* start = (char*)((uintptr_t)block & ~(uintptr_t)(page - 1));
+    char* end = (char*)(((uintptr_t)block + total_size + page - 1) & ~(uintptr_t)(page - 1));
+    if (start > memory) munmap(memory, start - memory);
+    if (end < memory + span) munmap(end, memory + span - end);
+
+    block->header = (size_t)(end - (char*)block) | BLOCK_MMAPPED | BLOCK_FRESH;
+
+    pthread_mutex_lock(&heap.lock);
+    heap.mmap_size += SIZE(block);
+    heap.mmap_calls++;
+    heap.munmap_calls += (start > memory) + (end < memory + span);
+    record_peaks();
+    pthread_mutex_unlock(&heap.lock);
+    return block;
+}
+
+// スレッド終了時にキャッシュの中身を中央ヒープへ返す
+static void tcache_flush(void* arg) {
+    tcache_t* tc = arg;
+    pthread_mutex_lock(&heap.lock);
+    for (int i = 0; i < TCACHE_BINS; i++) {
+        while (tc->bins[i]) {
+            block_t* block = tc->bins[i];
+            tc->bins[i] = TCACHE_NEXT(block);
+            TCACHE_KEY(block) = 0;
+            heap_free_block(block);
+        }
+        tc->counts[i] = 0;
+    }
+    tcache_merge_all(tc);
+    pthread_mutex_unlock(&heap.lock);
+}
+
+// 呼び出したスレッドのキャッシュを中央ヒープへ返す（統計を取る前などに使う）
+void flush_thread_cache(void) {
+    tcache_flush(&tcache);
+}
+
+static void theap_abandon(void);
+
+// スレッド終了時の後始末
+// 後に呼ばれたデストラクタがまた確保すると登録し直されるので、もう一度呼ばれる。
+static void tcache_release(void* arg) {
+    tcache_flush(arg);
+    theap_abandon();
+    tcache.registered = false;
+}
+
+static void tcache_make_key(void) {
+    pthread_key_create(&tcache_key, tcache_release);
+}
+
+// 初回利用時に、スレッド終了で tcache_flush が呼ばれるよう登録する
+static void tcache_register(void) {
+    if (tcache.registered) return;
+    pthread_once(&tcache_key_once, tcache_make_key);
+    pthread_setspecific(tcache_key, &tcache);
+    tcache.registered = true;
+}
+
+static void tcache_push(size_t idx, block_t* block) {
+    CLEAR_FLAG(block, BLOCK_FRESH); // リンクを data 領域に書くので 0 ではなくなる
+    TCACHE_NEXT(block) = tcache.bins[idx];
+    TCACHE_KEY(block) = TCACHE_ENTRY_KEY;
+    tcache.bins[idx] = block;
+    tcache.counts[idx]++;
+}
+
+// ブロックがこのスレッドのキャッシュに入っているか（二重解放の検出用）
+// キーが一致したときだけ、同じサイズのリストをたどって確かめる。
+static bool tcache_contains(block_t* block) {
+    if (TCACHE_KEY(block) != TCACHE_ENTRY_KEY) return false;
+    size_t idx = SIZE(block) / ALIGNMENT;
+    if (idx >= TCACHE_BINS) return false;
+    for (block_t* cached = tcache.bins[idx]; cached; cached = TCACHE_NEXT(cached)) {
+        if (cached == block) return true;
+    }
+    return false;
+}
+
+// キャッシュが空のとき、中央ヒープから TCACHE_BATCH 個まとめて補充する
+static void tcache_refill(size_t idx, size_t total_size) {
+    tcache_register();
+    pthread_mutex_lock(&heap.lock);
+    for (int i = 0; i < TCACHE_BATCH; i++) {
+        block_t* block = policy_alloc_block(total_size);
+        if (block == NULL) break;
+        tcache_push(idx, block);
+    }
+    tcache_merge_usage(&tcache, idx);
+    record_peaks();
+    pthread_mutex_unlock(&heap.lock);
+}
+
+// キャッシュがあふれたとき、TCACHE_BATCH 個まとめて中央ヒープへ返す
+static void tcache_drain(size_t idx) {
+    pthread_mutex_lock(&heap.lock);
+    for (int i = 0; i < TCACHE_BATCH && tcache.bins[idx]; i++) {
+        block_t* block = tcache.bins[idx];
+        tcache.bins[idx] = TCACHE_NEXT(block);
+        tcache.counts[idx]--;
+        TCACHE_KEY(block) = 0;
+        heap_free_block(block);
+    }
+    tcache_merge_usage(&tcache, idx);
+    record_peaks();
+    pthread_mutex_unlock(&heap.lock);
+}
+
+// ブロックがスレッドヒープのスパンにあるか
+static bool theap_owns(block_t* block) {
+    return (char*)block >= theap_region && (char*)block < theap_region_end;
+}
+
+// スレッドヒープ用の領域を予約する（heap.lock を保持して呼ぶ）
+// MAP_NORESERVE なので、触れたページだけが実際に割り当てられる。
+static bool theap_reserve(void) {
+    if (theap_region) return true;
+    char* memory = mmap(NULL, THEAP_REGION_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED) return false;
+    heap.mmap_calls++;
+    theap_region_next = (char*)(((uintptr_t)memory + THEAP_SPAN_SIZE - 1) & ~(uintptr_t)(THEAP_SPAN_SIZE - 1));
+    theap_region_end = memory + THEAP_REGION_SIZE;
+    theap_region = memory;
+    return true;
+}
+
+// 予約した領域から新しいスパンを取り出す（heap.lock を保持して呼ぶ）
+static char* theap_new_span(void) {
+    if (theap_region_end - theap_region_next < THEAP_SPAN_SIZE) return NULL;
+    char* span = theap_region_next;
+    theap_region_next += THEAP_SPAN_SIZE;
+    heap.theap_size += THEAP_SPAN_SIZE;
+    record_peaks();
+    return span;
+}
+
+// このスレッドにスレッドヒープを割り当てる
+// 終了したスレッドのヒープが残っていれば、中の空きブロックごと引き継ぐ。
+// なければ最初のスパンの先頭にヒープ自体を置く。
+static theap_t* theap_attach(void) {
+    tcache_register();
+    pthread_mutex_lock(&heap.lock);
+    theap_t* th = theap_abandoned;
+    if (th) {
+        theap_abandoned = th->next_abandoned;
+    } else {
+        char* span = theap_new_span();
+        if (span) {
+            th = (theap_t*)(span + ALIGNMENT); // 領域は触れていなければ 0
+            SPAN_OWNER(span) = th;
+            th->bump = (char*)th + ALIGN(sizeof(*th)) + PROLOGUE_SIZE; // data を ALIGNMENT 境界に揃える
+            th->bump_end = span + THEAP_SPAN_SIZE;
+        }
+    }
+    pthread_mutex_unlock(&heap.lock);
+    tcache.theap = th;
+    return th;
+}
+
+// スレッドの終了時に、スレッドヒープを次のスレッドのために残しておく
+static void theap_abandon(void) {
+    theap_t* th = tcache.theap;
+    if (th == NULL) return;
+    tcache.theap = NULL;
+    pthread_mutex_lock(&heap.lock);
+    th->next_abandoned = theap_abandoned;
+    theap_abandoned = th;
+    pthread_mutex_unlock(&heap.lock);
+}
+
+// remote リストを丸ごと取り出して、サイズごとの空きリストに移す
+static void theap_collect(theap_t* th) {
+    block_t* block = __atomic_exchange_n(&th->remote, NULL, __ATOMIC_ACQUIRE);
+    while (block) {
+        block_t* next = TCACHE_NEXT(block);
+        size_t idx = SIZE(block) / ALIGNMENT;
+        TCACHE_NEXT(block) = th->bins[idx];
+        th->bins[idx] = block;
+        block = next;
+    }
+}
+
+// スレッドヒープから total_size のブロックを確保する。予約した領域を使い切ったら NULL
+static block_t* theap_alloc(size_t idx, size_t total_size) {
+    theap_t* th = tcache.theap;
+    if (th == NULL) {
+        th = theap_attach();
+        if (th == NULL) return NULL;
+    }
+
+    block_t* block = th->bins[idx];
+    if (block == NULL && __atomic_load_n(&th->remote, __ATOMIC_RELAXED) != NULL) {
+        theap_collect(th);
+        block = th->bins[idx];
+    }
+    if (block) {
+        th->bins[idx] = TCACHE_NEXT(block);
+        block->header = total_size;
+        return block;
+    }
+
+    // 今のスパンの残り（ブロック1つ分に満たない）は捨てて、次のスパンに移る
+    if (th->bump_end - th->bump < (ptrdiff_t)total_size) {
+        pthread_mutex_lock(&heap.lock);
+        char* span = theap_new_span();
+        pthread_mutex_unlock(&heap.lock);
+        if (span == NULL) return NULL;
+        SPAN_OWNER(span) = th;
+        th->bump = span + PROLOGUE_SIZE;
+        th->bump_end = span + THEAP_SPAN_SIZE;
+    }
+    block = (block_t*)th->bump;
+    th->bump += total_size;
+    block->header = total_size | BLOCK_FRESH;
+    return block;
+}
+
+// スレッドヒープのブロックを持ち主に返す
+// 空きの間は BLOCK_FREE を立てておき、二重解放の検出に使う。
+static void theap_free(block_t* block) {
+    theap_t* owner = SPAN_OWNER(block);
+    block->header = SIZE(block) | BLOCK_FREE;
+    if (owner == tcache.theap) {
+        size_t idx = SIZE(block) / ALIGNMENT;
+        TCACHE_NEXT(block) = owner->bins[idx];
+        owner->bins[idx] = block;
+        return;
+    }
+    block_t* head = __atomic_load_n(&owner->remote, __ATOMIC_RELAXED);
+    do {
+        TCACHE_NEXT(block) = head;
+    } while (!__atomic_compare_exchange_n(&owner->remote, &head, block, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// ---- 共有ヒープ（init_shared_heap で有効にする） ----
+// shm_open した領域を複数のプロセスがマップし、どのプロセスからでも
+// custom_malloc / custom_free できるようにする。マップされるアドレスはプロセスごとに
+// 違いうるので、領域の中にはポインタを置かず、リンクはすべて領域の先頭からの
+// オフセットで持つ（0 は NULL の代わり。先頭には shared_header_t があるので
+// ブロックのオフセットが 0 になることはない）。
+// ブロックの形式（ヘッダ1ワードと空きブロックのフッタ）は中央ヒープと同じなので、
+// NEXT_BLOCK や境界タグでの統合はそのまま使える。空きブロックはサイズクラスごとの
+// 双方向リストに入れ、確保は同じクラスで最初に収まるもの、なければビットマップで
+// 選んだ上のクラスの先頭を取る（上のクラスのブロックはすべて収まる）。
+// 操作は領域に置いた PTHREAD_PROCESS_SHARED の mutex で守る。robust にしてあるので、
+// ロックを持ったままプロセスが死んでも、次にロックを取ったプロセスが EOWNERDEAD で
+// 引き継げる（ただし死んだプロセスの途中の操作は壊れたまま残りうる）。
+// 有効な間は tcache もスレッドヒープも通さない（キャッシュに入れたブロックは他の
+// プロセスから使えないため）。領域は作ったときの大きさのままで伸ばさない
+// （伸ばすと全プロセスでマップし直すことになる）。
+#define SHARED_MAGIC 0x50534d43u // "CMSP"
+#define SHARED_WAIT_MS 1000       // 作る側の初期化を待つ上限
+
+typedef struct {
+    uint32_t magic;
+    uint32_t ready;                  // 作ったプロセスが初期化を終えたら 1
+    size_t size;                     // 領域全体のバイト数
+    pthread_mutex_t lock;
+    uint64_t bins[NUM_SIZE_CLASSES]; // サイズクラスごとの空きリストの先頭（オフセット）
+    uint32_t fl_bitmap;
+    uint8_t sl_bitmap[FL_COUNT];
+    size_t free_size;                // 空きブロックの合計
+    size_t in_use;                   // 使用中のブロックの合計
+    uint64_t root;                   // 利用者が置いた最初のオブジェクト（set_shared_root）
+} shared_header_t;
+
+// 空きブロックの data 領域に置くリンク
+typedef struct {
+    uint64_t next;
+    uint64_t prev;
+} shared_node_t;
+
+// 領域の先頭には shared_header_t があるので、sh がそのまま領域の先頭になる
+#define SHARED_NODE(block) ((shared_node_t*)(block)->data)
+#define SHARED_AT(sh, offset) ((block_t*)((char*)(sh) + (offset)))
+#define SHARED_OFFSET(sh, block) ((uint64_t)((char*)(block) - (char*)(sh)))
+
+static char* shared_base; // このプロセスでのマップ先（NULL なら無効）
+static char* shared_end;
+
+// ブロックが共有ヒープの領域にあるか
+static bool shared_owns(block_t* block) {
+    return (char*)block >= shared_base && (char*)block < shared_end;
+}
+
+static void shared_lock(shared_header_t* sh) {
+    if (pthread_mutex_lock(&sh->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&sh->lock);
+    }
+}
+
+// 空きブロックをサイズクラスのリストの先頭に入れる（sh->lock を保持して呼ぶ）
+static void shared_insert(shared_header_t* sh, block_t* block) {
+    size_t size = SIZE(block);
+    int fl, sl;
+    size_to_class(size, &fl, &sl);
+    uint64_t* bin = &sh->bins[fl * SL_COUNT + sl];
+
+    SHARED_NODE(block)->next = *bin;
+    SHARED_NODE(block)->prev = 0;
+    if (*bin) SHARED_NODE(SHARED_AT(sh, *bin))->prev = SHARED_OFFSET(sh, block);
+    *bin = SHARED_OFFSET(sh, block);
+
+    SET_FLAG(block, BLOCK_FREE);
+    FOOTER(block) = size;
+    SET_FLAG(NEXT_BLOCK(block), BLOCK_PREV_FREE);
+    sh->free_size += size;
+    sh->sl_bitmap[fl] |= 1u << sl;
+    sh->fl_bitmap |= 1u << fl;
+}
+
+// 空きブロックをリストから外す（sh->lock を保持して呼ぶ）
+static void shared_remove(shared_header_t* sh, block_t* block) {
+    int fl, sl;
+    size_to_class(SIZE(block), &fl, &sl);
+    uint64_t* bin = &sh->bins[fl * SL_COUNT + sl];
+
+    shared_node_t* node = SHARED_NODE(block);
+    if (node->prev) {
+        SHARED_NODE(SHARED_AT(sh, node->prev))->next = node->next;
+    } else {
+        *bin = node->next;
+    }
+    if (node->next) SHARED_NODE(SHARED_AT(sh, node->next))->prev = node->prev;
+
+    CLEAR_FLAG(block, BLOCK_FREE);
+    CLEAR_FLAG(NEXT_BLOCK(block), BLOCK_PREV_FREE);
+    sh->free_size -= SIZE(block);
+    if (*bin == 0) {
+        sh->sl_bitmap[fl] &= ~(1u << sl);
+        if (sh->sl_bitmap[fl] == 0) sh->fl_bitmap &= ~(1u << fl);
+    }
+}
+
+// 隣接する空きブロックと統合してリストに入れる（sh->lock を保持して呼ぶ）
+static void shared_release(shared_header_t* sh, block_t* block) {
+    block_t* next = NEXT_BLOCK(block);
+    if (HAS_FLAG(next, BLOCK_FREE)) {
+        shared_remove(sh, next);
+        SET_SIZE(block, SIZE(block) + SIZE(next));
+    }
+    if (HAS_FLAG(block, BLOCK_PREV_FREE)) {
+        block_t* prev = (block_t*)((char*)block - PREV_FOOTER(block));
+        shared_remove(sh, prev);
+        SET_SIZE(prev, SIZE(prev) + SIZE(block));
+        block = prev;
+    }
+    shared_insert(sh, block);
+}
+
+// 共有ヒープから total_size のブロックを確保する。空きがなければ NULL（sh->lock を保持して呼ぶ）
+static block_t* shared_alloc_block(shared_header_t* sh, size_t total_size) {
+    int fl, sl;
+    size_to_class(total_size, &fl, &sl);
+
+    block_t* block = NULL;
+    for (uint64_t offset = sh->bins[fl * SL_COUNT + sl]; offset; ) {
+        block_t* candidate = SHARED_AT(sh, offset);
+        if (SIZE(candidate) >= total_size) {
+            block = candidate;
+            break;
+        }
+        offset = SHARED_NODE(candidate)->next;
+    }
+    if (block == NULL) {
+        uint32_t sl_map = sh->sl_bitmap[fl] & (~0u << (sl + 1));
+        if (sl_map == 0) {
+            uint32_t fl_map = (fl + 1 < FL_COUNT) ? sh->fl_bitmap & (~0u << (fl + 1)) : 0;
+            if (fl_map == 0) return NULL;
+            fl = __builtin_ctz(fl_map);
+            sl_map = sh->sl_bitmap[fl];
+        }
+        sl = __builtin_ctz(sl_map);
+        block = SHARED_AT(sh, sh->bins[fl * SL_COUNT + sl]);
+    }
+
+    shared_remove(sh, block);
+    size_t remaining_size = SIZE(block) - total_size;
+    if (remaining_size >= MIN_BLOCK_SIZE) {
+        block_t* rest = (block_t*)((char*)block + total_size);
+        rest->header = remaining_size;
+        SET_SIZE(block, total_size);
+        shared_insert(sh, rest);
+    }
+    sh->in_use += SIZE(block);
+    return block;
+}
+
+static void* shared_allocate(size_t size) {
+    if (size == 0 || size > SIZE_MAX / 2) return NULL;
+
+    shared_header_t* sh = (shared_header_t*)shared_base;
+    shared_lock(sh);
+    block_t* block = shared_alloc_block(sh, block_size_for(size));
+    pthread_mutex_unlock(&sh->lock);
+    return block ? block->data : NULL;
+}
+
+// allocate_aligned の共有ヒープ版。前後の余りは空きブロックとして戻す
+static void* shared_allocate_aligned(size_t alignment, size_t size) {
+    if (size == 0 || size > SIZE_MAX / 2) return NULL;
+
+    shared_header_t* sh = (shared_header_t*)shared_base;
+    size_t total_size = block_size_for(size);
+    shared_lock(sh);
+    block_t* block = shared_alloc_block(sh, total_size + alignment + MIN_BLOCK_SIZE);
+    if (block) {
+        sh->in_use -= SIZE(block);
+        uintptr_t data = ((uintptr_t)block->data + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        size_t lead = data - (uintptr_t)block->data;
+        if (lead != 0) {
+            while (lead < MIN_BLOCK_SIZE) lead += alignment;
+            block_t* aligned = (block_t*)((char*)block + lead);
+            aligned->header = SIZE(block) - lead;
+            SET_SIZE(block, lead);
+            shared_release(sh, block);
+            block = aligned;
+        }
+        if (SIZE(block) - total_size >= MIN_BLOCK_SIZE) {
+            block_t* tail = (block_t*)((char*)block + total_size);
+            tail->header = SIZE(block) - total_size;
+            SET_SIZE(block, total_size);
+            shared_release(sh, tail);
+        }
+        sh->in_use += SIZE(block);
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return block ? block->data : NULL;
+}
+
+static void shared_free(block_t* block) {
+    shared_header_t* sh = (shared_header_t*)shared_base;
+    shared_lock(sh);
+    sh->in_use -= SIZE(block);
+    shared_release(sh, block);
+    pthread_mutex_unlock(&sh->lock);
+}
+
+// ftruncate したばかりの（0 で埋まった）領域に、ヘッダと1つの空きブロックを作る
+// 最初のブロックは data が ALIGNMENT 境界に来る位置から、末尾にはエピローグを置く。
+static void shared_format(char* memory, size_t size) {
+    shared_header_t* sh = (shared_header_t*)memory;
+    sh->magic = SHARED_MAGIC;
+    sh->size = size;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&sh->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    size_t start = ALIGN(sizeof(*sh)) + PROLOGUE_SIZE;
+    block_t* block = (block_t*)(memory + start);
+    block->header = size - start - EPILOGUE_SIZE;
+    ((block_t*)(memory + size - EPILOGUE_SIZE))->header = 0;
+    shared_insert(sh, block);
+    __atomic_store_n(&sh->ready, 1, __ATOMIC_RELEASE);
+}
 
-// グローバルなヒープ構造体
-static heap_t heap = {0};
+// shm_open した名前付きの領域を共有ヒープにする。成功すれば 0、失敗すれば errno を設定して -1
+// CM_SHARED_CREATE なら、なければ size バイトで作る（すでにあれば size は見ずに開く）。
+// 後から開く側は、作る側の ftruncate と初期化が済むまで待つ。
+// 名前を消すのは利用者（07_shm_open.c と同じく shm_unlink を呼ぶ）。
+int init_shared_heap(const char* name, size_t size, int flags) {
+    if (shared_base != NULL) {
+        errno = EBUSY;
+        return -1;
+    }
 
-// ヒープの初期化関数
-void init_heap(size_t initial_size) {
-    initial_size = ALIGN(initial_size); // サイズをアラインメントに合わせる
-    
-    // OSからメモリを要求
-    void* memory = sbrk(initial_size);
-    if (memory == (void*)-1) {
-        perror("Failed to initialize heap"); // メモリ確保失敗時のエラー表示
-        return;
+    bool created = false;
+    int fd = -1;
+    if (flags & CM_SHARED_CREATE) {
+        fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd >= 0) {
+            created = true;
+        } else if (errno != EEXIST) {
+            return -1;
+        }
+    }
+    if (fd < 0) {
+        fd = shm_open(name, O_RDWR, 0);
+        if (fd < 0) return -1;
     }
-    memset(memory, 0, initial_size);
-    
-    // 最初のブロックを初期化
-    block_t* initial_block = (block_t*)memory;
-    initial_block->size = initial_size; // ブロックサイズ設定
-    initial_block->is_free = true;      // 空きブロックとしてマーク
-    initial_block->next = NULL;
-    initial_block->prev = NULL;
-    
-    // ヒープ構造体の初期化
-    heap.free_list = initial_block; // 空きリストに登録
-    heap.used_list = NULL;          // 使用中リストは空
-    heap.total_size = initial_size; // 総メモリサイズ
-    heap.used_size = 0;             // 使用中サイズ
-}
 
-// 最適な空きブロックを探す（ベストフィット法）
-block_t* find_best_fit(size_t size) {
-    block_t* current = heap.free_list;
-    block_t* best_fit = NULL;
-    size_t smallest_diff = SIZE_MAX;
-    
-    while (current != NULL) {
-        if (current->is_free && current->size >= size) {
-            size_t diff = current->size - size;
-            if (diff < smallest_diff) {
-                smallest_diff = diff;
-                best_fit = current;
-                
-                // 完全一致なら探索終了
-                if (diff == 0) break;
+    size_t header_size = ALIGN(sizeof(shared_header_t));
+    if (created) {
+        size = (size + page_size() - 1) & ~(page_size() - 1);
+        int error = 0;
+        if (size < header_size + ALIGNMENT + MIN_BLOCK_SIZE) {
+            error = EINVAL;
+        } else if (ftruncate(fd, size) != 0) {
+            error = errno;
+        }
+        if (error != 0) {
+            close(fd);
+            shm_unlink(name);
+            errno = error;
+            return -1;
+        }
+    } else {
+        struct stat st;
+        for (int waited = 0; ; waited++) {
+            if (fstat(fd, &st) != 0) {
+                close(fd);
+                return -1;
+            }
+            if ((size_t)st.st_size >= header_size) break;
+            if (waited == SHARED_WAIT_MS) {
+                close(fd);
+                errno = ETIMEDOUT;
+                return -1;
             }
+            usleep(1000);
         }
-        current = current->next;
+        size = st.st_size;
     }
-    
-    return best_fit;
-}
 
-// ブロックを分割する関数
-void split_block(block_t* block, size_t size) {
-    size_t remaining_size = block->size - size;
-    
-    // 残りサイズが新しいブロックとして十分な場合のみ分割
-    if (remaining_size > BLOCK_SIZE + ALIGNMENT) {
-        block_t* new_block = (block_t*)((char*)block + size);
-        new_block->size = remaining_size;
-        new_block->is_free = true;
-        new_block->next = block->next;
-        new_block->prev = block;
-        
-        if (block->next) {
-            block->next->prev = new_block;
+    char* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int saved_errno = errno;
+    close(fd);
+    if (memory == MAP_FAILED) {
+        if (created) shm_unlink(name);
+        errno = saved_errno;
+        return -1;
+    }
+
+    shared_header_t* sh = (shared_header_t*)memory;
+    if (created) {
+        shared_format(memory, size);
+    } else {
+        for (int waited = 0; __atomic_load_n(&sh->ready, __ATOMIC_ACQUIRE) == 0; waited++) {
+            if (waited == SHARED_WAIT_MS) {
+                munmap(memory, size);
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            usleep(1000);
+        }
+        if (sh->magic != SHARED_MAGIC || sh->size != size) {
+            munmap(memory, size);
+            errno = EINVAL;
+            return -1;
         }
-        
-        block->next = new_block;
-        block->size = size;
     }
+
+    pthread_mutex_lock(&heap.lock);
+    heap.mmap_calls++;
+    pthread_mutex_unlock(&heap.lock);
+    shared_end = memory + size;
+    __atomic_store_n(&shared_base, memory, __ATOMIC_RELEASE);
+    return 0;
 }
 
-// メモリ確保関数（malloc相当）
-// ...existing code...
+// このプロセスのマップを外し、以後の確保を元のヒープに戻す
+// 共有ヒープのブロックを指すポインタは使えなくなる（中身は領域に残る）。
+void detach_shared_heap(void) {
+    char* memory = shared_base;
+    if (memory == NULL) return;
+    __atomic_store_n(&shared_base, NULL, __ATOMIC_RELEASE);
+    munmap(memory, shared_end - memory);
+    shared_end = NULL;
 
-void* custom_malloc(size_t size) {
-    if (size == 0) return NULL;
+    pthread_mutex_lock(&heap.lock);
+    heap.munmap_calls++;
+    pthread_mutex_unlock(&heap.lock);
+}
 
-    size_t total_size = ALIGN(size + BLOCK_SIZE);
-    block_t* block = find_best_fit(total_size);
+// 共有ヒープの中のポインタと、プロセスをまたいで渡せるオフセットの変換（NULL と 0 が対応する）
+size_t shared_offset(const void* ptr) {
+    return ptr ? (size_t)((const char*)ptr - shared_base) : 0;
+}
 
-    if (block == NULL) {
-        size_t request_size = total_size > 4096 ? total_size : 4096;
-        void* memory = sbrk(request_size);
-        if (memory == (void*)-1) {
-            return NULL;
-        }
+void* shared_pointer(size_t offset) {
+    return offset ? shared_base + offset : NULL;
+}
 
-        block = (block_t*)memory;
-        block->size = request_size;
-        block->is_free = true;
-        block->next = heap.free_list;
-        block->prev = NULL;
+// 後から開いたプロセスが最初にたどるオブジェクト（リストの先頭など）を置く
+void set_shared_root(void* ptr) {
+    shared_header_t* sh = (shared_header_t*)shared_base;
+    __atomic_store_n(&sh->root, shared_offset(ptr), __ATOMIC_RELEASE);
+}
 
-        if (heap.free_list) {
-            heap.free_list->prev = block;
-        }
+void* get_shared_root(void) {
+    shared_header_t* sh = (shared_header_t*)shared_base;
+    return shared_pointer(__atomic_load_n(&sh->root, __ATOMIC_ACQUIRE));
+}
+
+// 共有ヒープ全体（全プロセスの合計）の使用中・空きのバイト数と最大の空きブロック
+void get_shared_heap_stats(size_t* in_use, size_t* free_size, size_t* largest_free) {
+    *in_use = *free_size = *largest_free = 0;
+    shared_header_t* sh = (shared_header_t*)shared_base;
+    if (sh == NULL) return;
 
-        heap.free_list = block;
-        heap.total_size += request_size;
+    shared_lock(sh);
+    *in_use = sh->in_use;
+    *free_size = sh->free_size;
+    if (sh->fl_bitmap != 0) {
+        int fl = 31 - __builtin_clz(sh->fl_bitmap);
+        int sl = 31 - __builtin_clz(sh->sl_bitmap[fl]);
+        for (uint64_t offset = sh->bins[fl * SL_COUNT + sl]; offset; ) {
+            block_t* block = SHARED_AT(sh, offset);
+            if (SIZE(block) > *largest_free) *largest_free = SIZE(block);
+            offset = SHARED_NODE(block)->next;
+        }
     }
+    pthread_mutex_unlock(&sh->lock);
+}
 
-    split_block(block, total_size);
+// ---- サンプリングによるヒーププロファイラ（本体は後ろの debug_malloc の近く） ----
+// 速い経路では、確保のたびにスレッドごとの残りバイト数を減らし、
+// 解放のたびに記録中のサンプルがあるかを見るだけにする。
+#define PROFILE_FILTER_SIZE (1 << 16)
+#define PROFILE_RECHECK (1024 * 1024) // 無効のときも、この量を確保するごとに設定を見に行く
+static size_t profile_interval;       // 平均このバイト数に1回記録する。0 なら無効
+static size_t profile_live;           // 記録中のサンプルの数
+// サンプルのアドレスのハッシュごとの個数（255 で止める）。0 なら表を引かずに済む
+static uint8_t profile_filter[PROFILE_FILTER_SIZE];
 
-    // 空きリストから完全に外す
-    if (block->prev) {
-        block->prev->next = block->next;
-    } else {
-        heap.free_list = block->next;
+static size_t profile_filter_index(const void* ptr) {
+    uint64_t h = (uint64_t)(uintptr_t)ptr * 0x9e3779b97f4a7c15ULL;
+    return (size_t)(h >> 48);
+}
+
+static void sample_allocation(void* ptr, size_t size, void* caller);
+static void sample_free(void* ptr);
+static int profile_set_interval(size_t interval);
+
+// 確保の本体（サンプリングは custom_malloc で行う）
+// 小さいブロックはスレッドキャッシュ（またはスレッドヒープ）から、それ以外は中央ヒープから確保する
+static inline void* allocate(size_t size) {
+    if (__builtin_expect(shared_base != NULL, 0)) return shared_allocate(size);
+    if (size == 0 || size > SIZE_MAX / 2) return NULL;
+
+    size_t total_size = block_size_for(size);
+    block_t* block;
+
+    if (total_size <= TCACHE_MAX_SIZE) {
+        // バディ方式では、解放したブロックが同じリストに戻るよう2のべき乗に揃える
+        if (__builtin_expect(heap.fit_policy == CM_FIT_BUDDY, 0)) {
+            total_size = (size_t)1 << (64 - __builtin_clzll(total_size - 1));
+        }
+        size_t idx = total_size / ALIGNMENT;
+        if (heap.thread_heaps) {
+            block = theap_alloc(idx, total_size);
+            if (block) {
+                tcache.allocs[idx]++;
+                tcache.requested += size;
+                return block->data;
+            }
+            // 予約した領域を使い切ったら tcache から
+        }
+        if (tcache.bins[idx] == NULL) {
+            tcache_refill(idx, total_size);
+            if (tcache.bins[idx] == NULL) return NULL;
+        }
+        block = tcache.bins[idx];
+        tcache.bins[idx] = TCACHE_NEXT(block);
+        tcache.counts[idx]--;
+        TCACHE_KEY(block) = 0;
+        tcache.allocs[SIZE(block) / ALIGNMENT]++; // 分割されず大きいこともある
+        tcache.requested += size;
+        return block->data;
     }
-    if (block->next) {
-        block->next->prev = block->prev;
+
+    if (total_size >= heap.mmap_threshold) {
+        block = mmap_alloc_block(total_size);
+        if (block == NULL) return NULL;
+        pthread_mutex_lock(&heap.lock);
+        count_alloc(size, block);
+        pthread_mutex_unlock(&heap.lock);
+        return block->data;
     }
-    block->next = NULL;
-    block->prev = NULL;
 
-    // 使用中リストの先頭に追加
-    block->is_free = false;
-    block->next = heap.used_list;
-    if (heap.used_list) {
-        heap.used_list->prev = block;
+    pthread_mutex_lock(&heap.lock);
+    block = policy_alloc_block(total_size);
+    if (block) count_alloc(size, block);
+    pthread_mutex_unlock(&heap.lock);
+
+    return block ? block->data : NULL;
+}
+
+// 確保して、サンプリングの間隔を数える。caller は公開関数の戻り先（プロファイルの末端になる）
+static inline void* sampled_allocate(size_t size, void* caller) {
+    void* ptr = allocate(size);
+    if ((tcache.sample_left -= (ptrdiff_t)size) < 0 && ptr) {
+        sample_allocation(ptr, size, caller);
     }
-    block->prev = NULL;
-    heap.used_list = block;
+    return ptr;
+}
+
+// メモリ確保関数（malloc相当）
+void* custom_malloc(size_t size) {
+    return sampled_allocate(size, __builtin_return_address(0));
+}
 
-    heap.used_size += block->size;
+// 動作パラメータの変更（mallopt 相当）。成功すれば 1 を返す
+int custom_mallopt(int param, size_t value) {
+    // backtrace の準備で確保が起きるので、heap.lock を取る前に分ける
+    if (param == CM_SAMPLE_INTERVAL) return profile_set_interval(value);
 
-    return block->data;
+    pthread_mutex_lock(&heap.lock);
+    int ok = 1;
+    switch (param) {
+    case CM_MMAP_THRESHOLD:
+        heap.mmap_threshold = value;
+        break;
+    case CM_TRIM_THRESHOLD:
+        heap.trim_threshold = value;
+        break;
+    case CM_REALLOC_IN_PLACE:
+        heap.realloc_in_place = value != 0;
+        break;
+    case CM_DUMP_BLOCKS:
+        heap.dump_blocks = value != 0;
+        break;
+    case CM_FIT_POLICY:
+        if (value >= sizeof(fit_policies) / sizeof(fit_policies[0]) ||
+            (fit_policies[value].buddy && !buddy_reserve()) ||
+            (fit_policies[value].address_order && !free_order_build())) {
+            ok = 0;
+            break;
+        }
+        if (!fit_policies[value].address_order) free_order_drop();
+        heap.fit_policy = (int)value;
+        break;
+    case CM_THREAD_HEAPS:
+        if (value != 0 && !theap_reserve()) {
+            ok = 0;
+            break;
+        }
+        heap.thread_heaps = value != 0;
+        break;
+    default:
+        ok = 0;
+        break;
+    }
+    pthread_mutex_unlock(&heap.lock);
+    return ok;
 }
-// ...existing code...
 
-// 隣接する空きブロックを統合する関数
-void coalesce_blocks(block_t* block) {
+// 隣接する空きブロックを統合する関数（境界タグ法）
+// メモリ上の次のブロックは自分のサイズから、前のブロックは BLOCK_PREV_FREE が
+// 立っていれば直前のフッタから O(1) で求まる。block はどの空きリストにも
+// 入っていない状態で渡し、統合後のブロックを返す。
+block_t* coalesce_blocks(block_t* block) {
     // 次のブロックが空きなら統合
-    if (block->next && block->next->is_free) {
-        block->size += block->next->size;
-        block->next = block->next->next;
-        if (block->next) {
-            block->next->prev = block;
-        }
+    block_t* next = NEXT_BLOCK(block);
+    if (HAS_FLAG(next, BLOCK_FREE)) {
+        remove_free_block(next);
+        SET_SIZE(block, SIZE(block) + SIZE(next));
+        CLEAR_FLAG(block, BLOCK_FRESH); // 間にあったヘッダが中身に残る
+        if (heap.rover == next) heap.rover = block;
     }
     
     // 前のブロックが空きなら統合
-    if (block->prev && block->prev->is_free) {
-        block->prev->size += block->size;
-        block->prev->next = block->next;
-        if (block->next) {
-            block->next->prev = block->prev;
-        }
-        block = block->prev;
+    if (HAS_FLAG(block, BLOCK_PREV_FREE)) {
+        block_t* prev = (block_t*)((char*)block - PREV_FOOTER(block));
+        remove_free_block(prev);
+        SET_SIZE(prev, SIZE(prev) + SIZE(block));
+        CLEAR_FLAG(prev, BLOCK_FRESH);
+        if (heap.rover == block) heap.rover = prev;
+        block = prev;
     }
+
+    return block;
 }
 
 // メモリ解放関数（free相当）
-// ...existing code...
-
 void custom_free(void* ptr) {
     if (!ptr) return;
 
     block_t* block = (block_t*)((char*)ptr - BLOCK_SIZE);
-    if (block->is_free) {
+    if (HAS_FLAG(block, BLOCK_FREE) || tcache_contains(block)) {
         fprintf(stderr, "Error: Double free detected at %p\n", ptr);
         return;
     }
-    block->is_free = true;
 
-    // 使用中リストから削除
-    if (block->prev) {
-        block->prev->next = block->next;
-    } else {
-        heap.used_list = block->next;
+    if (__atomic_load_n(&profile_live, __ATOMIC_RELAXED) != 0 &&
+        __atomic_load_n(&profile_filter[profile_filter_index(ptr)], __ATOMIC_RELAXED) != 0) {
+        sample_free(ptr);
+    }
+
+    // スレッドヒープのブロックは、無効にしたあとでも持ち主に返す
+    if (theap_owns(block)) {
+        tcache_register(); // 解放だけするスレッドの回数も、終了時に足し込む
+        tcache.frees[SIZE(block) / ALIGNMENT]++;
+        theap_free(block);
+        return;
+    }
+
+    // 共有ヒープのブロックは、どのプロセスが確保したものでもここで返せる
+    if (shared_owns(block)) {
+        shared_free(block);
+        return;
+    }
+
+    if (HAS_FLAG(block, BLOCK_MMAPPED)) {
+        mmap_free_block(block);
+        return;
+    }
+
+    // 小さいブロックはスレッドキャッシュへ（あふれたら半分を中央ヒープへ返す）
+    if (SIZE(block) <= TCACHE_MAX_SIZE) {
+        size_t idx = SIZE(block) / ALIGNMENT;
+        if (tcache.counts[idx] >= TCACHE_LIMIT) {
+            tcache_drain(idx);
+        }
+        tcache_register();
+        tcache_push(idx, block);
+        tcache.frees[idx]++;
+        return;
+    }
+
+    pthread_mutex_lock(&heap.lock);
+    usage_free(&heap.usage, SIZE(block));
+    heap_free_block(block);
+    pthread_mutex_unlock(&heap.lock);
+}
+
+// ブロックのうち利用者が使えるバイト数（使用中はフッタがないので末尾まで使える）
+static size_t usable_size(block_t* block) {
+    return SIZE(block) - BLOCK_SIZE;
+}
+
+// custom_malloc などで確保した領域の実際の大きさ（malloc_usable_size 相当）
+size_t custom_malloc_usable_size(void* ptr) {
+    if (ptr == NULL) return 0;
+    return usable_size((block_t*)((char*)ptr - BLOCK_SIZE));
+}
+
+// 使用中ブロックをその場で total_size に伸縮する（heap.lock を保持して呼ぶ）
+// 伸ばすときはメモリ上の次の空きブロックを取り込む。ヒープ末尾のブロックなら
+// sbrk で伸ばした領域を取り込む。余った末尾は切り離して空きに戻す。
+static bool resize_block(block_t* block, size_t total_size) {
+    size_t old_size = SIZE(block);
+
+    if (total_size > old_size) {
+        block_t* next = NEXT_BLOCK(block);
+        if (next == (block_t*)(heap.heap_end - EPILOGUE_SIZE) && sbrk(0) == heap.heap_end) {
+            // ヒープ末尾: 伸ばした領域はエピローグの位置から始まる
+            block_t* grown = extend_heap(total_size - old_size);
+            if (grown == NULL) return false;
+            if (grown != next) {
+                // 連続して取れなかった（別の領域になった）
+                insert_free_block(grown);
+                return false;
+            }
+        } else {
+            if (!HAS_FLAG(next, BLOCK_FREE) || old_size + SIZE(next) < total_size) return false;
+            remove_free_block(next);
+        }
+        if (heap.rover == next) heap.rover = block;
+        SET_SIZE(block, old_size + SIZE(next));
+    }
+
+    // 余った末尾を切り離して空きに戻す
+    if (SIZE(block) - total_size >= MIN_BLOCK_SIZE) {
+        block_t* tail = (block_t*)((char*)block + total_size);
+        tail->header = SIZE(block) - total_size;
+        SET_SIZE(block, total_size);
+        tail = coalesce_blocks(tail);
+        insert_free_block(tail);
+        trim_heap_top(tail);
+    }
+    heap.used_size = heap.used_size - old_size + SIZE(block);
+    return true;
+}
+
+// mmap したブロックを mremap で伸縮する（中身はページの付け替えで移り、コピーしない）
+static block_t* mmap_resize_block(block_t* block, size_t total_size) {
+    size_t page = page_size();
+    size_t offset = mmap_offset(block); // 移動してもページ内の位置は変わらない
+    size_t length = (offset + total_size + page - 1) & ~(page - 1);
+    size_t old_size = SIZE(block);
+    if (length == offset + old_size) return block;
+
+    void* memory = mremap((char*)block - offset, offset + old_size, length, MREMAP_MAYMOVE);
+    if (memory == MAP_FAILED) return NULL;
+    block = (block_t*)((char*)memory + offset);
+    SET_SIZE(block, length - offset);
+
+    pthread_mutex_lock(&heap.lock);
+    heap.mmap_size = heap.mmap_size - old_size + SIZE(block);
+    heap.mremap_calls++;
+    record_peaks();
+    pthread_mutex_unlock(&heap.lock);
+    return block;
+}
+
+// サイズ変更関数（realloc相当）
+// その場で伸縮できればコピーせずに同じポインタを返す。
+// できないときだけ新しく確保してコピーする。
+void* custom_realloc(void* ptr, size_t size) {
+    if (ptr == NULL) return custom_malloc(size);
+    if (size == 0) {
+        custom_free(ptr);
+        return NULL;
+    }
+    if (size > SIZE_MAX / 2) return NULL;
+
+    // その場で伸縮できたときは、統計の上では解放と確保を1回ずつ数える
+    block_t* block = (block_t*)((char*)ptr - BLOCK_SIZE);
+    if (theap_owns(block) || shared_owns(block) || buddy_owns(block)) {
+        // スレッドヒープ、共有ヒープ、バディ領域のブロックは伸縮しない。縮めるときはそのまま使う
+        if (block_size_for(size) <= SIZE(block)) return ptr;
+    } else if (heap.realloc_in_place) {
+        size_t old_size = SIZE(block);
+        if (HAS_FLAG(block, BLOCK_MMAPPED)) {
+            block_t* resized = mmap_resize_block(block, size + BLOCK_SIZE);
+            if (resized) {
+                pthread_mutex_lock(&heap.lock);
+                usage_free(&heap.usage, old_size);
+                count_alloc(size, resized);
+                pthread_mutex_unlock(&heap.lock);
+                return resized->data;
+            }
+        } else {
+            pthread_mutex_lock(&heap.lock);
+            bool ok = resize_block(block, block_size_for(size));
+            if (ok) {
+                usage_free(&heap.usage, old_size);
+                count_alloc(size, block);
+            }
+            pthread_mutex_unlock(&heap.lock);
+            if (ok) return ptr;
+        }
+    }
+
+    void* new_ptr = sampled_allocate(size, __builtin_return_address(0));
+    if (new_ptr == NULL) return NULL;
+    size_t old_size = usable_size(block);
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    custom_free(ptr);
+
+    pthread_mutex_lock(&heap.lock);
+    heap.realloc_copies++;
+    pthread_mutex_unlock(&heap.lock);
+    return new_ptr;
+}
+
+// custom_realloc がコピーにまで至った回数
+size_t get_realloc_copy_count(void) {
+    pthread_mutex_lock(&heap.lock);
+    size_t count = heap.realloc_copies;
+    pthread_mutex_unlock(&heap.lock);
+    return count;
+}
+
+// 0 で初期化した配列の確保（calloc相当）
+// OS から取ってきたばかりのメモリ（mmap や伸ばしたばかりのヒープ）は
+// すでに 0 なので memset を省く。
+void* custom_calloc(size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) return NULL;
+
+    void* ptr = sampled_allocate(count * size, __builtin_return_address(0));
+    if (ptr == NULL) return NULL;
+
+    block_t* block = (block_t*)((char*)ptr - BLOCK_SIZE);
+    if (!HAS_FLAG(block, BLOCK_FRESH)) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+// custom_memalign の本体（alignment は ALIGNMENT より大きい）
+// 中央ヒープから alignment 分だけ余分に取り、揃えた位置より前の余りは
+// 空きブロックとして切り離して返す。後ろの余りも resize_block で返す。
+static void* allocate_aligned(size_t alignment, size_t size) {
+    if (shared_base != NULL) return shared_allocate_aligned(alignment, size);
+    if (size == 0 || size > SIZE_MAX / 2) return NULL;
+
+    size_t total_size = block_size_for(size);
+    if (total_size + alignment >= heap.mmap_threshold) {
+        block_t* block = mmap_alloc_aligned(alignment, total_size);
+        if (block == NULL) return NULL;
+        pthread_mutex_lock(&heap.lock);
+        count_alloc(size, block);
+        pthread_mutex_unlock(&heap.lock);
+        return block->data;
+    }
+
+    pthread_mutex_lock(&heap.lock);
+    block_t* block = heap_alloc_block(total_size + alignment + MIN_BLOCK_SIZE);
+    if (block == NULL) {
+        pthread_mutex_unlock(&heap.lock);
+        return NULL;
     }
-    if (block->next) {
-        block->next->prev = block->prev;
+
+    uintptr_t data = ((uintptr_t)block->data + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    size_t lead = data - (uintptr_t)block->data;
+    if (lead != 0) {
+        // 前の余りが1ブロックとして成り立つ大きさになるまでずらす
+        while (lead < MIN_BLOCK_SIZE) lead += alignment;
+
+        block_t* aligned = (block_t*)((char*)block + lead);
+        aligned->header = SIZE(block) - lead;
+        SET_SIZE(block, lead);
+        heap_free_block(block); // 使用量からは lead の分だけ引かれる
+        block = aligned;
     }
+    resize_block(block, total_size);
+    count_alloc(size, block);
+    pthread_mutex_unlock(&heap.lock);
+    return block->data;
+}
 
-    // 空きリストの先頭に追加
-    block->next = heap.free_list;
-    block->prev = NULL;
-    if (heap.free_list && heap.free_list != block) { // 追加: 自分自身でなければ
-        heap.free_list->prev = block;
+// alignment 境界に揃えた領域の確保（memalign 相当、alignment は2のべき乗）
+// 返したポインタはそのまま custom_free / custom_realloc に渡せる
+// （custom_realloc で移動したあとは ALIGNMENT 境界しか保証しない）。
+void* custom_memalign(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) return NULL;
+    if (alignment <= ALIGNMENT) return sampled_allocate(size, __builtin_return_address(0));
+
+    void* ptr = allocate_aligned(alignment, size);
+    if ((tcache.sample_left -= (ptrdiff_t)size) < 0 && ptr) {
+        sample_allocation(ptr, size, __builtin_return_address(0));
     }
-    heap.free_list = block;
+    return ptr;
+}
+
+// C11 の aligned_alloc 相当。alignment が2のべき乗でなければ NULL
+void* custom_aligned_alloc(size_t alignment, size_t size) {
+    return custom_memalign(alignment, size);
+}
+
+// プロセスの常駐メモリ量（RSS）をバイト単位で返す
+// 表示中にロックを持っているので、malloc を使う stdio ではなく read で読む
+static size_t current_rss(void) {
+    char buf[128];
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if (fd < 0) return 0;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return 0;
+    buf[n] = '\0';
+
+    unsigned long vm_pages, rss_pages;
+    if (sscanf(buf, "%lu %lu", &vm_pages, &rss_pages) != 2) return 0;
+    return rss_pages * page_size();
+}
 
-    heap.used_size -= block->size;
+// 最大の空きブロックのサイズ。ビットマップで空きのある最上位のクラスを選び、
+// 木ならいちばん右を下る（リストのクラスはすべて同じサイズ）。
+static size_t largest_free_size(void) {
+    if (heap.fl_bitmap == 0) return 0;
+    int fl = 31 - __builtin_clz(heap.fl_bitmap);
+    int sl = 31 - __builtin_clz(heap.sl_bitmap[fl]);
+    block_t* block = heap.bins[fl * SL_COUNT + sl];
+    if (SIZE(block) >= LIST_CLASS_LIMIT) {
+        while (TREE_RIGHT(block)) block = TREE_RIGHT(block);
+    }
+    return SIZE(block);
+}
 
-    // 隣接する空きブロックを統合
-    coalesce_blocks(block);
+// 統計を集める（heap.lock を保持して呼ぶ）。ブロックはたどらない。
+static void collect_stats(malloc_stats_t* stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->requested_bytes = heap.usage.requested;
+    stats->allocated_bytes = heap.usage.allocated;
+    stats->in_use_bytes = (ptrdiff_t)heap.usage.in_use > 0 ? heap.usage.in_use : 0;
+    stats->peak_in_use_bytes = heap.peak_in_use;
+    stats->reserved_bytes = heap.total_size + heap.mmap_size + heap.theap_size + heap.buddy_size;
+    stats->peak_reserved_bytes = heap.peak_reserved;
+    stats->heap_bytes = heap.total_size;
+    stats->mmap_bytes = heap.mmap_size;
+    stats->thread_heap_bytes = heap.theap_size;
+    stats->buddy_bytes = heap.buddy_size;
+    stats->free_bytes = heap.free_size + heap.buddy_free;
+    stats->largest_free_block = largest_free_size();
+    if (buddy_largest_free() > stats->largest_free_block) stats->largest_free_block = buddy_largest_free();
+    if (stats->free_bytes > 0) {
+        stats->external_fragmentation = 1.0 - (double)stats->largest_free_block / stats->free_bytes;
+    }
+    for (int i = 0; i < CM_STATS_CLASSES; i++) {
+        stats->alloc_count[i] = heap.usage.allocs[i];
+        stats->live_count[i] = heap.usage.allocs[i] - heap.usage.frees[i];
+        stats->free_blocks[i] = heap.free_blocks[i];
+    }
+    stats->sbrk_calls = heap.sbrk_calls;
+    stats->mmap_calls = heap.mmap_calls;
+    stats->munmap_calls = heap.munmap_calls;
+    stats->mremap_calls = heap.mremap_calls;
+    stats->fit_searches = heap.fit_searches;
+    stats->fit_steps = heap.fit_steps;
 }
 
-// ...existing code...
+// アロケータの統計を返す
+// 他のスレッドが tcache で行った確保・解放は、そのスレッドが次に中央ヒープと
+// やり取りするまで反映されない（呼び出したスレッドの分は反映してから返す）。
+void get_malloc_stats(malloc_stats_t* stats) {
+    pthread_mutex_lock(&heap.lock);
+    tcache_merge_all(&tcache);
+    collect_stats(stats);
+    pthread_mutex_unlock(&heap.lock);
+}
 
 // メモリ使用状況を表示する関数
+// 集計値だけを表示する。custom_mallopt(CM_DUMP_BLOCKS, 1) のときは全ブロックも表示する。
+// 使用中のブロックは一覧を持たないので、sbrk した領域を先頭から順にたどる
+// （個別に mmap したブロックは合計サイズだけ表示する）。
 void print_memory_stats() {
+    pthread_mutex_lock(&heap.lock);
+    tcache_merge_all(&tcache);
+    malloc_stats_t stats;
+    collect_stats(&stats);
+
     printf("\nMemory Statistics:\n");
     printf("Total Heap Size: %zu bytes\n", heap.total_size);
     printf("Used Size: %zu bytes\n", heap.used_size);
-    printf("Free Size: %zu bytes\n", heap.total_size - heap.used_size);
+    printf("Free Size: %zu bytes\n", heap.free_size);
+    printf("mmap Size: %zu bytes\n", heap.mmap_size);
+    if (heap.theap_size) printf("Thread Heap Size: %zu bytes\n", heap.theap_size);
+    if (heap.buddy_size) printf("Buddy Size: %zu bytes (free %zu)\n", heap.buddy_size, heap.buddy_free);
+    printf("Process RSS: %zu KiB\n", current_rss() / 1024);
+    printf("In Use: %zu bytes (peak %zu)\n", stats.in_use_bytes, stats.peak_in_use_bytes);
+    printf("Reserved: %zu bytes (peak %zu)\n", stats.reserved_bytes, stats.peak_reserved_bytes);
+    printf("Requested / Allocated: %zu / %zu bytes\n", stats.requested_bytes, stats.allocated_bytes);
+    printf("Largest Free Block: %zu bytes, external fragmentation %.3f\n",
+           stats.largest_free_block, stats.external_fragmentation);
+    printf("sbrk %zu, mmap %zu, munmap %zu, mremap %zu calls\n",
+           stats.sbrk_calls, stats.mmap_calls, stats.munmap_calls, stats.mremap_calls);
+    printf("Fit Policy: %s, %.2f blocks examined per search\n", fit_policies[heap.fit_policy].name,
+           stats.fit_searches ? (double)stats.fit_steps / stats.fit_searches : 0.0);
+
+    printf("\nSize Classes (allocs / live / free blocks):\n");
+    for (int i = 0; i < CM_STATS_CLASSES; i++) {
+        if (stats.alloc_count[i] == 0 && stats.free_blocks[i] == 0) continue;
+        printf("%10zu- : %zu / %zu / %zu\n", (size_t)1 << (i + FL_SHIFT),
+               stats.alloc_count[i], stats.live_count[i], stats.free_blocks[i]);
+    }
+
+    if (!heap.dump_blocks) {
+        pthread_mutex_unlock(&heap.lock);
+        return;
+    }
     
     printf("\nFree Blocks:\n");
-    block_t* current = heap.free_list;
-    while (current) {
-        printf("Block at %p, size: %zu\n", (void*)current, current->size);
-        current = current->next;
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+        for (block_t* current = bin_first(heap.bins[i]); current; current = bin_next(current)) {
+            printf("Block at %p, size: %zu (class %d)\n", (void*)current, SIZE(current), i);
+        }
     }
     
     printf("\nUsed Blocks:\n");
-    current = heap.used_list;
-    while (current) {
-        printf("Block at %p, size: %zu\n", (void*)current, current->size);
-        current = current->next;
+    for (char* segment = heap.segments; segment; segment = *(char**)segment) {
+        block_t* current = (block_t*)(segment + PROLOGUE_SIZE);
+        for (; SIZE(current) != 0; current = NEXT_BLOCK(current)) {
+            if (HAS_FLAG(current, BLOCK_FREE)) continue;
+            printf("Block at %p, size: %zu%s\n", (void*)current, SIZE(current),
+                   TCACHE_KEY(current) == TCACHE_ENTRY_KEY ? " (thread cache)" : "");
+        }
     }
+    pthread_mutex_unlock(&heap.lock);
+}
+
+// 空き領域の合計と最大の空きブロックのサイズを返す（断片化の目安）
+void get_free_block_stats(size_t* total_free, size_t* largest_free) {
+    pthread_mutex_lock(&heap.lock);
+    *total_free = heap.free_size + heap.buddy_free;
+    *largest_free = largest_free_size();
+    if (buddy_largest_free() > *largest_free) *largest_free = buddy_largest_free();
+    pthread_mutex_unlock(&heap.lock);
 }
 
+typedef struct profile_site profile_site_t;
+
 typedef struct {
-    void* ptr;
+    void* ptr;        // NULL なら空きスロット
     size_t size;
-    const char* file;
-    int line;
+    union {
+        struct {                  // debug_malloc の記録
+            const char* file;
+            int line;
+        };
+        struct {                  // サンプリングした確保の記録
+            profile_site_t* site;
+            size_t weight;        // この1個が代表する推定バイト数
+        };
+    };
 } allocation_info_t;
 
-#define MAX_ALLOCATIONS 1000
-static allocation_info_t allocations[MAX_ALLOCATIONS];
-static int allocation_count = 0;
+// 確保中のポインタをキーにしたオープンアドレス法（線形探索）のハッシュ表
+// 削除はトゥームストーンを置かず後ろの要素を詰め直すので、探索列が伸び続けない。
+// 使用率が 1/2 を超えたら容量を倍にする。表そのものも custom_calloc で確保する。
+#define ALLOCATION_TABLE_MIN 1024
+typedef struct {
+    allocation_info_t* slots;
+    size_t capacity; // 2のべき乗
+    size_t count;
+} allocation_table_t;
+
+static allocation_table_t allocations;
+static pthread_mutex_t allocation_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t allocation_hash(const void* ptr, size_t capacity) {
+    // 下位ビットはアラインメントで揃っているので、乗算でかき混ぜて上位ビットを使う
+    uint64_t h = (uint64_t)(uintptr_t)ptr * 0x9e3779b97f4a7c15ULL;
+    return (size_t)(h >> 32) & (capacity - 1);
+}
+
+static void allocation_put(allocation_table_t* table, const allocation_info_t* info) {
+    size_t i = allocation_hash(info->ptr, table->capacity);
+    while (table->slots[i].ptr != NULL) {
+        i = (i + 1) & (table->capacity - 1);
+    }
+    table->slots[i] = *info;
+    table->count++;
+}
+
+// 表を new_capacity に作り直す（表のロックを保持して呼ぶ）
+static bool allocation_resize(allocation_table_t* table, size_t new_capacity) {
+    allocation_info_t* slots = custom_calloc(new_capacity, sizeof(allocation_info_t));
+    if (slots == NULL) return false;
+
+    allocation_info_t* old = table->slots;
+    size_t old_capacity = table->capacity;
+    table->slots = slots;
+    table->capacity = new_capacity;
+    table->count = 0;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].ptr) allocation_put(table, &old[i]);
+    }
+    custom_free(old);
+    return true;
+}
+
+// 1つ追加できるよう、必要なら表を広げる。もう入らなければ false（表のロックを保持して呼ぶ）
+static bool allocation_reserve(allocation_table_t* table) {
+    if ((table->count + 1) * 2 <= table->capacity) return true;
+    size_t new_capacity = table->capacity ? table->capacity * 2 : ALLOCATION_TABLE_MIN;
+    return allocation_resize(table, new_capacity) || table->count + 1 < table->capacity;
+}
+
+// ptr の記録を取り除いて info に返す。見つからなければ false（表のロックを保持して呼ぶ）
+static bool allocation_remove(allocation_table_t* table, void* ptr, allocation_info_t* info) {
+    if (table->count == 0) return false;
+
+    allocation_info_t* slots = table->slots;
+    size_t mask = table->capacity - 1;
+    size_t i = allocation_hash(ptr, table->capacity);
+    while (slots[i].ptr != ptr) {
+        if (slots[i].ptr == NULL) return false;
+        i = (i + 1) & mask;
+    }
+    *info = slots[i];
+
+    // 空いた穴に、本来の位置がそこ以前にある後続の要素を移す
+    size_t hole = i;
+    for (;;) {
+        i = (i + 1) & mask;
+        if (slots[i].ptr == NULL) break;
+        size_t home = allocation_hash(slots[i].ptr, table->capacity);
+        // home が (hole, i] の範囲（循環）にあれば動かせない
+        bool stays = hole <= i ? (hole < home && home <= i) : (hole < home || home <= i);
+        if (!stays) {
+            slots[hole] = slots[i];
+            hole = i;
+        }
+    }
+    slots[hole].ptr = NULL;
+    table->count--;
+    return true;
+}
 
 void* debug_malloc(size_t size, const char* file, int line) {
     void* ptr = custom_malloc(size);
-    if (ptr && allocation_count < MAX_ALLOCATIONS) {
-        allocations[allocation_count].ptr = ptr;
-        allocations[allocation_count].size = size;
-        allocations[allocation_count].file = file;
-        allocations[allocation_count].line = line;
-        allocation_count++;
+    if (ptr == NULL) return NULL;
+
+    pthread_mutex_lock(&allocation_lock);
+    if (!allocation_reserve(&allocations)) {
+        // 表を広げられず、もう入らない
+        pthread_mutex_unlock(&allocation_lock);
+        fprintf(stderr, "Error: Allocation table is full, %p at %s:%d is not tracked\n",
+                ptr, file, line);
+        return ptr;
     }
+    allocation_info_t info = { .ptr = ptr, .size = size, .file = file, .line = line };
+    allocation_put(&allocations, &info);
+    pthread_mutex_unlock(&allocation_lock);
     return ptr;
 }
 
 void debug_free(void* ptr, const char* file, int line) {
     if (!ptr) return;
 
-    bool found = false;
-    for (int i = 0; i < allocation_count; i++) {
-        if (allocations[i].ptr == ptr) {
-            memmove(&allocations[i], &allocations[i + 1], 
-                    (allocation_count - i - 1) * sizeof(allocation_info_t));
-            allocation_count--;
-            break;
-        }
-    }
+    pthread_mutex_lock(&allocation_lock);
+    allocation_info_t info;
+    bool found = allocation_remove(&allocations, ptr, &info);
+    pthread_mutex_unlock(&allocation_lock);
 
     if (!found) {
         fprintf(stderr, "Error: Attempting to free unallocated pointer %p at %s:%d\n", 
@@ -288,20 +2504,292 @@ void debug_free(void* ptr, const char* file, int line) {
 }
 
 void check_leaks() {
-    if (allocation_count > 0) {
+    pthread_mutex_lock(&allocation_lock);
+    if (allocations.count > 0) {
         printf("\nMemory Leaks Detected:\n");
-        for (int i = 0; i < allocation_count; i++) {
+        for (size_t i = 0; i < allocations.capacity; i++) {
+            allocation_info_t* info = &allocations.slots[i];
+            if (info->ptr == NULL) continue;
             printf("Leak: %zu bytes at %p, allocated in %s:%d\n",
-                   allocations[i].size, allocations[i].ptr,
-                   allocations[i].file, allocations[i].line);
+                   info->size, info->ptr, info->file, info->line);
         }
     } else {
         printf("No memory leaks detected\n");
     }
+    pthread_mutex_unlock(&allocation_lock);
+}
+
+// ---- サンプリングによるヒーププロファイラ ----
+// debug_malloc のように全部の確保を記録すると重いので、確保したバイト数を数えて
+// 平均 profile_interval バイトに1回だけ backtrace() で呼び出し元を記録する。
+// 次のサンプルまでの間隔は指数分布（確保1バイトごとに同じ確率で選ぶ幾何分布の連続版）で
+// 決めるので、決まった周期の確保パターンと同期して偏ることがない。大きい確保ほど
+// 選ばれやすく、選ばれた確保はその確率の逆数 size / (1 - exp(-size / interval)) バイトを
+// 代表するとして数える（tcmalloc と同じ推定）。
+// 呼び出し元のスタックごとに、生きているサンプルの個数と推定バイト数を持ち、
+// dump_heap_profile で folded 形式（flamegraph.pl にそのまま渡せる）で書き出す。
+// その場での realloc はサンプルのサイズを更新しない。
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_INTERNAL 4        // アロケータ内のフレームとして飛ばしうる数
+#define PROFILE_BUCKETS 1024
+#define LN2 0.69314718055994531
+
+struct profile_site {
+    profile_site_t* next;         // 同じバケットの次
+    uint64_t hash;
+    int depth;
+    size_t live_count;            // 生きているサンプルの数
+    size_t live_bytes;            // その要求バイト数の合計
+    size_t live_weight;           // 推定バイト数の合計
+    void* frames[PROFILE_MAX_DEPTH];
+};
+
+static profile_site_t* profile_sites[PROFILE_BUCKETS]; // 作った呼び出し元は消さない
+static allocation_table_t profile_samples;             // 生きているサンプル
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static char profile_path[4096];                        // シグナルで書き出すファイル
+static volatile sig_atomic_t profile_dump_pending;
+
+// log2(x)（x > 0）。指数はビット位置から、仮数 [1, 2) は多項式で近似する（誤差 0.001 程度）
+// libm を使わずに済ませるため。
+static double log2_approx(uint64_t x) {
+    int e = 63 - __builtin_clzll(x);
+    double t = (double)x / (double)((uint64_t)1 << e) - 1.0;
+    return e + t * (1.4416935 + t * (-0.6992192 + t * (0.3634327 - t * 0.1066328)));
+}
+
+// 2^x（x <= 0）。整数部は割り算で、小数部 [0, 1) は多項式で近似する
+static double exp2_approx(double x) {
+    if (x < -62) return 0;
+    int i = (int)x;
+    if (i > x) i--;
+    double f = x - i;
+    double p = 0.9998130 + f * (0.6968337 + f * (0.2241305 + f * 0.0790209));
+    return p / (double)((uint64_t)1 << -i);
+}
+
+// 次のサンプルまでのバイト数（平均 interval の指数分布）
+static ptrdiff_t sample_distance(size_t interval) {
+    uint64_t x = tcache.sample_random;
+    if (x == 0) x = (uintptr_t)&tcache * 0x9e3779b97f4a7c15ULL | 1; // スレッドごとに違う種
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    tcache.sample_random = x;
+    // u = (x の上位 53 ビット + 1) / 2^53 として -ln(u) = (53 - log2(u * 2^53)) * ln 2
+    double exponential = (53.0 - log2_approx((x >> 11) + 1)) * LN2;
+    double distance = exponential * interval;
+    return distance > (double)PTRDIFF_MAX / 2 ? PTRDIFF_MAX / 2 : (ptrdiff_t)distance + 1;
+}
+
+// size バイトの確保1つが代表する推定バイト数
+static size_t sample_weight(size_t size, size_t interval) {
+    double x = (double)size / interval;
+    // 選ばれる確率 1 - exp(-x)。x が小さいと近似の誤差が効くので級数で求める
+    double p = x < 0.1 ? x * (1 - x / 2 + x * x / 6) : 1 - exp2_approx(-x / LN2);
+    return (size_t)(size / p);
+}
+
+// スタックに対応する呼び出し元を探し、なければ作る（profile_lock を保持して呼ぶ）
+static profile_site_t* profile_site_for(void** frames, int depth) {
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    for (int i = 0; i < depth; i++) {
+        hash = (hash ^ (uintptr_t)frames[i]) * 1099511628211ULL;
+    }
+    profile_site_t** bucket = &profile_sites[hash & (PROFILE_BUCKETS - 1)];
+    for (profile_site_t* site = *bucket; site; site = site->next) {
+        if (site->hash == hash && site->depth == depth &&
+            memcmp(site->frames, frames, depth * sizeof(void*)) == 0) {
+            return site;
+        }
+    }
+    profile_site_t* site = custom_calloc(1, sizeof(profile_site_t));
+    if (site == NULL) return NULL;
+    site->hash = hash;
+    site->depth = depth;
+    memcpy(site->frames, frames, depth * sizeof(void*));
+    site->next = *bucket;
+    *bucket = site;
+    return site;
+}
+
+// 1フレーム分の名前を buf に書く。dladdr で引ける名前（共有ライブラリの関数と、
+// -rdynamic でリンクした実行ファイルの static でない関数）はそのまま、
+// 引けなければ「ファイル名+0xオフセット」にする（addr2line -f -e ファイル名 で引ける）。
+static int frame_name(char* buf, size_t size, void* frame) {
+    // 戻り先アドレスなので、1つ戻して呼び出し命令の中を指す
+    void* address = (char*)frame - 1;
+    Dl_info info;
+    if (dladdr(address, &info) == 0) {
+        return snprintf(buf, size, "%p", address);
+    }
+    if (info.dli_sname) {
+        return snprintf(buf, size, "%.100s", info.dli_sname);
+    }
+    if (info.dli_fname) {
+        const char* file = strrchr(info.dli_fname, '/');
+        return snprintf(buf, size, "%.60s+0x%lx", file ? file + 1 : info.dli_fname,
+                        (unsigned long)((char*)address - (char*)info.dli_fbase));
+    }
+    return snprintf(buf, size, "%p", address);
+}
+
+// 生きているサンプルを呼び出し元ごとに folded 形式で書く（profile_lock を保持して呼ぶ）
+// 1行が1つのスタックで、外側の関数から順に ; でつなぎ、最後に推定バイト数を置く。
+// 確保や解放の途中から呼ぶこともあるので、確保せずに write で書く。
+static void write_profile(int fd) {
+    char line[PROFILE_MAX_DEPTH * 128 + 32];
+    for (int b = 0; b < PROFILE_BUCKETS; b++) {
+        for (profile_site_t* site = profile_sites[b]; site; site = site->next) {
+            if (site->live_count == 0) continue;
+            size_t n = 0;
+            for (int i = site->depth - 1; i >= 0; i--) {
+                n += frame_name(line + n, 124, site->frames[i]);
+                if (i > 0) line[n++] = ';';
+            }
+            n += snprintf(line + n, sizeof(line) - n, " %zu\n", site->live_weight);
+            ssize_t ignored = write(fd, line, n);
+            (void)ignored;
+        }
+    }
+}
+
+static void write_profile_file(void) {
+    int fd = open(profile_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    write_profile(fd);
+    close(fd);
+}
+
+// シグナルで頼まれていれば、プロファイルをファイルに書き出す（profile_lock を保持して呼ぶ）
+static void write_pending_profile(void) {
+    if (profile_dump_pending) {
+        profile_dump_pending = 0;
+        write_profile_file();
+    }
+}
+
+// 確保を記録する（確保の関数から、残りバイト数が負になったときに呼ばれる）
+// caller は custom_malloc などの戻り先で、スタックはそのフレームから記録する
+// （アロケータ内のフレームの数は最適化やインライン化で変わるので、数では飛ばさない）。
+__attribute__((noinline))
+static void sample_allocation(void* ptr, size_t size, void* caller) {
+    if (tcache.sampling) return; // 記録中の確保（表や呼び出し元の確保）は数えない
+    size_t interval = __atomic_load_n(&profile_interval, __ATOMIC_RELAXED);
+    if (interval == 0) {
+        tcache.sample_left = PROFILE_RECHECK;
+        if (profile_dump_pending) { // 無効にしたあとも、残っているサンプルは書き出せる
+            tcache.sampling = true;
+            pthread_mutex_lock(&profile_lock);
+            write_pending_profile();
+            pthread_mutex_unlock(&profile_lock);
+            tcache.sampling = false;
+        }
+        return;
+    }
+    tcache.sampling = true;
+    tcache.sample_left = sample_distance(interval);
+
+    void* frames[PROFILE_MAX_DEPTH + PROFILE_INTERNAL];
+    int depth = backtrace(frames, PROFILE_MAX_DEPTH + PROFILE_INTERNAL);
+    int skip = 0;
+    while (skip < depth && skip < PROFILE_INTERNAL && frames[skip] != caller) skip++;
+    if (skip == depth || skip == PROFILE_INTERNAL) skip = 1; // 見つからなければ自分だけ飛ばす
+    depth -= skip;
+    if (depth > PROFILE_MAX_DEPTH) depth = PROFILE_MAX_DEPTH; // 外側を切り捨てる
+    size_t weight = sample_weight(size, interval);
+
+    pthread_mutex_lock(&profile_lock);
+    profile_site_t* site = depth > 0 ? profile_site_for(frames + skip, depth) : NULL;
+    if (site && allocation_reserve(&profile_samples)) {
+        allocation_info_t info = { .ptr = ptr, .size = size, .site = site, .weight = weight };
+        allocation_put(&profile_samples, &info);
+        site->live_count++;
+        site->live_bytes += size;
+        site->live_weight += weight;
+        uint8_t* filter = &profile_filter[profile_filter_index(ptr)];
+        if (*filter < UINT8_MAX) __atomic_store_n(filter, *filter + 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&profile_live, 1, __ATOMIC_RELAXED);
+    }
+    write_pending_profile();
+    pthread_mutex_unlock(&profile_lock);
+    tcache.sampling = false;
 }
 
+// サンプルした確保が解放されたら記録から外す
+// profile_filter が 0 でないときだけ呼ばれる（別のサンプルとハッシュが衝突しただけのこともある）
+__attribute__((noinline))
+static void sample_free(void* ptr) {
+    if (tcache.sampling) return;
+    tcache.sampling = true;
+    pthread_mutex_lock(&profile_lock);
+    allocation_info_t info;
+    if (allocation_remove(&profile_samples, ptr, &info)) {
+        info.site->live_count--;
+        info.site->live_bytes -= info.size;
+        info.site->live_weight -= info.weight;
+        uint8_t* filter = &profile_filter[profile_filter_index(ptr)];
+        if (*filter < UINT8_MAX) __atomic_store_n(filter, *filter - 1, __ATOMIC_RELAXED); // 255 で止まったものは減らさない
+        __atomic_sub_fetch(&profile_live, 1, __ATOMIC_RELAXED);
+    }
+    write_pending_profile();
+    pthread_mutex_unlock(&profile_lock);
+    tcache.sampling = false;
+}
+
+// custom_mallopt(CM_SAMPLE_INTERVAL, interval)
+// 他のスレッドは、次に設定を見に来たとき（PROFILE_RECHECK バイト以内）から数え始める。
+static int profile_set_interval(size_t interval) {
+    if (interval != 0) {
+        // 最初の backtrace は libgcc_s を読み込むので（その中で確保する）、先に済ませておく
+        void* frame;
+        tcache.sampling = true;
+        backtrace(&frame, 1);
+        tcache.sampling = false;
+    }
+    __atomic_store_n(&profile_interval, interval, __ATOMIC_RELAXED);
+    tcache.sample_left = interval ? sample_distance(interval) : PROFILE_RECHECK;
+    return 1;
+}
+
+// 今のプロファイルを fd に書き出す（シグナルで頼まれた分もここで書く）
+void dump_heap_profile(int fd) {
+    tcache.sampling = true;
+    pthread_mutex_lock(&profile_lock);
+    write_profile(fd);
+    write_pending_profile();
+    pthread_mutex_unlock(&profile_lock);
+    tcache.sampling = false;
+}
+
+// ハンドラでは印を付けるだけにする。dladdr や snprintf、ロックは async-signal-safe でないので、
+// 書き出しは次にどれかのスレッドがサンプルを取るか、サンプルした確保を解放するか、
+// dump_heap_profile を呼んだときに普通の文脈で行う。
+static void profile_signal_handler(int signo) {
+    (void)signo;
+    profile_dump_pending = 1;
+}
+
+// シグナル signo を受けたら path にプロファイルを書き出すようにする。成功すれば 0
+// 書き出すのは受けた直後ではなく、確保が平均 CM_SAMPLE_INTERVAL バイト進んだころになる。
+int dump_heap_profile_on_signal(int signo, const char* path) {
+    if (strlen(path) >= sizeof(profile_path)) return -1;
+    pthread_mutex_lock(&profile_lock);
+    strcpy(profile_path, path);
+    pthread_mutex_unlock(&profile_lock);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profile_signal_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    return sigaction(signo, &action, NULL);
+}
+
+#ifndef CUSTOM_MALLOC_NO_MAIN
 int main() {
     init_heap(1024 * 1024);
+    custom_mallopt(CM_DUMP_BLOCKS, 1);
     
     int* numbers = (int*)custom_malloc(10 * sizeof(int));
     char* string = (char*)custom_malloc(100);
@@ -310,19 +2798,27 @@ int main() {
         numbers[i] = i;
     }
     strcpy(string, "Hello, World!");
+
+    // 200MB のバッファは mmap で確保され、解放すると RSS から消える
+    char* big = (char*)custom_malloc(200 * 1024 * 1024);
+    memset(big, 1, 200 * 1024 * 1024);
     
     print_memory_stats();
     
+    custom_free(big);
     custom_free(numbers);
     custom_free(string);
+
+    print_memory_stats();
     
     check_leaks();
     
     return 0;
 }
+#endif
 
 // AddressSanitizerの使用：
 // コンパイル時にASanを有効化：
 // bash 
 // gcc -g -fsanitize=address -o a.out 08_custom_malloc.c
-// ./a.out
\ No newline at end of file
+// ./a.out
\ No newline at end of file
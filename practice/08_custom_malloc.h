@@ -0,0 +1,100 @@
+// 08_custom_malloc.c の公開インターフェース
+// ベンチマークなど別ファイルから使うときは CUSTOM_MALLOC_NO_MAIN を定義して
+// 08_custom_malloc.c を一緒にコンパイルする（デモ用の main を外すため）。
+#ifndef CUSTOM_MALLOC_H
+#define CUSTOM_MALLOC_H
+
+#include <stddef.h>
+
+void init_heap(size_t initial_size);
+
+// init_heap_with の flags
+#define CM_HEAP_MMAP 1      // sbrk ではなく mmap で予約する
+#define CM_HEAP_HUGEPAGE 2  // 2 MiB 境界に揃えて madvise(MADV_HUGEPAGE) する（THP）
+#define CM_HEAP_HUGETLB 4   // MAP_HUGETLB を試し、予約済みの huge page がなければ THP にする
+#define CM_HEAP_POPULATE 8  // memset の代わりに、ページを初期化のときに割り当てておく
+void init_heap_with(size_t initial_size, int flags);
+void* custom_malloc(size_t size);
+void custom_free(void* ptr);
+void* custom_realloc(void* ptr, size_t size);
+void* custom_calloc(size_t count, size_t size);
+void* custom_memalign(size_t alignment, size_t size);
+void* custom_aligned_alloc(size_t alignment, size_t size);
+size_t custom_malloc_usable_size(void* ptr);
+size_t get_realloc_copy_count(void);
+void flush_thread_cache(void);
+void print_memory_stats(void);
+
+// custom_mallopt のパラメータ
+#define CM_MMAP_THRESHOLD 1 // このサイズ以上の確保は個別に mmap する
+#define CM_TRIM_THRESHOLD 2 // ヒープ末尾の空きがこのサイズを超えたら OS に返す
+#define CM_REALLOC_IN_PLACE 3 // 0 にすると custom_realloc は常に確保し直してコピーする
+#define CM_DUMP_BLOCKS 4 // 1 にすると print_memory_stats が全ブロックを表示する
+#define CM_THREAD_HEAPS 5 // 1 にすると小さいブロックをスレッドごとのヒープから確保する
+#define CM_SAMPLE_INTERVAL 6 // 平均このバイト数に1回、確保の呼び出し元を記録する（0 で無効）
+#define CM_DEFAULT_SAMPLE_INTERVAL (1024 * 1024)
+#define CM_FIT_POLICY 7 // 中央ヒープの空きブロックの選び方（下の CM_FIT_*）
+#define CM_FIT_BEST 0   // 収まるもののうち最小（既定）
+#define CM_FIT_FIRST 1  // アドレスの低いほうから見て最初に収まるもの
+#define CM_FIT_NEXT 2   // 前回見つけた位置からたどって最初に収まるもの
+#define CM_FIT_WORST 3  // 最大のもの
+#define CM_FIT_BUDDY 4  // 2のべき乗に切り上げて、バディ方式の領域から
+int custom_mallopt(int param, size_t value);
+void get_free_block_stats(size_t* total_free, size_t* largest_free);
+
+// get_malloc_stats が返す統計
+// 確保・解放のたびにカウンタを更新しているので、ブロックをたどらずに O(1) で返る。
+// サイズクラス i はブロックサイズ（ヘッダ込み）が [2^(i+5), 2^(i+6)) のもの。
+#define CM_STATS_CLASSES 32
+typedef struct {
+    size_t requested_bytes;     // 要求されたバイト数の累計
+    size_t allocated_bytes;     // そのために渡したブロックの累計（ヘッダと切り上げを含む）
+    size_t in_use_bytes;        // 利用者が使用中のブロックの合計
+    size_t peak_in_use_bytes;
+    size_t reserved_bytes;      // OS から取っている量（sbrk したヒープ + mmap）
+    size_t peak_reserved_bytes;
+    size_t heap_bytes;          // reserved_bytes のうち sbrk したヒープ
+    size_t mmap_bytes;          // reserved_bytes のうち個別に mmap したブロック
+    size_t thread_heap_bytes;   // reserved_bytes のうちスレッドヒープのスパン
+    size_t buddy_bytes;         // reserved_bytes のうちバディ領域のチャンク
+    size_t free_bytes;          // ヒープの空きブロックの合計
+    size_t largest_free_block;
+    double external_fragmentation; // 1 - largest_free_block / free_bytes
+    size_t alloc_count[CM_STATS_CLASSES]; // クラスごとの確保回数の累計
+    size_t live_count[CM_STATS_CLASSES];  // クラスごとの使用中のブロック数
+    size_t free_blocks[CM_STATS_CLASSES]; // 空きブロックのサイズの分布（個数）
+    size_t sbrk_calls;          // ヒープを伸縮した sbrk の回数
+    size_t mmap_calls;
+    size_t munmap_calls;
+    size_t mremap_calls;
+    size_t fit_searches;        // 空きブロックを探した回数
+    size_t fit_steps;           // そのとき調べたブロックの数（fit_steps / fit_searches が平均の探索長）
+} malloc_stats_t;
+void get_malloc_stats(malloc_stats_t* stats);
+
+// 共有ヒープ（shm_open した領域を複数のプロセスで使う）
+// 有効にしたプロセス（と、その後に fork した子）の custom_malloc などは、すべてこの領域から
+// 確保する。custom_free は、どのプロセスが確保したブロックでも受け付ける。
+// 領域の中のリンクはオフセットなので、プロセスごとにマップ先が違ってもよい。
+// プロセスをまたいでポインタを渡すときは shared_offset / shared_pointer で変換する。
+#define CM_SHARED_CREATE 1 // なければ作る（あれば size は見ずに開く）
+int init_shared_heap(const char* name, size_t size, int flags);
+void detach_shared_heap(void);
+size_t shared_offset(const void* ptr);
+void* shared_pointer(size_t offset);
+void set_shared_root(void* ptr);
+void* get_shared_root(void);
+void get_shared_heap_stats(size_t* in_use, size_t* free_size, size_t* largest_free);
+
+void* debug_malloc(size_t size, const char* file, int line);
+void debug_free(void* ptr, const char* file, int line);
+void check_leaks(void);
+
+// サンプリングしたヒーププロファイル（custom_mallopt(CM_SAMPLE_INTERVAL, n) で有効にする）
+// 生きている確保の推定バイト数を呼び出し元のスタックごとに folded 形式で書き出す。
+//   perl flamegraph.pl profile.folded > heap.svg
+void dump_heap_profile(int fd);
+// シグナルを受けたあと、次のサンプルか dump_heap_profile のときに path へ書き出す
+int dump_heap_profile_on_signal(int signo, const char* path);
+
+#endif
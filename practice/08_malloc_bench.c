@@ -0,0 +1,1181 @@
+// 08_custom_malloc.c のベンチマーク
+// ビルド:
+// gcc -O2 -pthread -DCUSTOM_MALLOC_NO_MAIN -o bench 08_malloc_bench.c 08_custom_malloc.c 08_slab.c 08_arena.c
+// 実行:
+// ./bench mix [live_slots] [ops]
+// ./bench threads [max_threads] [ops_per_thread]
+// ./bench remote [max_threads] [rounds]
+// ./bench shared [max_procs] [ops_per_proc]
+// ./bench frag [rounds] [ops_per_round]
+// ./bench trim
+// ./bench realloc [vectors] [pushes_per_vector]
+// ./bench slab [objects]
+// ./bench arena [requests] [objects_per_request]
+// ./bench bestfit [fragments] [allocs]
+// ./bench debug [ops]
+// ./bench stats [fragments]
+// ./bench profile [ops]
+// ./bench overhead [objects]
+// ./bench avx [floats] [reps]
+// ./bench hugepage [nodes]
+// ./bench preload ./libcustom_malloc.so command [args...]   （08_malloc_preload.c を参照）
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <immintrin.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "08_custom_malloc.h"
+#include "08_slab.h"
+#include "08_arena.h"
+
+typedef struct {
+    const char* name;
+    void* (*alloc)(size_t);
+    void (*release)(void*);
+} allocator_t;
+
+static const allocator_t custom_allocator = {"custom_malloc", custom_malloc, custom_free};
+static const allocator_t libc_allocator = {"glibc malloc", malloc, free};
+
+static void* debug_malloc_bench(size_t size) { return debug_malloc(size, __FILE__, __LINE__); }
+static void debug_free_bench(void* p) { debug_free(p, __FILE__, __LINE__); }
+static const allocator_t debug_allocator = {"debug_malloc", debug_malloc_bench, debug_free_bench};
+
+// 再現性のある乱数（xorshift64）
+static uint64_t rng_state = 88172645463325252ULL;
+static uint64_t next_rand(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// ランダムな確保・解放の混在
+// live_slots 個のスロットからランダムに選び、空なら確保、埋まっていれば解放する。
+// 生存ブロック数がスロット数の半分前後で推移するので、断片化したヒープでの
+// 探索コストがそのまま見える。かかった秒数を返す
+static double run_mix(const allocator_t* a, int live_slots, long ops) {
+    void** slots = calloc(live_slots, sizeof(void*));
+    rng_state = 88172645463325252ULL;
+
+    double start = now_sec();
+    for (long i = 0; i < ops; i++) {
+        int s = next_rand() % live_slots;
+        if (slots[s]) {
+            a->release(slots[s]);
+            slots[s] = NULL;
+        } else {
+            size_t size = 16 + next_rand() % 1009;
+            slots[s] = a->alloc(size);
+            memset(slots[s], 0xab, 8);
+        }
+    }
+    double elapsed = now_sec() - start;
+
+    for (int s = 0; s < live_slots; s++) {
+        if (slots[s]) a->release(slots[s]);
+    }
+    free(slots);
+    return elapsed;
+}
+
+static void bench_mix(const allocator_t* a, int live_slots, long ops) {
+    double elapsed = run_mix(a, live_slots, ops);
+    printf("%-14s slots=%d ops=%ld: %.3f s, %.2f Mops/s\n",
+           a->name, live_slots, ops, elapsed, ops / elapsed / 1e6);
+}
+
+// スレッドごとの確保・解放ループ
+typedef struct {
+    const allocator_t* a;
+    long ops;
+    uint64_t seed;
+} thread_arg_t;
+
+#define THREAD_SLOTS 1024
+
+static void* thread_mix(void* p) {
+    thread_arg_t* arg = p;
+    void* slots[THREAD_SLOTS] = {0};
+    uint64_t x = arg->seed;
+
+    for (long i = 0; i < arg->ops; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        int s = x % THREAD_SLOTS;
+        if (slots[s]) {
+            arg->a->release(slots[s]);
+            slots[s] = NULL;
+        } else {
+            size_t size = 16 + (x >> 32) % 241;  // 16〜256 バイトの小オブジェクト
+            slots[s] = arg->a->alloc(size);
+            memset(slots[s], 0xab, 8);
+        }
+    }
+    for (int s = 0; s < THREAD_SLOTS; s++) {
+        if (slots[s]) arg->a->release(slots[s]);
+    }
+    return NULL;
+}
+
+// スレッド数を倍々に増やし、全体のスループットを測る
+static void bench_threads(const allocator_t* a, int max_threads, long ops_per_thread) {
+    pthread_t* threads = malloc(max_threads * sizeof(pthread_t));
+    thread_arg_t* args = malloc(max_threads * sizeof(thread_arg_t));
+
+    for (int n = 1; n <= max_threads; n *= 2) {
+        double start = now_sec();
+        for (int t = 0; t < n; t++) {
+            args[t].a = a;
+            args[t].ops = ops_per_thread;
+            args[t].seed = 88172645463325252ULL + t * 7919;
+            pthread_create(&threads[t], NULL, thread_mix, &args[t]);
+        }
+        for (int t = 0; t < n; t++) {
+            pthread_join(threads[t], NULL);
+        }
+        double elapsed = now_sec() - start;
+        printf("%-14s threads=%2d: %.3f s, %.2f Mops/s\n",
+               a->name, n, elapsed, n * ops_per_thread / elapsed / 1e6);
+    }
+
+    free(threads);
+    free(args);
+}
+
+// 別のスレッドが確保したものを解放する（producer/consumer の形）
+// 各スレッドが REMOTE_BATCH 個確保して自分の枠に置き、全員そろったら隣のスレッドの枠の
+// ものを解放する、を rounds 回くり返す。解放はすべて他のスレッドが確保したブロックになる。
+#define REMOTE_BATCH 4096
+
+typedef struct {
+    const allocator_t* a;
+    int index;
+    int threads;
+    int rounds;
+    void*** batches;           // スレッドごとの枠
+    pthread_barrier_t* barrier;
+} remote_arg_t;
+
+static void* thread_remote(void* p) {
+    remote_arg_t* arg = p;
+    void** mine = arg->batches[arg->index];
+    void** neighbor = arg->batches[(arg->index + 1) % arg->threads];
+    uint64_t x = 88172645463325252ULL + arg->index * 7919;
+
+    for (int r = 0; r < arg->rounds; r++) {
+        for (int i = 0; i < REMOTE_BATCH; i++) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            mine[i] = arg->a->alloc(16 + (x >> 32) % 241); // 16〜256 バイト
+            memset(mine[i], 0xab, 8);
+        }
+        pthread_barrier_wait(arg->barrier);
+        for (int i = 0; i < REMOTE_BATCH; i++) {
+            arg->a->release(neighbor[i]);
+        }
+        pthread_barrier_wait(arg->barrier);
+    }
+    return NULL;
+}
+
+static void run_remote(const allocator_t* a, const char* name, int threads, int rounds) {
+    pthread_t* ids = malloc(threads * sizeof(pthread_t));
+    remote_arg_t* args = malloc(threads * sizeof(remote_arg_t));
+    void*** batches = malloc(threads * sizeof(void**));
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, threads);
+    for (int t = 0; t < threads; t++) {
+        batches[t] = malloc(REMOTE_BATCH * sizeof(void*));
+    }
+
+    double start = now_sec();
+    for (int t = 0; t < threads; t++) {
+        args[t] = (remote_arg_t){a, t, threads, rounds, batches, &barrier};
+        pthread_create(&ids[t], NULL, thread_remote, &args[t]);
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(ids[t], NULL);
+    }
+    double elapsed = now_sec() - start;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%-22s threads=%2d: %.2f Mops/s, max RSS %6ld KiB\n", name, threads,
+           2.0 * threads * rounds * REMOTE_BATCH / elapsed / 1e6, usage.ru_maxrss);
+
+    for (int t = 0; t < threads; t++) {
+        free(batches[t]);
+    }
+    pthread_barrier_destroy(&barrier);
+    free(batches);
+    free(args);
+    free(ids);
+}
+
+static void bench_remote(int max_threads, int rounds) {
+    for (int n = 2; n <= max_threads; n *= 2) {
+        for (int mode = 0; mode < 3; mode++) {
+            // 最大 RSS も比べるので、毎回 fork した子で測る
+            fflush(stdout);
+            if (fork() == 0) {
+                if (mode == 0) {
+                    run_remote(&libc_allocator, "glibc malloc", n, rounds);
+                } else if (mode == 1) {
+                    run_remote(&custom_allocator, "custom_malloc (tcache)", n, rounds);
+                } else {
+                    custom_mallopt(CM_THREAD_HEAPS, 1);
+                    run_remote(&custom_allocator, "custom_malloc (theap)", n, rounds);
+                }
+                exit(0);
+            }
+            wait(NULL);
+        }
+    }
+}
+
+// 共有ヒープ: fork したプロセスたちが、共有の枠（オフセットの配列）に確保したものを
+// exchange で置き、入れ替わりに取り出したもの（たいていは他のプロセスが確保したもの）を
+// 確かめて解放する。奇数番目のプロセスはマップし直して、親と違うアドレスから使う。
+// 比べるのは、同じことを各プロセスが自分のヒープと自分の枠だけで行う場合。
+#define SHARED_SLOTS 4096
+#define SHARED_HEAP_SIZE (64 * 1024 * 1024)
+#define SHARED_NAME "/custom_malloc_bench"
+
+// 1プロセス分。壊れていたオブジェクトの数を返す
+static long shared_worker(uint64_t* slots, bool shared, int index, long ops) {
+    uint64_t x = 88172645463325252ULL + index * 7919;
+    long errors = 0;
+    for (long i = 0; i < ops; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        uint32_t size = 16 + (x >> 32) % 497; // 16〜512 バイト
+        uint32_t* p = custom_malloc(size);
+        if (p == NULL) {
+            errors++;
+            continue;
+        }
+        p[0] = size;
+        p[1] = (uint32_t)x;
+        ((uint8_t*)p)[size - 1] = (uint8_t)x;
+
+        uint64_t value = shared ? shared_offset(p) : (uint64_t)(uintptr_t)p;
+        uint64_t old = __atomic_exchange_n(&slots[(x >> 8) % SHARED_SLOTS], value, __ATOMIC_ACQ_REL);
+        if (old == 0) continue;
+        uint32_t* q = shared ? shared_pointer(old) : (uint32_t*)(uintptr_t)old;
+        if (((uint8_t*)q)[q[0] - 1] != (uint8_t)q[1]) errors++;
+        custom_free(q);
+    }
+    return errors;
+}
+
+static void run_shared(int procs, long ops, bool shared) {
+    if (shared) {
+        shm_unlink(SHARED_NAME);
+        if (init_shared_heap(SHARED_NAME, SHARED_HEAP_SIZE, CM_SHARED_CREATE) != 0) {
+            perror("init_shared_heap");
+            return;
+        }
+        set_shared_root(custom_calloc(SHARED_SLOTS, sizeof(uint64_t)));
+    }
+
+    double start = now_sec();
+    for (int p = 0; p < procs; p++) {
+        if (fork() != 0) continue;
+        uint64_t* slots;
+        if (!shared) {
+            slots = calloc(SHARED_SLOTS, sizeof(uint64_t));
+        } else if (p % 2 == 1) {
+            // 元のアドレスを塞いでから開き直す
+            detach_shared_heap();
+            mmap(NULL, SHARED_HEAP_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (init_shared_heap(SHARED_NAME, 0, 0) != 0) _exit(1);
+            slots = get_shared_root();
+        } else {
+            slots = get_shared_root();
+        }
+        _exit(shared_worker(slots, shared, p, ops) != 0);
+    }
+    int failed = 0;
+    for (int p = 0; p < procs; p++) {
+        int status;
+        wait(&status);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+    }
+    double elapsed = now_sec() - start;
+    printf("%-23s procs=%2d: %.2f Mops/s", shared ? "custom_malloc (shared)" : "custom_malloc (private)",
+           procs, 2.0 * procs * ops / elapsed / 1e6);
+
+    if (shared) {
+        // 残りを親が解放すると、全体が1つの空きブロックに戻るはず
+        uint64_t* slots = get_shared_root();
+        for (int i = 0; i < SHARED_SLOTS; i++) {
+            if (slots[i]) custom_free(shared_pointer(slots[i]));
+        }
+        custom_free(slots);
+        size_t in_use, free_size, largest;
+        get_shared_heap_stats(&in_use, &free_size, &largest);
+        printf(", in_use %zu, free %zu / largest %zu", in_use, free_size, largest);
+        detach_shared_heap();
+        shm_unlink(SHARED_NAME);
+    }
+    printf("%s\n", failed ? ", FAILED" : "");
+}
+
+static void bench_shared(int max_procs, long ops) {
+    for (int n = 1; n <= max_procs; n *= 2) {
+        run_shared(n, ops, false);
+        run_shared(n, ops, true);
+    }
+}
+
+// 長時間動かしたときの断片化の推移
+// 小さい長寿命ブロックと大きい短寿命ブロックを混ぜて確保・解放を繰り返し、
+// ラウンドごとに「最大空きブロック / 空き合計」を表示する。
+// 1.0 に近いほど空き領域がまとまっており、0 に近いほど細切れになっている。
+#define FRAG_SLOTS 20000
+
+static void bench_frag(int rounds, long ops_per_round) {
+    void** slots = calloc(FRAG_SLOTS, sizeof(void*));
+    rng_state = 88172645463325252ULL;
+
+    printf("%6s %12s %12s %8s\n", "round", "free bytes", "largest", "ratio");
+    for (int r = 1; r <= rounds; r++) {
+        for (long i = 0; i < ops_per_round; i++) {
+            int s = next_rand() % FRAG_SLOTS;
+            if (slots[s]) {
+                // 大きいブロック（奇数スロット）ほど早く解放される
+                if ((s & 1) || next_rand() % 8 == 0) {
+                    custom_free(slots[s]);
+                    slots[s] = NULL;
+                }
+            } else {
+                size_t size = (s & 1) ? 1024 + next_rand() % 15361 : 16 + next_rand() % 241;
+                slots[s] = custom_malloc(size);
+            }
+        }
+        size_t total_free, largest_free;
+        get_free_block_stats(&total_free, &largest_free);
+        printf("%6d %12zu %12zu %8.3f\n", r, total_free, largest_free,
+               total_free ? (double)largest_free / total_free : 1.0);
+    }
+
+    for (int s = 0; s < FRAG_SLOTS; s++) {
+        if (slots[s]) custom_free(slots[s]);
+    }
+    flush_thread_cache();
+    size_t total_free, largest_free;
+    get_free_block_stats(&total_free, &largest_free);
+    printf("%6s %12zu %12zu %8.3f\n", "end", total_free, largest_free,
+           total_free ? (double)largest_free / total_free : 1.0);
+    free(slots);
+}
+
+static size_t rss_kib(void) {
+    FILE* f = fopen("/proc/self/statm", "r");
+    unsigned long vm_pages = 0, rss_pages = 0;
+    if (f) {
+        if (fscanf(f, "%lu %lu", &vm_pages, &rss_pages) != 2) rss_pages = 0;
+        fclose(f);
+    }
+    return rss_pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// 200MB を確保・解放したあと RSS が戻るかを見る
+// 1) 200MB 1個: mmap の経路
+// 2) 64KiB x 3200個: sbrk ヒープの経路（解放後に末尾が縮められる）
+#define TRIM_TOTAL (200L * 1024 * 1024)
+#define TRIM_CHUNK (64 * 1024)
+
+static void bench_trim(void) {
+    printf("start                 RSS %7zu KiB\n", rss_kib());
+
+    char* big = custom_malloc(TRIM_TOTAL);
+    memset(big, 1, TRIM_TOTAL);
+    printf("200MB x1 allocated    RSS %7zu KiB\n", rss_kib());
+    custom_free(big);
+    printf("200MB x1 freed        RSS %7zu KiB\n", rss_kib());
+
+    int n = TRIM_TOTAL / TRIM_CHUNK;
+    char** chunks = malloc(n * sizeof(char*));
+    for (int i = 0; i < n; i++) {
+        chunks[i] = custom_malloc(TRIM_CHUNK);
+        memset(chunks[i], 1, TRIM_CHUNK);
+    }
+    printf("64KiB x%d allocated RSS %7zu KiB\n", n, rss_kib());
+    for (int i = n - 1; i >= 0; i--) {
+        custom_free(chunks[i]);
+    }
+    printf("64KiB x%d freed     RSS %7zu KiB\n", n, rss_kib());
+    free(chunks);
+}
+
+// 可変長配列（vector）への push を custom_realloc で伸ばしていく
+// 容量が足りなくなるたびに 1.5 倍に伸ばす。vectors 本を交互に伸ばすので、
+// 1本だけなら毎回ヒープ末尾で伸ばせるが、複数本だと隣が使用中のこともある。
+typedef struct {
+    long* data;
+    size_t len;
+    size_t cap;
+} vector_t;
+
+static void run_vector_push(int vectors, long pushes, bool in_place) {
+    custom_mallopt(CM_REALLOC_IN_PLACE, in_place);
+    vector_t* v = calloc(vectors, sizeof(vector_t));
+    size_t copies_before = get_realloc_copy_count();
+
+    double start = now_sec();
+    for (long i = 0; i < pushes; i++) {
+        for (int k = 0; k < vectors; k++) {
+            if (v[k].len == v[k].cap) {
+                v[k].cap = v[k].cap ? v[k].cap + v[k].cap / 2 : 4;
+                v[k].data = custom_realloc(v[k].data, v[k].cap * sizeof(long));
+            }
+            v[k].data[v[k].len++] = i;
+        }
+    }
+    double elapsed = now_sec() - start;
+    size_t copies = get_realloc_copy_count() - copies_before;
+
+    long errors = 0;
+    for (int k = 0; k < vectors; k++) {
+        for (long i = 0; i < pushes; i++) {
+            if (v[k].data[i] != i) errors++;
+        }
+        custom_free(v[k].data);
+    }
+    free(v);
+
+    printf("vectors=%2d pushes=%ld in_place=%d: %.3f s, copies=%zu%s\n",
+           vectors, pushes, in_place, elapsed, copies, errors ? " (DATA ERROR)" : "");
+    custom_mallopt(CM_REALLOC_IN_PLACE, 1);
+}
+
+static void bench_realloc(int vectors, long pushes) {
+    run_vector_push(1, pushes * vectors, false);
+    run_vector_push(1, pushes * vectors, true);
+    run_vector_push(vectors, pushes, false);
+    run_vector_push(vectors, pushes, true);
+}
+
+// 固定サイズオブジェクト: スラブ vs custom_malloc
+// objects 個を確保 → ランダムに半分解放 → 半分確保し直し → 全解放、を繰り返す。
+// 全部確保した時点の RSS の増分から、1オブジェクトあたりの実メモリも出す。
+static slab_cache_t* bench_cache;
+static void* slab_alloc_bench(size_t size) { (void)size; return slab_alloc(bench_cache); }
+static void slab_free_bench(void* p) { slab_free(bench_cache, p); }
+
+static void run_fixed_size(const allocator_t* a, size_t size, int objects, int rounds) {
+    void** objs = calloc(objects, sizeof(void*));
+    memset(objs, 0, objects * sizeof(void*)); // RSS の増分に配列自体を含めないよう先に触っておく
+    rng_state = 88172645463325252ULL;
+    size_t rss_before = rss_kib();
+    size_t rss_peak = 0;
+    long ops = 0;
+
+    double start = now_sec();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < objects; i++) {
+            objs[i] = a->alloc(size);
+            memset(objs[i], 0, 8);
+        }
+        if (r == 0) rss_peak = rss_kib();
+        for (int i = 0; i < objects; i += 2) {
+            int j = next_rand() % objects;
+            void* tmp = objs[i]; objs[i] = objs[j]; objs[j] = tmp;
+        }
+        for (int i = 0; i < objects / 2; i++) a->release(objs[i]);
+        for (int i = 0; i < objects / 2; i++) objs[i] = a->alloc(size);
+        for (int i = 0; i < objects; i++) a->release(objs[i]);
+        ops += objects * 3L;
+    }
+    double elapsed = now_sec() - start;
+
+    printf("%-14s %4zu B x %d: %.3f s, %6.2f Mops/s, %5.1f bytes/object\n",
+           a->name, size, objects, elapsed, ops / elapsed / 1e6,
+           (rss_peak - rss_before) * 1024.0 / objects);
+    free(objs);
+}
+
+// RSS を比べられるよう、計測ごとに fork した子プロセスで動かす
+static void bench_slab(int objects) {
+    static const size_t sizes[] = {32, 64, 128};
+    for (int i = 0; i < 3; i++) {
+        fflush(stdout);
+        if (fork() == 0) {
+            bench_cache = slab_cache_create("bench", sizes[i]);
+            allocator_t slab_allocator = {"slab_alloc", slab_alloc_bench, slab_free_bench};
+            run_fixed_size(&slab_allocator, sizes[i], objects, 5);
+            slab_cache_print_stats(bench_cache);
+            slab_cache_destroy(bench_cache);
+            exit(0);
+        }
+        wait(NULL);
+        fflush(stdout);
+        if (fork() == 0) {
+            run_fixed_size(&custom_allocator, sizes[i], objects, 5);
+            exit(0);
+        }
+        wait(NULL);
+        printf("\n");
+    }
+}
+
+// リクエスト単位の処理: 1リクエストで objects 個をまとめて確保し、最後に全部捨てる
+static void run_requests(const allocator_t* a, arena_t* arena, int requests, int objects) {
+    void** objs = malloc(objects * sizeof(void*));
+    rng_state = 88172645463325252ULL;
+
+    double start = now_sec();
+    for (int r = 0; r < requests; r++) {
+        for (int i = 0; i < objects; i++) {
+            size_t size = 16 + next_rand() % 241;
+            objs[i] = arena ? arena_alloc(arena, size) : a->alloc(size);
+            memset(objs[i], 0, 8);
+        }
+        if (arena) {
+            arena_reset(arena);
+        } else {
+            for (int i = 0; i < objects; i++) a->release(objs[i]);
+        }
+    }
+    double elapsed = now_sec() - start;
+
+    printf("%-14s requests=%d objects=%d: %.3f s, %.2f M objects/s\n",
+           arena ? "arena" : a->name, requests, objects, elapsed,
+           (double)requests * objects / elapsed / 1e6);
+    free(objs);
+}
+
+static void bench_arena(int requests, int objects) {
+    arena_t* arena = arena_create(0);
+    run_requests(NULL, arena, requests, objects);
+    printf("arena reserved: %zu bytes\n", arena_reserved_bytes(arena));
+    arena_destroy(arena);
+    run_requests(&custom_allocator, NULL, requests, objects);
+    run_requests(&libc_allocator, NULL, requests, objects);
+}
+
+// 使用中ブロックで区切られた空きブロック（統合できない断片）を fragments 個作ってから、
+// ランダムなサイズを allocs 回確保してベストフィット探索の速さを測る。
+// 断片は 16 の倍数、確保は 16 の倍数 + 8 バイトにして、ちょうど同じサイズの空きが
+// 見つかって探索が早く終わることがないようにする。
+static void bench_bestfit(long fragments, long allocs) {
+    void** blocks = malloc(fragments * 2 * sizeof(void*));
+    rng_state = 88172645463325252ULL;
+
+    for (long i = 0; i < fragments * 2; i++) {
+        // 偶数番目が後で解放する断片、奇数番目は区切りとして残す
+        size_t size = (i & 1) ? 16 : 16 * (1 + next_rand() % 32);
+        blocks[i] = custom_malloc(size);
+    }
+    for (long i = 0; i < fragments * 2; i += 2) {
+        custom_free(blocks[i]);
+    }
+    flush_thread_cache(); // キャッシュに残った分も中央ヒープの空きブロックにする
+
+    size_t total_free, largest_free;
+    get_free_block_stats(&total_free, &largest_free);
+    printf("fragments=%ld free=%zu bytes\n", fragments, total_free);
+
+    void** got = malloc(allocs * sizeof(void*));
+    double start = now_sec();
+    for (long i = 0; i < allocs; i++) {
+        got[i] = custom_malloc(8 + 16 * (next_rand() % 32));
+    }
+    double elapsed = now_sec() - start;
+    printf("allocs=%ld: %.3f s, %.3f us/alloc\n", allocs, elapsed, elapsed / allocs * 1e6);
+
+    for (long i = 0; i < allocs; i++) custom_free(got[i]);
+    for (long i = 1; i < fragments * 2; i += 2) custom_free(blocks[i]);
+    free(got);
+    free(blocks);
+}
+
+// 小さいオブジェクトを objects 個確保したままにして、RSS の増分から1個あたりの消費を出す
+// size = 0 なら 8〜64 バイトのランダムなサイズ
+static void run_small_objects(const allocator_t* a, size_t size, int objects) {
+    void** objs = calloc(objects, sizeof(void*));
+    memset(objs, 0, objects * sizeof(void*));
+    rng_state = 88172645463325252ULL;
+    size_t requested = 0;
+    size_t rss_before = rss_kib();
+    for (int i = 0; i < objects; i++) {
+        size_t n = size ? size : 8 + next_rand() % 57;
+        objs[i] = a->alloc(n);
+        memset(objs[i], 0, n);
+        requested += n;
+    }
+    size_t used = (rss_kib() - rss_before) * 1024;
+    char label[24];
+    if (size) snprintf(label, sizeof(label), "%zu", size);
+    else snprintf(label, sizeof(label), "8-64");
+    printf("%-14s %4s B x %d: %6.1f bytes/object, overhead %5.1f%%\n", a->name,
+           label, objects, (double)used / objects,
+           100.0 * ((double)used - requested) / requested);
+    free(objs);
+}
+
+// 統計の取得: bestfit と同じく統合できない空き断片を大量に作り、その状態で統計を取る時間を測る
+static void bench_stats(long fragments, int calls) {
+    void** blocks = malloc(fragments * 2 * sizeof(void*));
+    rng_state = 88172645463325252ULL;
+    for (long i = 0; i < fragments * 2; i++) {
+        size_t size = (i & 1) ? 16 : 16 * (1 + next_rand() % 32);
+        blocks[i] = custom_malloc(size);
+    }
+    for (long i = 0; i < fragments * 2; i += 2) {
+        custom_free(blocks[i]);
+    }
+    flush_thread_cache();
+
+    size_t total_free, largest_free;
+    double start = now_sec();
+    for (int i = 0; i < calls; i++) {
+        get_free_block_stats(&total_free, &largest_free);
+    }
+    double elapsed = now_sec() - start;
+    printf("get_free_block_stats x%d: %.3f us/call\n", calls, elapsed / calls * 1e6);
+
+    malloc_stats_t stats;
+    start = now_sec();
+    for (int i = 0; i < calls; i++) {
+        get_malloc_stats(&stats);
+    }
+    elapsed = now_sec() - start;
+    printf("get_malloc_stats     x%d: %.3f us/call\n", calls, elapsed / calls * 1e6);
+
+    size_t free_blocks = 0;
+    for (int i = 0; i < CM_STATS_CLASSES; i++) free_blocks += stats.free_blocks[i];
+    printf("in use %zu (peak %zu), reserved %zu (peak %zu), requested/allocated %.3f\n",
+           stats.in_use_bytes, stats.peak_in_use_bytes, stats.reserved_bytes,
+           stats.peak_reserved_bytes, (double)stats.requested_bytes / stats.allocated_bytes);
+    printf("free %zu bytes in %zu blocks, largest %zu, external fragmentation %.3f\n",
+           stats.free_bytes, free_blocks, stats.largest_free_block, stats.external_fragmentation);
+    printf("sbrk %zu, mmap %zu, munmap %zu, mremap %zu\n",
+           stats.sbrk_calls, stats.mmap_calls, stats.munmap_calls, stats.mremap_calls);
+
+    for (long i = 1; i < fragments * 2; i += 2) custom_free(blocks[i]);
+    free(blocks);
+}
+
+// プロファイルの推定が合っているかを見るための、呼び出し元の違う2か所
+__attribute__((noinline)) static void* profile_small(void) {
+    void* p = custom_malloc(100);
+    __asm__ volatile("" : : : "memory"); // 末尾呼び出しにしない（スタックに残す）
+    return p;
+}
+
+__attribute__((noinline)) static void* profile_large(void) {
+    void* p = custom_malloc(24 * 1024);
+    __asm__ volatile("" : : : "memory");
+    return p;
+}
+
+// 1回のサンプル（確保と解放の両方）にかかる時間を、全部サンプルする間隔 1 と無効のときの差で測る
+static void profile_sample_cost(int count) {
+    void** p = malloc(count * sizeof(void*));
+    double elapsed[2];
+    for (int sampled = 0; sampled < 2; sampled++) {
+        custom_mallopt(CM_SAMPLE_INTERVAL, sampled);
+        double start = now_sec();
+        for (int j = 0; j < count; j++) p[j] = profile_small();
+        for (int j = 0; j < count; j++) custom_free(p[j]);
+        elapsed[sampled] = now_sec() - start;
+    }
+    custom_mallopt(CM_SAMPLE_INTERVAL, 0);
+    free(p);
+    printf("sample cost: %.2f us (unsampled %.3f us)\n",
+           (elapsed[1] - elapsed[0]) / count * 1e6, elapsed[0] / count * 1e6);
+}
+
+// サンプリングの間隔ごとに、mix と threads の速さと推定の誤差を比べる（子プロセスで計測）
+// mix はぶれが大きいので 5回測って最速と中央の値を出す。
+static void bench_profile(long ops) {
+    static const size_t intervals[] = {0, CM_DEFAULT_SAMPLE_INTERVAL, 512 * 1024, 64 * 1024};
+    for (int i = -1; i < 4; i++) {
+        fflush(stdout);
+        if (fork() != 0) {
+            wait(NULL);
+            continue;
+        }
+        if (i < 0) {
+            profile_sample_cost(100000);
+            exit(0);
+        }
+        printf("interval %zu\n", intervals[i]);
+        custom_mallopt(CM_SAMPLE_INTERVAL, intervals[i]);
+        double runs[5];
+        for (int r = 0; r < 5; r++) {
+            double elapsed = run_mix(&custom_allocator, 20000, ops);
+            int k = r;
+            for (; k > 0 && runs[k - 1] > elapsed; k--) runs[k] = runs[k - 1]; // 挿入ソート
+            runs[k] = elapsed;
+        }
+        printf("%-14s slots=%d ops=%ld: best %.2f Mops/s, median %.2f Mops/s\n",
+               custom_allocator.name, 20000, ops, ops / runs[0] / 1e6, ops / runs[2] / 1e6);
+        bench_threads(&custom_allocator, 1, ops);
+
+        // 100 B x 20万個（20 MB）と 24 KiB x 800個（19.7 MB）を生かしたまま書き出す
+        void** small = malloc(200000 * sizeof(void*));
+        void** large = malloc(800 * sizeof(void*));
+        for (int j = 0; j < 200000; j++) small[j] = profile_small();
+        for (int j = 0; j < 800; j++) large[j] = profile_large();
+        FILE* f = tmpfile();
+        dump_heap_profile(fileno(f));
+        rewind(f);
+        char line[8192];
+        size_t total = 0;
+        int stacks = 0;
+        while (fgets(line, sizeof(line), f)) {
+            char* weight = strrchr(line, ' ');
+            if (weight) total += strtoull(weight + 1, NULL, 10);
+            stacks++;
+        }
+        fclose(f);
+        size_t live = 200000 * 100 + 800 * 24 * 1024;
+        if (intervals[i] != 0) {
+            printf("profile: %d stacks, estimated %.1f MB / live %.1f MB\n",
+                   stacks, total / 1e6, live / 1e6);
+        }
+        for (int j = 0; j < 200000; j++) custom_free(small[j]);
+        for (int j = 0; j < 800; j++) custom_free(large[j]);
+        free(small);
+        free(large);
+        exit(0);
+    }
+}
+
+static void bench_overhead(int objects) {
+    static const size_t sizes[] = {8, 16, 24, 32, 48, 64, 128, 0};
+    for (int i = 0; i < 8; i++) {
+        const allocator_t* allocators[] = {&custom_allocator, &libc_allocator};
+        for (int j = 0; j < 2; j++) {
+            // ヒープの使い回しが RSS に出ないよう、毎回 fork した子で測る
+            fflush(stdout);
+            if (fork() == 0) {
+                run_small_objects(allocators[j], sizes[i], objects);
+                exit(0);
+            }
+            wait(NULL);
+        }
+    }
+}
+
+// y = a * x + y を AVX で（1回に8個の float）
+// aligned なら 32 バイト境界前提の load/store、そうでなければ loadu/storeu を使う
+__attribute__((target("avx")))
+static void saxpy_avx(float* y, const float* x, float a, size_t n, bool aligned) {
+    __m256 va = _mm256_set1_ps(a);
+    if (aligned) {
+        for (size_t i = 0; i < n; i += 8) {
+            __m256 v = _mm256_add_ps(_mm256_mul_ps(va, _mm256_load_ps(x + i)), _mm256_load_ps(y + i));
+            _mm256_store_ps(y + i, v);
+        }
+    } else {
+        for (size_t i = 0; i < n; i += 8) {
+            __m256 v = _mm256_add_ps(_mm256_mul_ps(va, _mm256_loadu_ps(x + i)), _mm256_loadu_ps(y + i));
+            _mm256_storeu_ps(y + i, v);
+        }
+    }
+}
+
+// offset バイトずらしたバッファで saxpy を回す。offset = 16 だと 32 バイトの
+// ロード/ストアの半分がキャッシュライン（64 バイト）をまたぐ。
+static void run_saxpy(size_t n, int reps, size_t offset) {
+    char* xraw = custom_memalign(64, n * sizeof(float) + 64);
+    char* yraw = custom_memalign(64, n * sizeof(float) + 64);
+    float* x = (float*)(xraw + offset);
+    float* y = (float*)(yraw + offset);
+    for (size_t i = 0; i < n; i++) {
+        x[i] = (float)i;
+        y[i] = 1.0f;
+    }
+
+    // 5回測って最短を取る（共有マシンでのばらつき対策）
+    double elapsed = 0;
+    for (int trial = 0; trial < 5; trial++) {
+        double start = now_sec();
+        for (int r = 0; r < reps; r++) {
+            saxpy_avx(y, x, 0.5f, n, offset % 32 == 0);
+        }
+        double t = now_sec() - start;
+        if (trial == 0 || t < elapsed) elapsed = t;
+    }
+    printf("n=%-9zu offset=%2zu: %.3f s, %.2f GFLOP/s\n", n, offset, elapsed,
+           2.0 * n * reps / elapsed / 1e9);
+    custom_free(xraw);
+    custom_free(yraw);
+}
+
+static void bench_avx(size_t n, int reps) {
+    if (!__builtin_cpu_supports("avx")) {
+        printf("AVX is not supported on this CPU\n");
+        return;
+    }
+    // L1 に収まる大きさと、メモリ帯域で律速する大きさの両方
+    size_t sizes[] = {2048, n};
+    for (int i = 0; i < 2; i++) {
+        size_t count = sizes[i] & ~(size_t)7;
+        int r = (int)((double)reps * n / count);
+        run_saxpy(count, r, 0);
+        run_saxpy(count, r, 4);
+        run_saxpy(count, r, 16);
+    }
+}
+
+// dTLB のロードミスを数えるカウンタを開く（使えなければ -1）
+// 仮想マシンなどで PMU が見えないときや、perf_event_paranoid が高いときは失敗する。
+static int open_dtlb_counter(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// /proc/self/smaps_rollup の AnonHugePages（KiB）
+static long anon_huge_kib(void) {
+    FILE* f = fopen("/proc/self/smaps_rollup", "r");
+    if (f == NULL) return -1;
+    char line[256];
+    long kib = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "AnonHugePages: %ld kB", &kib) == 1) break;
+    }
+    fclose(f);
+    return kib;
+}
+
+typedef struct node {
+    struct node* next;
+    char pad[48]; // 確保サイズ 56 B、ブロック 64 B
+} node_t;
+
+// init_heap_with でヒープを作り、そこから確保した nodes 個のノードを
+// ランダムな1つの輪につないでたどる（1歩ごとに別のページに飛ぶので TLB に厳しい）
+static void run_pointer_chase(const char* name, int flags, int nodes) {
+    size_t heap_size = (size_t)nodes * sizeof(node_t) * 5 / 4;
+    double start = now_sec();
+    init_heap_with(heap_size, flags);
+    double init_time = now_sec() - start;
+
+    node_t** order = malloc((size_t)nodes * sizeof(node_t*));
+    for (int i = 0; i < nodes; i++) {
+        order[i] = custom_malloc(sizeof(node_t));
+    }
+    // Sattolo のアルゴリズムで、全体が1つの輪になる順列を作る
+    rng_state = 88172645463325252ULL;
+    for (int i = nodes - 1; i > 0; i--) {
+        int j = (int)(next_rand() % (uint64_t)i);
+        node_t* tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    for (int i = 0; i < nodes; i++) {
+        order[i]->next = order[(i + 1) % nodes];
+    }
+    node_t* p = order[0];
+    free(order);
+
+    int fd = open_dtlb_counter();
+    long steps = (long)nodes * 4;
+    if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    start = now_sec();
+    for (long i = 0; i < steps; i++) {
+        p = p->next;
+    }
+    double elapsed = now_sec() - start;
+    if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    __asm__ volatile("" : : "r"(p));
+
+    uint64_t misses = 0;
+    char miss_text[32] = "unavailable";
+    if (fd >= 0 && read(fd, &misses, sizeof(misses)) == sizeof(misses)) {
+        snprintf(miss_text, sizeof(miss_text), "%.3f/step", (double)misses / steps);
+    }
+    if (fd >= 0) close(fd);
+
+    printf("%-16s init %7.2f ms, chase %5.1f ns/step, dTLB miss %-12s AnonHugePages %6ld KiB\n",
+           name, init_time * 1e3, elapsed / steps * 1e9, miss_text, anon_huge_kib());
+}
+
+static void bench_hugepage(int nodes) {
+    static const struct {
+        const char* name;
+        int flags;
+    } modes[] = {
+        {"sbrk", 0},
+        {"sbrk+populate", CM_HEAP_POPULATE},
+        {"mmap+populate", CM_HEAP_MMAP | CM_HEAP_POPULATE},
+        {"thp+populate", CM_HEAP_HUGEPAGE | CM_HEAP_POPULATE},
+        {"hugetlb+populate", CM_HEAP_HUGETLB | CM_HEAP_POPULATE},
+    };
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        // ヒープは1回しか初期化できないので、子プロセスごとに作る
+        fflush(stdout);
+        if (fork() == 0) {
+            run_pointer_chase(modes[i].name, modes[i].flags, nodes);
+            exit(0);
+        }
+        wait(NULL);
+    }
+}
+
+// 既存のプログラムを glibc の malloc と LD_PRELOAD した custom_malloc で3回ずつ動かし、
+// 最短の実行時間と最大 RSS（wait4 の ru_maxrss）を比べる
+static void run_command(const char* preload, char** argv) {
+    double best = 0;
+    long max_rss = 0;
+    for (int i = 0; i < 3; i++) {
+        double start = now_sec();
+        pid_t pid = fork();
+        if (pid == 0) {
+            if (preload) setenv("LD_PRELOAD", preload, 1);
+            int devnull = open("/dev/null", O_WRONLY);
+            dup2(devnull, STDOUT_FILENO);
+            execvp(argv[0], argv);
+            perror(argv[0]);
+            _exit(127);
+        }
+        int status;
+        struct rusage usage;
+        wait4(pid, &status, 0, &usage);
+        double elapsed = now_sec() - start;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("%s: command failed (status %d)\n", preload ? preload : "glibc", status);
+            return;
+        }
+        if (i == 0 || elapsed < best) best = elapsed;
+        if (usage.ru_maxrss > max_rss) max_rss = usage.ru_maxrss;
+    }
+    printf("%-24s %.3f s, max RSS %ld KiB\n", preload ? preload : "glibc malloc", best, max_rss);
+}
+
+static void bench_preload(const char* library, char** argv) {
+    run_command(NULL, argv);
+    run_command(library, argv);
+}
+
+int main(int argc, char** argv) {
+    const char* mode = argc > 1 ? argv[1] : "mix";
+
+    // ヒープの作り方を比べるので、init_heap より前に分ける
+    if (strcmp(mode, "hugepage") == 0) {
+        bench_hugepage(argc > 2 ? atoi(argv[2]) : 4 * 1024 * 1024);
+        return 0;
+    }
+
+    init_heap(1024 * 1024);
+
+    if (strcmp(mode, "mix") == 0) {
+        int live_slots = argc > 2 ? atoi(argv[2]) : 400000;
+        long ops = argc > 3 ? atol(argv[3]) : 2000000;
+        bench_mix(&custom_allocator, live_slots, ops);
+        bench_mix(&libc_allocator, live_slots, ops);
+    } else if (strcmp(mode, "threads") == 0) {
+        int max_threads = argc > 2 ? atoi(argv[2]) : 16;
+        long ops = argc > 3 ? atol(argv[3]) : 1000000;
+        bench_threads(&custom_allocator, max_threads, ops);
+        bench_threads(&libc_allocator, max_threads, ops);
+    } else if (strcmp(mode, "remote") == 0) {
+        int max_threads = argc > 2 ? atoi(argv[2]) : 32;
+        int rounds = argc > 3 ? atoi(argv[3]) : 200;
+        bench_remote(max_threads, rounds);
+    } else if (strcmp(mode, "shared") == 0) {
+        int max_procs = argc > 2 ? atoi(argv[2]) : 8;
+        long ops = argc > 3 ? atol(argv[3]) : 1000000;
+        bench_shared(max_procs, ops);
+    } else if (strcmp(mode, "frag") == 0) {
+        int rounds = argc > 2 ? atoi(argv[2]) : 20;
+        long ops = argc > 3 ? atol(argv[3]) : 500000;
+        bench_frag(rounds, ops);
+    } else if (strcmp(mode, "trim") == 0) {
+        bench_trim();
+    } else if (strcmp(mode, "realloc") == 0) {
+        int vectors = argc > 2 ? atoi(argv[2]) : 8;
+        long pushes = argc > 3 ? atol(argv[3]) : 2000000;
+        bench_realloc(vectors, pushes);
+    } else if (strcmp(mode, "slab") == 0) {
+        int objects = argc > 2 ? atoi(argv[2]) : 100000;
+        bench_slab(objects);
+    } else if (strcmp(mode, "arena") == 0) {
+        int requests = argc > 2 ? atoi(argv[2]) : 2000;
+        int objects = argc > 3 ? atoi(argv[3]) : 5000;
+        bench_arena(requests, objects);
+    } else if (strcmp(mode, "debug") == 0) {
+        // 追跡表の大きさ（生存ブロック数 ≒ スロット数の半分）を変えて、素の custom_malloc と比べる
+        long ops = argc > 2 ? atol(argv[2]) : 2000000;
+        int slots[] = {2000, 20000, 200000};
+        for (int i = 0; i < 3; i++) {
+            bench_mix(&custom_allocator, slots[i], ops);
+            bench_mix(&debug_allocator, slots[i], ops);
+        }
+        check_leaks();
+    } else if (strcmp(mode, "stats") == 0) {
+        long fragments = argc > 2 ? atol(argv[2]) : 1000000;
+        bench_stats(fragments, 100);
+    } else if (strcmp(mode, "profile") == 0) {
+        bench_profile(argc > 2 ? atol(argv[2]) : 4000000);
+    } else if (strcmp(mode, "overhead") == 0) {
+        bench_overhead(argc > 2 ? atoi(argv[2]) : 1000000);
+    } else if (strcmp(mode, "avx") == 0) {
+        size_t floats = argc > 2 ? strtoul(argv[2], NULL, 10) : 4 * 1024 * 1024;
+        int reps = argc > 3 ? atoi(argv[3]) : 20;
+        bench_avx(floats, reps);
+    } else if (strcmp(mode, "preload") == 0 && argc > 3) {
+        bench_preload(argv[2], argv + 3);
+    } else if (strcmp(mode, "bestfit") == 0) {
+        long fragments = argc > 2 ? atol(argv[2]) : 1000000;
+        long allocs = argc > 3 ? atol(argv[3]) : 100000;
+        bench_bestfit(fragments, allocs);
+    } else {
+        fprintf(stderr, "usage: %s mix|threads|remote|shared|frag|trim|realloc|slab|arena|bestfit|debug|stats|profile|overhead|avx|hugepage|preload ...\n", argv[0]);
+        return 1;
+    }
+
+    return 0;
+}
+
+// 計測結果（gcc -O2, 1コア, 確保サイズ 16〜1024 バイト）
+// mix: サイズクラス別空きリスト導入前後（導入前は全空きリストを線形探索）
+//   slots=20000  ops=200000 : 0.13 Mops/s -> 6.30 Mops/s
+//   slots=100000 ops=400000 : 0.01 Mops/s -> 4.57 Mops/s
+//   （参考: glibc malloc 9.65 Mops/s）
+// threads: スレッドごとに 16〜256 バイトを確保・解放（1コアの環境で計測）
+//   custom_malloc (tcache)  1: 72.3  2: 79.3  4: 71.6  8: 72.4  16: 61.6  32: 69.2 Mops/s
+//   glibc malloc            1: 51.2  2: 49.1  4: 48.1  8: 47.2  16: 40.5  32: 37.8 Mops/s
+//   コアが1つなので台数効果は出ないが、スレッド数を増やしてもロック競合で
+//   落ち込まないことは確認できる。多コア環境では threads=N で N 倍近くになるはず。
+// frag: 20ラウンド x 50万操作（小 16〜256 B 長寿命 / 大 1〜16 KiB 短寿命）
+//   境界タグ導入前: 空き合計 15MB -> 38MB と増え続け、最大空きブロックは 16〜32 KiB 止まり
+//                   ratio 0.001 前後、全解放後も 0.000（物理的な隣と統合されない）
+//   境界タグ導入後: 空き合計 3〜6MB で頭打ち、ratio 0.04〜0.17 で安定、全解放後 0.979
+// trim: 200MB を確保して解放（mmap 閾値 128KiB、trim 閾値 128KiB）
+//   200MB x1        : RSS 2.3MB -> 207MB -> 2.5MB（munmap）
+//   64KiB x3200     : RSS 207MB -> 2.6MB（ヒープ末尾を負の sbrk で縮小）
+//   導入前はどちらも解放後も 207MB のまま残っていた
+// realloc: vector に long を push（容量は 1.5 倍ずつ）、その場での伸長 なし -> あり
+//   1本 x 1600万回  : 0.400 s, コピー 38回 -> 0.139 s, コピー 9回
+//   8本 x 200万回   : 0.394 s, コピー 264回 -> 0.097 s, コピー 149回
+//   64本 x 10万回   : 0.262 s, コピー 1664回 -> 0.111 s, コピー 1330回
+//   残るコピーは tcache 由来の小さいブロックと、ヒープから mmap へ移るときのもの
+// slab: 10万個を確保 → 半分入れ替え → 全解放 を5回（RSS は最初に全部確保した時点の増分。子プロセスで3回）
+//   32 B : slab 30.4〜47.4 Mops/s, 42.0 B/obj   custom_malloc 8.2〜10.0 Mops/s, 46.4〜47.0 B/obj
+//   64 B : slab 25.4〜30.3 Mops/s, 75.2〜75.9 B/obj   custom_malloc 7.3〜7.9 Mops/s, 79.1〜79.7 B/obj
+//   128 B: slab 11.1〜13.0 Mops/s, 141.8〜142.6 B/obj  custom_malloc 3.7〜4.8 Mops/s, 142.9〜143.6 B/obj
+//   custom_malloc のヘッダは 8 B の1ワードで、使用中のブロックはフッタを持たないので、ブロックは
+//   要求 + 8 B を 16 B 境界に切り上げた 48 / 80 / 144 B になる。スラブとの差はオブジェクトあたり
+//   数 B で、メモリの差はほとんどない。速さは 3〜5 倍の差が残る。10万個は tcache（1サイズ 64個まで）に
+//   収まらないので、32個ずつロックを取って中央ヒープから分割・統合しながら補充と返却をくり返す。
+//   144 B のブロックは木で持つクラスに入るので、128 B がいちばん遅い。
+//   （custom_malloc の RSS は init_heap で先に触った 1MB の分だけ少なめに出る）
+// arena: 1リクエストで 16〜256 B を 5000個確保 → 全部捨てる を2000回
+//   arena (arena_reset) : 0.090 s, 111.5 M objects/s（予約 705 KiB を使い回し）
+//   custom_malloc/free  : 0.788 s, 12.7 M objects/s
+//   glibc malloc/free   : 0.754 s, 13.3 M objects/s
+//   個別の free が要らないぶん、arena は約9倍速い
+// bestfit: 区切りで統合できない空き断片を作り、断片と同じサイズにはならない大きさで確保
+//   断片 10万個 : 線形探索 1.67 us/alloc -> 赤黒木 0.12 us/alloc
+//   断片 100万個: 線形探索 220 us/alloc  -> 赤黒木 0.15 us/alloc
+//   （線形探索は 2000回、赤黒木は 10万回の平均。選ばれるブロックは以前と同じ）
+// debug: mix と同じ操作を debug_malloc/debug_free で（生存ブロック数 ≒ スロット数の半分）
+//   slots=2000  : custom 32.2 Mops/s, debug 15.8 Mops/s（配列版 3.0 Mops/s、found を直した上で）
+//   slots=20000 : custom 24.5 Mops/s, debug 10.9 Mops/s
+//   slots=200000: custom 8.1 Mops/s,  debug 4.1 Mops/s
+//   配列版は 1000個を超えると記録されず、そのうえ found が立たないので全部の解放がエラーだった
+// preload: 実在のプログラムを glibc malloc と libcustom_malloc.so で（3回中最短、最大 RSS）
+//   gcc -O2 -c 08_custom_malloc.c : 0.469 s, 39.3 MB -> 0.503 s, 40.4 MB
+//   ls -lR /usr                   : 0.596 s, 3.1 MB  -> 0.758 s, 3.5 MB
+//   sort -n（200万行）            : 2.611 s, 109.8 MB -> 2.460 s, 110.0 MB
+//   python3 で json 往復（20万件）: 10.35 s, 555.0 MB -> 8.96 s, 555.7 MB
+// avx: saxpy（y = a*x + y）を 32 バイト境界の load/store とずらした loadu/storeu で（6回中最良）
+//   2048 個（L1 に収まる）: offset 0 22.5 GFLOP/s, offset 4 16.3, offset 16 15.5
+//   400万個（メモリ律速） : offset 0 3.16 GFLOP/s, offset 4 2.91, offset 16 2.92
+//   キャッシュに乗っているうちはラインをまたぐロード/ストアの分だけ 3割ほど遅い
+// overhead: 同じサイズを100万個確保したときの RSS 増分 / 個数（ポインタ配列の 8 B を含む、子プロセスで計測）
+//   サイズ   : 40 B ヘッダ + 8 B フッタ -> 8 B ヘッダ（glibc）
+//   8 B      : 55.3 -> 39.1 B/obj（40.2）
+//   16 B     : 71.1 -> 39.1 B/obj（40.2）
+//   24 B     : 71.1 -> 39.1 B/obj（40.2）
+//   32 B     : 87.4 -> 55.3 B/obj（56.2）
+//   48 B     : 103.4 -> 71.1 B/obj（72.2）
+//   64 B     : 119.3 -> 87.4 B/obj（88.2）
+//   128 B    : 185.1 -> 151.2 B/obj（152.2）
+//   8〜64 B  : 91.3 -> 59.4 B/obj（60.4）
+//   使用中ブロックはサイズとフラグの1ワードだけになり、最小ブロックも 64 B から 32 B に減った
+// stats: 断片を作った状態で統計を取る（100回の平均）
+//   断片 100万個（空きブロック約5万個）: 全ブロックをたどる版 12.3 ms -> カウンタ版 0.03 us
+//   断片 10万個（空きブロック約5千個） : 177 us -> 0.04 us
+//   get_malloc_stats は 0.2〜0.5 us（呼んだスレッドの tcache の数を足し込む分）
+//   カウンタの更新は、threads 1本の速い経路で 5% ほど遅くなる程度（79.5 -> 75.5 Mops/s、5回中最良）
+//   sbrk の回数を見ると、ヒープ末尾が trim 閾値を行き来するたびに 4 KiB ずつ伸縮している
+// hugepage: init_heap_with で作ったヒープの 64 B ノード400万個（256 MiB）をランダムな輪でたどる（子プロセスで計測）
+//   sbrk             : init 0.04 ms,  chase 575〜685 ns/step
+//   sbrk+populate    : init 217〜239 ms, chase 580 ns/step（以前の init_heap と同じく全ページを先に割り当てる）
+//   mmap+populate    : init 151〜169 ms, chase 603〜638 ns/step
+//   thp+populate     : init 593〜617 ms, chase 362〜463 ns/step、AnonHugePages 280 MiB
+//   hugetlb+populate : nr_hugepages = 0 なので THP に切り替わり、thp と同じ
+//   100万個（64 MiB）: 4 KiB ページ 383〜414 ns/step -> THP 344〜358 ns/step
+//   この環境（仮想マシン）では PMU が見えず perf_event_open が失敗するので、dTLB ミスの数は取れない。
+//   1歩の時間で見ると、TLB に収まらない大きさで THP にすると 2〜4割速くなる。
+//   THP の init が遅いのは 2 MiB ページを 0 で埋める分（khugepaged を待たずに最初から huge page にしている）
+// remote: 各スレッドが 4096個確保し、隣のスレッドが全部解放する を200回（解放はすべて他スレッドのもの、1コア）
+//   threads                  2      4      8     16     32   Mops/s
+//   glibc malloc          10.7    8.9    4.5    4.7    4.0
+//   custom_malloc tcache   7.9    7.0    8.0    6.4    4.3
+//   custom_malloc theap   26.2   20.2    6.8    5.5    4.6
+//   tcache では解放側のキャッシュがあふれるたびに中央ヒープへ返し（統合と空きリストへの挿入）、
+//   確保側が補充するたびに探索と分割をしている。theap はどちらもリストの付け替えだけになる。
+//   8本以上ではスレッドごとの 4096個（約 0.5 MiB）の合計がキャッシュに収まらず、
+//   どれもメモリ待ちで頭打ちになる。最大 RSS は theap が 1〜3 MiB ほど多い
+//   （スパンをスレッドごとに持ち、サイズをまたいで使い回さないため）。
+// profile: CM_SAMPLE_INTERVAL を変えて mix / threads 1本を測り、最後に 100 B×20万個と 24 KiB×800個
+//   （合計 39.7 MB）を残したまま dump_heap_profile した推定値を比べる（子プロセスで計測、3回。mix は5回の最速）
+//   interval        mix Mops/s   threads 1 Mops/s   推定 / 実際
+//   0（無効）       21.9〜34.0   44.7〜56.8         -
+//   1 MiB（既定）   19.4〜30.1   42.5〜63.8         40.1〜47.5 MB / 39.7 MB
+//   512 KiB         24.8〜30.1   44.9〜66.4         36.6〜39.3 MB / 39.7 MB
+//   64 KiB          20.4〜25.6   42.1〜49.8         38.2〜41.9 MB / 39.7 MB
+//   子プロセスごとのぶれ（3〜5割）のほうがサンプリングの差より大きいので、遅くなる割合は
+//   1回のサンプルの時間から見積もる。全部サンプルする間隔 1 と無効の差は確保と解放で 2.4〜3.3 us。
+//   mix は 400万回で約 200万回・1 GB を確保するので、1 MiB なら約 1000 サンプルで 2.4〜3.3 ms、
+//   無効のときの 0.12〜0.18 秒に対して 2〜3%。512 KiB では 3〜5%、64 KiB では 2〜4割になる。
+//   threads は確保が小さい（16〜256 B）ので、1 MiB では 1% ほど。
+//   無効のときは確保ごとにカウンタを1つ減らすだけで、HEAD との差は測定のぶれに埋もれる。
+//   推定の誤差はサンプル数で決まり、1 MiB では約 40 サンプルしかないので ±2割ほどぶれる。
+// shared: 共有の枠 4096個に 16〜512 バイトを exchange で置き、取り出したものを確かめて解放（1プロセス100万回、1コア、2回）
+//   procs                            1           2           4           8          16   Mops/s
+//   custom_malloc (private)  15.8〜24.4  11.5〜17.9  13.1〜13.3  10.9〜17.3  14.0〜14.7
+//   custom_malloc (shared)    4.9〜 8.8   4.6〜 5.6   4.8〜 7.2   6.9〜 8.0   6.4〜 7.6
+//   共有ヒープは tcache を通らず毎回プロセス間のロックを取るので、1プロセスでも 1/3 ほどになる。
+//   1コアなのでプロセスを増やしても並列には動かず、差は切り替えのときにロックを持っている
+//   かどうかで決まる。壊れたオブジェクトは0個、終了後は全体が1つの空きブロックに戻った
+//   （奇数番目のプロセスは別のアドレスにマップし直しているので、リンクがオフセットで
+//   閉じていることの確認にもなる）。
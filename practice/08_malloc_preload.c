@@ -0,0 +1,335 @@
+// 08_custom_malloc.c を LD_PRELOAD で既存のプログラムに差し込むための共有ライブラリ
+// ビルド:
+// gcc -O2 -shared -fPIC -ftls-model=initial-exec -pthread -DCUSTOM_MALLOC_NO_MAIN
+//     -o libcustom_malloc.so 08_malloc_preload.c 08_custom_malloc.c
+// 実行:
+// LD_PRELOAD=./libcustom_malloc.so ls -l /usr/bin
+//
+// glibc の malloc 系の関数はすべてここで置き換える。一部だけ置き換えると、glibc で
+// 確保した領域が custom_free に渡されてヒープが壊れるので、memalign なども用意する。
+// ヒープは最初の確保のときに extend_heap で作られるので、init_heap より前、
+// main より前（動的リンカや libc の初期化中）の確保もそのまま custom_malloc で扱う。
+// tcache は __thread 変数なので、__tls_get_addr 経由の遅延確保（それ自体が malloc を
+// 呼ぶ）を避けるため -ftls-model=initial-exec を付けてビルドする。
+//
+// 環境変数 CUSTOM_MALLOC_TRACE にファイル名を指定すると、呼び出しを 08_malloc_trace.h の
+// 形式で記録する（08_malloc_trace.c の replay で再生できる）。ファイル名の %p はプロセス ID に
+// 置き換えるので、子プロセスを exec するプログラムでは %p を入れておく。
+// calloc や memalign も malloc として記録する（アラインメントは残らない）。
+//
+// 環境変数 CUSTOM_MALLOC_PROFILE にファイル名を指定すると、サンプリングによるヒープ
+// プロファイルを取り、SIGUSR2 を受けたあとと終了時にそのファイルへ folded 形式で書き出す
+// （%p は同じくプロセス ID）。シグナルのあとは、次にサンプルを取るか、サンプルした確保を
+// 解放したときに書くので、確保をしていないプロセスではすぐには書かれない。
+// 間隔は CUSTOM_MALLOC_PROFILE_INTERVAL（バイト、既定 1 MiB）。
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "08_custom_malloc.h"
+#include "08_malloc_trace.h"
+
+// ---- トレースの記録 ----
+
+#define TRACE_BUFFER_EVENTS 4096
+#define TRACE_TABLE_MIN 1024
+
+typedef struct {
+    void* ptr;      // NULL なら空きスロット
+    uint32_t id;
+} trace_slot_t;
+
+enum { TRACE_UNKNOWN, TRACE_ON, TRACE_OFF };
+static int trace_state = TRACE_UNKNOWN;
+static pid_t trace_pid;      // fork した子は記録しない
+static int trace_fd = -1;
+static trace_header_t trace_header;
+static trace_event_t trace_buffer[TRACE_BUFFER_EVENTS];
+static size_t trace_buffered = 0;
+static __thread int trace_thread = -1;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 生きているポインタから id への表（08_custom_malloc.c の debug_malloc の表と同じ作り）
+static trace_slot_t* trace_table = NULL;
+static size_t trace_capacity = 0; // 2のべき乗
+static size_t trace_count = 0;
+
+static void trace_flush(void) {
+    if (trace_buffered == 0) return;
+    ssize_t ignored = write(trace_fd, trace_buffer, trace_buffered * sizeof(trace_event_t));
+    (void)ignored;
+    trace_buffered = 0;
+}
+
+// ファイル名の %p をプロセス ID に置き換える
+static void expand_path(const char* pattern, char* path, size_t size) {
+    size_t n = 0;
+    for (const char* c = pattern; *c && n + 24 < size; c++) {
+        if (c[0] == '%' && c[1] == 'p') {
+            n += snprintf(path + n, size - n, "%d", (int)getpid());
+            c++;
+        } else {
+            path[n++] = *c;
+        }
+    }
+    path[n] = '\0';
+}
+
+// 最初の呼び出しで環境変数を見てファイルを開く（trace_lock を保持して呼ぶ）
+static void trace_open(void) {
+    trace_state = TRACE_OFF;
+    const char* pattern = getenv("CUSTOM_MALLOC_TRACE");
+    if (pattern == NULL || *pattern == '\0') return;
+
+    char path[4096];
+    expand_path(pattern, path, sizeof(path));
+
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_fd < 0) return;
+    trace_header.magic = TRACE_MAGIC;
+    trace_header.version = TRACE_VERSION;
+    ssize_t ignored = write(trace_fd, &trace_header, sizeof(trace_header)); // 数は終了時に書き直す
+    (void)ignored;
+    trace_pid = getpid();
+    trace_state = TRACE_ON;
+}
+
+// 記録中なら trace_lock を取って true を返す
+static bool trace_begin(void) {
+    if (__atomic_load_n(&trace_state, __ATOMIC_RELAXED) == TRACE_OFF) return false;
+    pthread_mutex_lock(&trace_lock);
+    if (trace_state == TRACE_UNKNOWN) trace_open();
+    if (trace_state != TRACE_ON || getpid() != trace_pid) {
+        pthread_mutex_unlock(&trace_lock);
+        return false;
+    }
+    return true;
+}
+
+static void trace_end(void) {
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_append(int op, uint32_t id, size_t size) {
+    if (trace_thread < 0) trace_thread = trace_header.threads++;
+    trace_event_t* event = &trace_buffer[trace_buffered++];
+    event->id = id;
+    event->size = size > UINT32_MAX ? UINT32_MAX : (uint32_t)size;
+    event->op = (uint8_t)op;
+    event->thread = (uint8_t)trace_thread; // 256 本を超えたら同じ番号に畳む
+    event->reserved = 0;
+    trace_header.events++;
+    if (trace_buffered == TRACE_BUFFER_EVENTS) trace_flush();
+}
+
+static size_t trace_hash(const void* ptr) {
+    uint64_t h = (uint64_t)(uintptr_t)ptr * 0x9e3779b97f4a7c15ULL;
+    return (size_t)(h >> 32) & (trace_capacity - 1);
+}
+
+static void trace_put(void* ptr, uint32_t id) {
+    size_t i = trace_hash(ptr);
+    while (trace_table[i].ptr != NULL) {
+        i = (i + 1) & (trace_capacity - 1);
+    }
+    trace_table[i].ptr = ptr;
+    trace_table[i].id = id;
+    trace_count++;
+}
+
+static bool trace_insert(void* ptr, uint32_t id) {
+    if ((trace_count + 1) * 2 > trace_capacity) {
+        size_t new_capacity = trace_capacity ? trace_capacity * 2 : TRACE_TABLE_MIN;
+        trace_slot_t* table = custom_calloc(new_capacity, sizeof(trace_slot_t));
+        if (table == NULL) return false;
+        trace_slot_t* old = trace_table;
+        size_t old_capacity = trace_capacity;
+        trace_table = table;
+        trace_capacity = new_capacity;
+        trace_count = 0;
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i].ptr) trace_put(old[i].ptr, old[i].id);
+        }
+        custom_free(old);
+    }
+    trace_put(ptr, id);
+    return true;
+}
+
+// ptr の id を取り除いて返す。記録の始まる前に確保されたものなどは false
+static bool trace_remove(void* ptr, uint32_t* id) {
+    if (trace_count == 0) return false;
+
+    size_t i = trace_hash(ptr);
+    while (trace_table[i].ptr != ptr) {
+        if (trace_table[i].ptr == NULL) return false;
+        i = (i + 1) & (trace_capacity - 1);
+    }
+    *id = trace_table[i].id;
+
+    // 空いた穴に、本来の位置がそこ以前にある後続の要素を移す
+    size_t hole = i;
+    for (;;) {
+        i = (i + 1) & (trace_capacity - 1);
+        if (trace_table[i].ptr == NULL) break;
+        size_t home = trace_hash(trace_table[i].ptr);
+        bool stays = hole <= i ? (hole < home && home <= i) : (hole < home || home <= i);
+        if (!stays) {
+            trace_table[hole] = trace_table[i];
+            hole = i;
+        }
+    }
+    trace_table[hole].ptr = NULL;
+    trace_count--;
+    return true;
+}
+
+// 確保を記録する（trace_lock を保持して呼ぶ）
+static void trace_new_object(void* ptr, size_t size) {
+    uint32_t id = trace_header.objects;
+    if (!trace_insert(ptr, id)) return;
+    trace_header.objects++;
+    trace_append(TRACE_MALLOC, id, size);
+}
+
+// 確保した直後のポインタを記録する
+// 解放は記録してから実際に解放するので、同じアドレスが先に記録されることはない。
+static void* trace_malloc(void* ptr, size_t size) {
+    if (ptr && trace_begin()) {
+        trace_new_object(ptr, size);
+        trace_end();
+    }
+    return ptr;
+}
+
+__attribute__((destructor))
+static void trace_close(void) {
+    if (!trace_begin()) return;
+    trace_flush();
+    ssize_t ignored = pwrite(trace_fd, &trace_header, sizeof(trace_header), 0);
+    (void)ignored;
+    close(trace_fd);
+    trace_state = TRACE_OFF;
+    trace_end();
+}
+
+// ---- ヒーププロファイル ----
+
+static char profile_file[4096];
+
+__attribute__((constructor))
+static void profile_open(void) {
+    const char* pattern = getenv("CUSTOM_MALLOC_PROFILE");
+    if (pattern == NULL || *pattern == '\0') return;
+    expand_path(pattern, profile_file, sizeof(profile_file));
+    const char* interval = getenv("CUSTOM_MALLOC_PROFILE_INTERVAL");
+    custom_mallopt(CM_SAMPLE_INTERVAL, interval ? strtoul(interval, NULL, 10) : CM_DEFAULT_SAMPLE_INTERVAL);
+    dump_heap_profile_on_signal(SIGUSR2, profile_file);
+}
+
+__attribute__((destructor))
+static void profile_close(void) {
+    if (profile_file[0] == '\0') return;
+    int fd = open(profile_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    dump_heap_profile(fd);
+    close(fd);
+}
+
+// ---- malloc 系の関数 ----
+
+void* malloc(size_t size) {
+    // malloc(0) も free できる一意なポインタを返す
+    void* ptr = custom_malloc(size ? size : 1);
+    if (ptr == NULL) errno = ENOMEM;
+    return trace_malloc(ptr, size);
+}
+
+void free(void* ptr) {
+    if (ptr && trace_begin()) {
+        uint32_t id;
+        if (trace_remove(ptr, &id)) trace_append(TRACE_FREE, id, 0);
+        custom_free(ptr);
+        trace_end();
+        return;
+    }
+    custom_free(ptr);
+}
+
+void* calloc(size_t count, size_t size) {
+    if (count == 0 || size == 0) count = size = 1;
+    void* ptr = custom_calloc(count, size);
+    if (ptr == NULL) errno = ENOMEM;
+    return trace_malloc(ptr, count * size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    // 移動した場合に古いアドレスが他のスレッドで再利用される前に記録するよう、ロックを持ったまま呼ぶ
+    bool tracing = trace_begin();
+    void* new_ptr = custom_realloc(ptr, size);
+    if (new_ptr == NULL && size != 0) errno = ENOMEM;
+    if (tracing) {
+        uint32_t id;
+        bool known = ptr && trace_remove(ptr, &id);
+        if (new_ptr == NULL) {
+            if (known && size == 0) {
+                trace_append(TRACE_FREE, id, 0);
+            } else if (known) {
+                trace_insert(ptr, id); // 失敗したので元のまま
+            }
+        } else if (known) {
+            if (trace_insert(new_ptr, id)) trace_append(TRACE_REALLOC, id, size);
+        } else {
+            trace_new_object(new_ptr, size);
+        }
+        trace_end();
+    }
+    return new_ptr;
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) return EINVAL;
+    void* ptr = custom_memalign(alignment, size ? size : 1);
+    if (ptr == NULL) return ENOMEM;
+    *memptr = trace_malloc(ptr, size);
+    return 0;
+}
+
+void* memalign(size_t alignment, size_t size) {
+    // glibc と同じく、2のべき乗でない alignment は次の2のべき乗に切り上げる
+    if (alignment != 0 && (alignment & (alignment - 1)) != 0) {
+        alignment = (size_t)1 << (64 - __builtin_clzll(alignment));
+    }
+    void* ptr = custom_memalign(alignment ? alignment : 1, size ? size : 1);
+    if (ptr == NULL) errno = ENOMEM;
+    return trace_malloc(ptr, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    void* ptr = custom_aligned_alloc(alignment, size ? size : 1);
+    if (ptr == NULL) errno = ENOMEM;
+    return trace_malloc(ptr, size);
+}
+
+void* valloc(size_t size) {
+    return memalign((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+void* pvalloc(size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void* ptr) {
+    return custom_malloc_usable_size(ptr);
+}
@@ -0,0 +1,591 @@
+// 確保トレースの生成と再生（custom_malloc と glibc malloc の比較）
+// ビルド:
+// gcc -O2 -pthread -DCUSTOM_MALLOC_NO_MAIN -o malloc_trace 08_malloc_trace.c 08_custom_malloc.c
+// 実行:
+// ./malloc_trace gen uniform out.trace [events]
+// ./malloc_trace gen powerlaw out.trace [events]
+// ./malloc_trace gen larson out.trace [threads] [events]
+// ./malloc_trace gen prodcons out.trace [producers] [consumers] [events]
+// ./malloc_trace replay in.trace
+// ./malloc_trace policy in.trace   （custom_malloc の空きブロックの選び方ごとに再生する）
+//
+// 実在のプログラムのトレースは、08_malloc_preload.c の共有ライブラリで記録する:
+// CUSTOM_MALLOC_TRACE=out.trace LD_PRELOAD=./libcustom_malloc.so command [args...]
+//
+// replay はアロケータごとに子プロセスを作り、その中でトレースを再生する。
+// トレースの各スレッドに1本ずつスレッドを立て、同じ id のイベントはファイルの順に
+// 実行されるまで待つ。確保した領域にはページごとに1バイト書き、RSS に現れるようにする。
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "08_custom_malloc.h"
+#include "08_malloc_trace.h"
+
+typedef struct {
+    const char* name;
+    void* (*alloc)(size_t);
+    void (*release)(void*);
+    void* (*resize)(void*, size_t);
+} allocator_t;
+
+static const allocator_t custom_allocator = {"custom_malloc", custom_malloc, custom_free, custom_realloc};
+static const allocator_t libc_allocator = {"glibc malloc", malloc, free, realloc};
+
+// policy で比べる custom_mallopt(CM_FIT_POLICY, ...) の値（名前だけ変えた custom_malloc）
+static const struct {
+    int value;
+    allocator_t allocator;
+} fit_policies[] = {
+    {CM_FIT_BEST, {"best-fit", custom_malloc, custom_free, custom_realloc}},
+    {CM_FIT_FIRST, {"first-fit", custom_malloc, custom_free, custom_realloc}},
+    {CM_FIT_NEXT, {"next-fit", custom_malloc, custom_free, custom_realloc}},
+    {CM_FIT_WORST, {"worst-fit", custom_malloc, custom_free, custom_realloc}},
+    {CM_FIT_BUDDY, {"buddy", custom_malloc, custom_free, custom_realloc}},
+};
+
+// 再現性のある乱数（xorshift64）
+static uint64_t rng_state = 88172645463325252ULL;
+static uint64_t next_rand(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// ---- トレースの生成 ----
+
+typedef struct {
+    FILE* file;
+    trace_header_t header;
+    uint32_t next_id;
+} trace_writer_t;
+
+static bool writer_open(trace_writer_t* w, const char* path) {
+    memset(w, 0, sizeof(*w));
+    w->file = fopen(path, "wb");
+    if (w->file == NULL) {
+        perror(path);
+        return false;
+    }
+    w->header.magic = TRACE_MAGIC;
+    w->header.version = TRACE_VERSION;
+    fwrite(&w->header, sizeof(w->header), 1, w->file); // 数は閉じるときに書き直す
+    return true;
+}
+
+static void emit(trace_writer_t* w, int op, uint32_t id, size_t size, int thread) {
+    trace_event_t event = {
+        .id = id,
+        .size = size > UINT32_MAX ? UINT32_MAX : (uint32_t)size,
+        .op = (uint8_t)op,
+        .thread = (uint8_t)thread,
+    };
+    fwrite(&event, sizeof(event), 1, w->file);
+    w->header.events++;
+    if ((uint32_t)thread + 1 > w->header.threads) w->header.threads = thread + 1;
+    if (id + 1 > w->header.objects) w->header.objects = id + 1;
+}
+
+// 新しいオブジェクトを確保するイベントを書き、その id を返す
+static uint32_t emit_malloc(trace_writer_t* w, size_t size, int thread) {
+    uint32_t id = w->next_id++;
+    emit(w, TRACE_MALLOC, id, size, thread);
+    return id;
+}
+
+static void writer_close(trace_writer_t* w) {
+    fseek(w->file, 0, SEEK_SET);
+    fwrite(&w->header, sizeof(w->header), 1, w->file);
+    fclose(w->file);
+    printf("events=%llu threads=%u objects=%u\n", (unsigned long long)w->header.events,
+           w->header.threads, w->header.objects);
+}
+
+static size_t uniform_size(void) {
+    return 16 + next_rand() % 1009;
+}
+
+// 16 B 〜 1 MiB で、大きさ x 以上になる確率が 1/x に比例する（べき分布）
+static size_t powerlaw_size(void) {
+    int octave = __builtin_ctzll(next_rand() | (1ULL << 16)); // 2^-k の確率で k
+    size_t size = (size_t)16 << octave;
+    return size + next_rand() % size;
+}
+
+// live_slots 個のスロットからランダムに選び、空なら確保、埋まっていれば
+// 1/8 の確率で realloc、それ以外は解放する（08_malloc_bench.c の mix と同じ形）
+static void gen_slots(trace_writer_t* w, long events, int live_slots, size_t (*size_fn)(void)) {
+    int64_t* slots = malloc(live_slots * sizeof(int64_t)); // id、-1 は空
+    for (int s = 0; s < live_slots; s++) slots[s] = -1;
+
+    for (long i = 0; i < events; i++) {
+        int s = next_rand() % live_slots;
+        if (slots[s] < 0) {
+            slots[s] = emit_malloc(w, size_fn(), 0);
+        } else if (next_rand() % 8 == 0) {
+            emit(w, TRACE_REALLOC, slots[s], size_fn(), 0);
+        } else {
+            emit(w, TRACE_FREE, slots[s], 0, 0);
+            slots[s] = -1;
+        }
+    }
+    for (int s = 0; s < live_slots; s++) {
+        if (slots[s] >= 0) emit(w, TRACE_FREE, slots[s], 0, 0);
+    }
+    free(slots);
+}
+
+// Larson: 各スレッドが自分の組のブロックをランダムに解放しては確保し直す。
+// ラウンドごとに組を隣のスレッドへ引き継ぐので、前のスレッドが確保したものを解放する。
+// スレッドの操作は1回ずつ交互に並べる。
+static void gen_larson(trace_writer_t* w, int threads, long events) {
+    const int per_thread = 1000;
+    const int per_round = 1000; // 1ラウンドで各スレッドが入れ替える数
+    uint32_t* slots = malloc((size_t)threads * per_thread * sizeof(uint32_t));
+
+    for (int t = 0; t < threads; t++) {
+        for (int j = 0; j < per_thread; j++) {
+            slots[t * per_thread + j] = emit_malloc(w, 10 + next_rand() % 491, t);
+        }
+    }
+    int round = 0;
+    while ((long)w->header.events < events) {
+        for (int k = 0; k < per_round; k++) {
+            for (int set = 0; set < threads; set++) {
+                int t = (set + round) % threads; // ラウンド round でこの組を受け持つスレッド
+                uint32_t* slot = &slots[set * per_thread + next_rand() % per_thread];
+                emit(w, TRACE_FREE, *slot, 0, t);
+                *slot = emit_malloc(w, 10 + next_rand() % 491, t);
+            }
+        }
+        round++;
+    }
+    for (int set = 0; set < threads; set++) {
+        for (int j = 0; j < per_thread; j++) {
+            emit(w, TRACE_FREE, slots[set * per_thread + j], 0, (set + round) % threads);
+        }
+    }
+    free(slots);
+}
+
+// producer/consumer: producers 本のスレッドが 64 B 〜 4 KiB のメッセージを確保して
+// キューに入れ、consumers 本のスレッドが古いものから解放する（キューの深さ 1000）
+static void gen_prodcons(trace_writer_t* w, int producers, int consumers, long events) {
+    const int depth = 1000;
+    uint32_t* queue = malloc(depth * sizeof(uint32_t));
+    int head = 0, count = 0;
+    long consumed = 0;
+
+    for (long i = 0; (long)w->header.events < events; i++) {
+        if (count == depth) {
+            emit(w, TRACE_FREE, queue[head], 0, producers + consumed++ % consumers);
+            head = (head + 1) % depth;
+            count--;
+        }
+        queue[(head + count++) % depth] = emit_malloc(w, 64 + next_rand() % 4033, i % producers);
+    }
+    while (count > 0) {
+        emit(w, TRACE_FREE, queue[head], 0, producers + consumed++ % consumers);
+        head = (head + 1) % depth;
+        count--;
+    }
+    free(queue);
+}
+
+static int generate(int argc, char** argv) {
+    if (argc < 4) return 1;
+    const char* kind = argv[2];
+    trace_writer_t w;
+    if (!writer_open(&w, argv[3])) return 1;
+
+    if (strcmp(kind, "uniform") == 0) {
+        gen_slots(&w, argc > 4 ? atol(argv[4]) : 2000000, 10000, uniform_size);
+    } else if (strcmp(kind, "powerlaw") == 0) {
+        gen_slots(&w, argc > 4 ? atol(argv[4]) : 2000000, 10000, powerlaw_size);
+    } else if (strcmp(kind, "larson") == 0) {
+        int threads = argc > 4 ? atoi(argv[4]) : 4;
+        if (threads < 1 || threads > 256) threads = 4;
+        gen_larson(&w, threads, argc > 5 ? atol(argv[5]) : 2000000);
+    } else if (strcmp(kind, "prodcons") == 0) {
+        int producers = argc > 4 ? atoi(argv[4]) : 2;
+        int consumers = argc > 5 ? atoi(argv[5]) : 2;
+        if (producers < 1 || consumers < 1 || producers + consumers > 256) producers = consumers = 2;
+        gen_prodcons(&w, producers, consumers, argc > 6 ? atol(argv[6]) : 2000000);
+    } else {
+        fprintf(stderr, "unknown trace kind: %s\n", kind);
+        fclose(w.file);
+        return 1;
+    }
+    writer_close(&w);
+    return 0;
+}
+
+// ---- トレースの再生 ----
+
+// 遅延のヒストグラム: 2のべき乗ごとに8分割（誤差 1/8 以内）
+#define LATENCY_BUCKETS (64 * 8)
+// 1/8 の呼び出しだけ時間を測る（clock_gettime のぶんでスループットが落ちないように）
+#define LATENCY_SAMPLE_MASK 7
+
+static int latency_bucket(uint64_t ns) {
+    if (ns < 8) return (int)ns;
+    int msb = 63 - __builtin_clzll(ns);
+    return (msb - 2) * 8 + (int)((ns >> (msb - 3)) & 7);
+}
+
+static uint64_t bucket_value(int bucket) {
+    if (bucket < 8) return bucket;
+    int msb = bucket / 8 + 2;
+    return (uint64_t)(8 + bucket % 8) << (msb - 3);
+}
+
+static uint64_t percentile(const uint64_t* histogram, double p) {
+    uint64_t total = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) total += histogram[i];
+    uint64_t rank = (uint64_t)(total * p), seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histogram[i];
+        if (seen > rank) return bucket_value(i);
+    }
+    return 0;
+}
+
+// 他のスレッドより先へ進んでよいイベント数。id ごとの順序だけだと、producer は
+// consumer の解放を待たずに最後まで確保してしまい、生存量がトレースと大きく変わる。
+#define REPLAY_WINDOW 1024
+
+typedef struct replay_thread replay_thread_t;
+
+typedef struct {
+    const trace_event_t* events;
+    const uint32_t* event_step;   // 各イベントが同じ id の何番目のイベントか
+    uint32_t* progress;           // id ごとの、実行を終えたイベント数
+    void** objects;               // id ごとの現在のポインタ
+    replay_thread_t* threads;
+    int thread_count;
+    size_t peak_index;            // 生存バイト数が最大になるイベントの番号
+    malloc_stats_t* peak_stats;   // その直後の custom_malloc の統計（custom_malloc のときだけ）
+} replay_state_t;
+
+struct replay_thread {
+    _Alignas(64) uint64_t next_index; // 次に実行するイベントの番号（終わったら UINT64_MAX）
+    const replay_state_t* state;
+    const allocator_t* allocator;
+    const uint32_t* indexes;      // このスレッドが実行するイベントの番号
+    size_t count;
+    pthread_barrier_t* start;
+    uint64_t histogram[LATENCY_BUCKETS];
+};
+
+// 他のすべてのスレッドが index - REPLAY_WINDOW より先へ進むまで待つ
+static void wait_for_others(const replay_state_t* st, const replay_thread_t* self, uint64_t index) {
+    if (index < REPLAY_WINDOW) return;
+    for (int t = 0; t < st->thread_count; t++) {
+        const replay_thread_t* other = &st->threads[t];
+        if (other == self) continue;
+        while (__atomic_load_n(&other->next_index, __ATOMIC_ACQUIRE) < index - REPLAY_WINDOW) {
+            sched_yield();
+        }
+    }
+}
+
+// ページごとに1バイト書いて、確保した領域を RSS に載せる
+static void touch(char* ptr, size_t size) {
+    for (size_t offset = 0; offset < size; offset += 4096) ptr[offset] = 1;
+    if (size) ptr[size - 1] = 1;
+}
+
+static void* replay_thread(void* arg) {
+    replay_thread_t* rt = arg;
+    const replay_state_t* st = rt->state;
+    const allocator_t* a = rt->allocator;
+    pthread_barrier_wait(rt->start);
+
+    for (size_t n = 0; n < rt->count; n++) {
+        uint32_t index = rt->indexes[n];
+        const trace_event_t* event = &st->events[index];
+        uint32_t id = event->id;
+
+        __atomic_store_n(&rt->next_index, index, __ATOMIC_RELEASE);
+        if ((n & 63) == 0) wait_for_others(st, rt, index);
+        // 同じ id の前のイベント（ほかのスレッドのものかもしれない）が終わるまで待つ
+        for (int spins = 0; __atomic_load_n(&st->progress[id], __ATOMIC_ACQUIRE) != st->event_step[index]; spins++) {
+            if (spins > 100) sched_yield();
+        }
+
+        bool timed = (n & LATENCY_SAMPLE_MASK) == 0;
+        uint64_t start = timed ? now_ns() : 0;
+        void* ptr = st->objects[id];
+        switch (event->op) {
+        case TRACE_MALLOC:
+            ptr = a->alloc(event->size ? event->size : 1);
+            break;
+        case TRACE_REALLOC:
+            ptr = a->resize(ptr, event->size ? event->size : 1);
+            break;
+        case TRACE_FREE:
+            a->release(ptr);
+            ptr = NULL;
+            break;
+        }
+        if (timed) rt->histogram[latency_bucket(now_ns() - start)]++;
+        if (ptr) touch(ptr, event->size);
+        if (index == st->peak_index && st->peak_stats) get_malloc_stats(st->peak_stats);
+
+        st->objects[id] = ptr;
+        __atomic_store_n(&st->progress[id], st->event_step[index] + 1, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&rt->next_index, UINT64_MAX, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static size_t rss_kib(void) {
+    FILE* f = fopen("/proc/self/statm", "r");
+    unsigned long vm_pages = 0, rss_pages = 0;
+    if (f) {
+        if (fscanf(f, "%lu %lu", &vm_pages, &rss_pages) != 2) rss_pages = 0;
+        fclose(f);
+    }
+    return rss_pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// 再生用の表はアロケータを通さず、先に触って RSS に載せておく
+static void* map_table(size_t bytes) {
+    void* table = mmap(NULL, bytes ? bytes : 1, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (table == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return table;
+}
+
+static const trace_header_t* load_trace(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    const trace_header_t* header = NULL;
+    if ((size_t)st.st_size >= sizeof(trace_header_t)) {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if (map != MAP_FAILED) header = map;
+    }
+    close(fd);
+    if (header == NULL || header->magic != TRACE_MAGIC || header->version != TRACE_VERSION ||
+        (size_t)st.st_size < sizeof(*header) + header->events * sizeof(trace_event_t)) {
+        fprintf(stderr, "%s: not a trace file\n", path);
+        return NULL;
+    }
+    return header;
+}
+
+// 子プロセスの中で1回再生して、結果を1行表示する
+static void replay_child(const char* path, const allocator_t* a) {
+    const trace_header_t* header = load_trace(path);
+    if (header == NULL) exit(1);
+    const trace_event_t* events = (const trace_event_t*)(header + 1);
+    size_t count = header->events;
+    int threads = header->threads ? header->threads : 1;
+
+    uint32_t* event_step = map_table(count * sizeof(uint32_t));
+    replay_state_t state = {
+        .events = events,
+        .event_step = event_step,
+        .progress = map_table(header->objects * sizeof(uint32_t)),
+        .objects = map_table(header->objects * sizeof(void*)),
+    };
+    bool custom = a->release == custom_free;
+    state.peak_stats = custom ? map_table(sizeof(malloc_stats_t)) : NULL;
+    uint32_t* indexes = map_table(count * sizeof(uint32_t));
+    size_t* offsets = map_table((threads + 1) * sizeof(size_t));
+
+    // 前処理: 同じ id の何番目のイベントか、スレッドごとのイベント数、生存バイト数の最大
+    // （objects をサイズの記録に、progress を数の記録に一時的に使う）
+    size_t* sizes = (size_t*)state.objects;
+    size_t live = 0, peak_live = 0, peak_index = 0;
+    for (size_t i = 0; i < count; i++) {
+        const trace_event_t* event = &events[i];
+        if (event->id >= header->objects || event->thread >= threads) {
+            fprintf(stderr, "%s: broken event %zu\n", path, i);
+            exit(1);
+        }
+        event_step[i] = state.progress[event->id]++;
+        offsets[event->thread + 1]++;
+        live -= sizes[event->id];
+        sizes[event->id] = event->op == TRACE_FREE ? 0 : event->size;
+        live += sizes[event->id];
+        if (live > peak_live) {
+            peak_live = live;
+            peak_index = i;
+        }
+    }
+    state.peak_index = peak_index;
+    memset(state.progress, 0, header->objects * sizeof(uint32_t));
+    memset(state.objects, 0, header->objects * sizeof(void*));
+    for (int t = 0; t < threads; t++) offsets[t + 1] += offsets[t];
+    size_t* fill = map_table(threads * sizeof(size_t));
+    for (size_t i = 0; i < count; i++) {
+        int t = events[i].thread;
+        indexes[offsets[t] + fill[t]++] = i;
+    }
+
+    replay_thread_t* rts = map_table(threads * sizeof(replay_thread_t));
+    state.threads = rts;
+    state.thread_count = threads;
+    pthread_t* tids = map_table(threads * sizeof(pthread_t));
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, threads + 1);
+    for (int t = 0; t < threads; t++) {
+        rts[t].state = &state;
+        rts[t].allocator = a;
+        rts[t].indexes = indexes + offsets[t];
+        rts[t].count = offsets[t + 1] - offsets[t];
+        rts[t].start = &start;
+        rts[t].next_index = rts[t].count ? rts[t].indexes[0] : UINT64_MAX;
+        pthread_create(&tids[t], NULL, replay_thread, &rts[t]);
+    }
+
+    size_t baseline = rss_kib();
+    pthread_barrier_wait(&start);
+    uint64_t begin = now_ns();
+    for (int t = 0; t < threads; t++) pthread_join(tids[t], NULL);
+    double elapsed = (now_ns() - begin) / 1e9;
+
+    uint64_t histogram[LATENCY_BUCKETS] = {0};
+    for (int t = 0; t < threads; t++) {
+        for (int i = 0; i < LATENCY_BUCKETS; i++) histogram[i] += rts[t].histogram[i];
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    size_t peak_rss = (size_t)usage.ru_maxrss > baseline ? usage.ru_maxrss - baseline : 0;
+
+    // 断片化の目安は、生存バイト数の最大に対する RSS の増分の最大（1 に近いほど無駄が少ない）
+    printf("%-14s %6.2f Mops/s, p50 %4llu ns, p99 %5llu ns, peak RSS %7.1f MiB"
+           " (live %.1f MiB, RSS/live %.2f)\n", a->name, count / elapsed / 1e6,
+           (unsigned long long)percentile(histogram, 0.50),
+           (unsigned long long)percentile(histogram, 0.99), peak_rss / 1024.0,
+           peak_live / 1048576.0, peak_live ? peak_rss * 1024.0 / peak_live : 0.0);
+    if (custom) {
+        malloc_stats_t stats;
+        get_malloc_stats(&stats);
+        printf("%-14s reserved peak %.1f MiB, in use peak %.1f MiB, requested/allocated %.3f,"
+               " sbrk %zu, mmap %zu\n", "", stats.peak_reserved_bytes / 1048576.0,
+               stats.peak_in_use_bytes / 1048576.0,
+               stats.allocated_bytes ? (double)stats.requested_bytes / stats.allocated_bytes : 0.0,
+               stats.sbrk_calls, stats.mmap_calls);
+        // 探索長は空きブロックを探した1回あたりに調べたブロック数。
+        // 断片化は生存バイト数が最大になった直後の空き（tcache の中身は使用中に数える）
+        const malloc_stats_t* peak = state.peak_stats;
+        printf("%-14s search %.1f blocks x %zu, at peak: free %.1f MiB, largest %.1f MiB,"
+               " external frag %.3f\n", "",
+               stats.fit_searches ? (double)stats.fit_steps / stats.fit_searches : 0.0,
+               stats.fit_searches, peak->free_bytes / 1048576.0,
+               peak->largest_free_block / 1048576.0, peak->external_fragmentation);
+    }
+    fflush(stdout);
+}
+
+// 子プロセスを作って再生する。policy が 0 以上なら、先に空きブロックの選び方を切り替える
+static void replay_in_child(const char* path, const allocator_t* a, int policy) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (policy >= 0 && !custom_mallopt(CM_FIT_POLICY, policy)) _exit(1);
+        replay_child(path, a);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("%s: replay failed (status %d)\n", a->name, status);
+    }
+}
+
+static bool print_header(const char* path) {
+    const trace_header_t* header = load_trace(path);
+    if (header == NULL) return false;
+    printf("%s: events=%llu threads=%u objects=%u\n", path,
+           (unsigned long long)header->events, header->threads, header->objects);
+    fflush(stdout);
+    return true;
+}
+
+static int replay(const char* path) {
+    if (!print_header(path)) return 1;
+    replay_in_child(path, &custom_allocator, -1);
+    replay_in_child(path, &libc_allocator, -1);
+    return 0;
+}
+
+// 同じトレースを、custom_malloc の空きブロックの選び方ごとに再生する
+static int replay_policies(const char* path) {
+    if (!print_header(path)) return 1;
+    for (size_t i = 0; i < sizeof(fit_policies) / sizeof(fit_policies[0]); i++) {
+        replay_in_child(path, &fit_policies[i].allocator, fit_policies[i].value);
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 3 && strcmp(argv[1], "gen") == 0) {
+        return generate(argc, argv);
+    } else if (argc > 2 && strcmp(argv[1], "replay") == 0) {
+        return replay(argv[2]);
+    } else if (argc > 2 && strcmp(argv[1], "policy") == 0) {
+        return replay_policies(argv[2]);
+    }
+    fprintf(stderr, "usage: %s gen uniform|powerlaw|larson|prodcons out.trace ...\n"
+                    "       %s replay|policy in.trace\n", argv[0], argv[0]);
+    return 1;
+}
+
+// 計測結果（gcc -O2, 1コア。Mops/s, p50/p99 は 1/8 抽出、RSS は再生中の増分の最大）
+//   トレース（200万イベント）     custom_malloc                     glibc malloc
+//   uniform 16〜1024 B            6.7 Mops/s, 56/512 ns, x1.88       7.5 Mops/s, 56/512 ns, x1.29
+//   powerlaw 16 B〜2 MiB          5.2 Mops/s, 60/480 ns, x1.57       7.4 Mops/s, 60/448 ns, x1.70
+//   larson 4 スレッド             11.4 Mops/s, 56/224 ns, x2.51      7.2 Mops/s, 72/320 ns, x1.64
+//   prodcons 2+2 スレッド         2.6 Mops/s, 160/640 ns, x3.78      4.2 Mops/s, 96/1152 ns, x1.97
+//   gcc -O2 -c の cc1（53万）     3.8 Mops/s, 44/224 ns, x1.02       3.1 Mops/s, 52/352 ns, x1.01
+//   （x は RSS の最大 / 生存バイト数の最大）
+//   小さいブロックが多いトレースでは、スレッドごとの tcache に溜まった分と 4 KiB ずつの
+//   sbrk のせいで RSS が glibc の 1.5〜2 倍になる。1コアなので複数スレッドの Mops/s は
+//   スレッドの切り替え（sched_yield）に左右される。
+// policy: 空きブロックの選び方ごとに同じトレースを再生（1コア、3回。探索長は1回の探索で調べた空きブロック
+//   （木のノード）の数、x は RSS の最大 / 生存バイト数の最大、外部断片化は生存量が最大のときの 1 - 最大の空き / 空きの合計）
+//   uniform 50万イベント    Mops/s      探索長    x     requested/allocated  外部断片化
+//     best-fit              11.2〜12.2      3.4  1.84  0.971                0.995
+//     first-fit              5.0〜6.8    1183    1.89  0.971                0.997
+//     next-fit               5.3〜7.6     149    1.93  0.971                0.998
+//     worst-fit             10.4〜13.0      1.8  2.07  0.971                0.999
+//     buddy                 16.4〜20.5      1.0  1.52  0.734                0.714
+//   powerlaw 30万イベント   best 13.1 / 1.8 / x1.50、first 7.6 / 371 / x1.47、next 7.5 / 13.6 / x1.89、
+//                           worst 10.4 / 1.7 / x2.41、buddy 17.2 / 1.0 / x1.36（requested/allocated 0.780）
+//   larson 4 スレッド       best 23.2 / 1.7 / x2.49、first 18.4 / 138 / x2.61、next 17.9 / 9.2 / x2.61、
+//                           worst 21.0 / 1.6 / x2.74、buddy 24.1 / 1.0 / x1.86（requested/allocated 0.726）
+//   first-fit / next-fit は空きブロックだけをアドレス順の索引でたどる。それでも first-fit は
+//   領域の前のほうに要求に足りない小さい空きが溜まり、毎回それを飛ばすので探索長が数百〜千になる。
+//   next-fit は前回の続きから見るので探索長は短いが、領域の後ろから切り崩すので RSS が増える。
+//   worst-fit は大きな空きを先に崩すので、どのトレースでも RSS が一番大きい。
+//   buddy は2のべき乗への切り上げで要求の 2〜3割を内部断片化で失うが、同じ大きさのブロックが
+//   同じ場所に戻るので外部断片化が小さく、この程度の生存量では RSS も一番小さかった。
+//   best-fit の外部断片化が 1 に近いのは、小さい空きの多くが tcache の補充で細かく切られて
+//   いるため（最大の空きも数 KiB しかない）。
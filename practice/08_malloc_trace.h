@@ -0,0 +1,37 @@
+// 確保トレースのファイル形式（08_malloc_trace.c で生成・再生し、08_malloc_preload.c で記録する）
+// ファイルは trace_header_t のあとに trace_event_t が events 個並ぶだけ（リトルエンディアン）。
+// オブジェクトは id で指す。malloc で新しい id が生まれ、realloc は同じ id のまま
+// サイズを変え、free で消える。同じ id に対するイベントはファイルの順に起きたものとして
+// 再生するので、別のスレッドが確保したものを解放する（producer/consumer など）トレースも表せる。
+#ifndef MALLOC_TRACE_H
+#define MALLOC_TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC 0x52544d43u // "CMTR"
+#define TRACE_VERSION 1
+
+enum {
+    TRACE_MALLOC = 1,
+    TRACE_FREE = 2,
+    TRACE_REALLOC = 3,
+};
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t threads;   // イベントの thread の最大値 + 1
+    uint32_t objects;   // id の最大値 + 1
+    uint64_t events;
+} trace_header_t;
+
+// 1イベント 12 バイト
+typedef struct {
+    uint32_t id;
+    uint32_t size;      // malloc / realloc の要求バイト数（free では 0）
+    uint8_t op;         // TRACE_MALLOC / TRACE_FREE / TRACE_REALLOC
+    uint8_t thread;     // 呼び出したスレッドの番号（0 から）
+    uint16_t reserved;
+} trace_event_t;
+
+#endif
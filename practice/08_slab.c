@@ -0,0 +1,248 @@
+// 固定サイズオブジェクト用のスラブアロケータ
+// ビルド（単体では main を持たないので、使う側と一緒にコンパイルする）:
+// gcc -O2 -pthread -DCUSTOM_MALLOC_NO_MAIN prog.c 08_slab.c 08_custom_malloc.c
+//
+// スラブは SLAB_SIZE バイトで SLAB_SIZE 境界に揃えて置くので、
+// オブジェクトのアドレスの下位ビットを落とせば所属スラブのヘッダが求まる。
+// スラブ内の空きオブジェクトは、オブジェクト自身の先頭にリンクを書いたスタックで持つ。
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "08_custom_malloc.h"
+#include "08_slab.h"
+
+#define SLAB_SIZE (16 * 1024)    // 1スラブの大きさ（2のべき乗）
+#define SLABS_PER_CHUNK 8        // ヒープから一度に切り出すスラブ数
+#define SLAB_ALIGN 8             // オブジェクトのアラインメント
+
+// スラブのヘッダ（スラブの先頭に置く）
+typedef struct slab {
+    slab_cache_t* cache;
+    struct slab* next;           // キャッシュ内のリスト（partial/full/empty のどれか）
+    struct slab* prev;
+    struct slab_chunk* chunk;    // 切り出し元のチャンク
+    void* free_top;              // 空きオブジェクトのスタックの先頭
+    char* unused;                // まだ一度も使っていない領域の先頭（遅延初期化）
+    size_t inuse;                // 使用中のオブジェクト数
+} slab_t;
+
+// ヒープから確保した、スラブ SLABS_PER_CHUNK 個分の領域
+// custom_memalign で SLAB_SIZE 境界に揃えて確保する（管理情報は別に確保する）。
+typedef struct slab_chunk {
+    struct slab_chunk* next;
+    void* raw;                   // custom_memalign の戻り値（最初のスラブ）
+    size_t empty_slabs;          // このチャンク内の空きスラブ数
+} slab_chunk_t;
+
+struct slab_cache {
+    char name[32];
+    size_t object_size;
+    size_t objects_per_slab;
+    slab_t* partial;             // 使用中と空きが混在するスラブ
+    slab_t* full;                // 空きのないスラブ
+    slab_t* empty;               // すべて空きのスラブ
+    slab_chunk_t* chunks;
+    slab_stats_t stats;
+    pthread_mutex_t lock;
+};
+
+#define SLAB_OF(object) ((slab_t*)((uintptr_t)(object) & ~(uintptr_t)(SLAB_SIZE - 1)))
+#define SLAB_HEADER_SIZE ((sizeof(slab_t) + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1))
+
+static void slab_list_push(slab_t** list, slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) (*list)->prev = slab;
+    *list = slab;
+}
+
+static void slab_list_remove(slab_t** list, slab_t* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+slab_cache_t* slab_cache_create(const char* name, size_t object_size) {
+    if (object_size < sizeof(void*)) object_size = sizeof(void*); // 空きリンクが入る大きさ
+    object_size = (object_size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    if (object_size > SLAB_SIZE - SLAB_HEADER_SIZE) return NULL;
+
+    slab_cache_t* cache = custom_malloc(sizeof(slab_cache_t));
+    if (cache == NULL) return NULL;
+    memset(cache, 0, sizeof(*cache));
+    snprintf(cache->name, sizeof(cache->name), "%s", name);
+    cache->object_size = object_size;
+    cache->objects_per_slab = (SLAB_SIZE - SLAB_HEADER_SIZE) / object_size;
+    cache->stats.object_size = object_size;
+    cache->stats.objects_per_slab = cache->objects_per_slab;
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+// ヒープからチャンクを確保し、SLAB_SIZE 境界のスラブに切り分けて empty に入れる
+static bool slab_cache_grow(slab_cache_t* cache) {
+    slab_chunk_t* chunk = custom_malloc(sizeof(slab_chunk_t));
+    if (chunk == NULL) return false;
+    char* first = custom_memalign(SLAB_SIZE, SLAB_SIZE * SLABS_PER_CHUNK);
+    if (first == NULL) {
+        custom_free(chunk);
+        return false;
+    }
+    chunk->raw = first;
+    chunk->empty_slabs = SLABS_PER_CHUNK;
+    chunk->next = cache->chunks;
+    cache->chunks = chunk;
+
+    for (int i = 0; i < SLABS_PER_CHUNK; i++) {
+        slab_t* slab = (slab_t*)(first + i * SLAB_SIZE);
+        slab->cache = cache;
+        slab->chunk = chunk;
+        slab->free_top = NULL;
+        slab->unused = (char*)slab + SLAB_HEADER_SIZE;
+        slab->inuse = 0;
+        slab_list_push(&cache->empty, slab);
+    }
+    cache->stats.slabs += SLABS_PER_CHUNK;
+    cache->stats.empty_slabs += SLABS_PER_CHUNK;
+    cache->stats.reserved_bytes += SLAB_SIZE * SLABS_PER_CHUNK;
+    return true;
+}
+
+void* slab_alloc(slab_cache_t* cache) {
+    pthread_mutex_lock(&cache->lock);
+
+    slab_t* slab = cache->partial;
+    if (slab == NULL) {
+        if (cache->empty == NULL && !slab_cache_grow(cache)) {
+            pthread_mutex_unlock(&cache->lock);
+            return NULL;
+        }
+        slab = cache->empty;
+        slab_list_remove(&cache->empty, slab);
+        slab_list_push(&cache->partial, slab);
+        slab->chunk->empty_slabs--;
+        cache->stats.empty_slabs--;
+    }
+
+    // 空きスタックから取り出す。空なら未使用領域から切り出す
+    void* object = slab->free_top;
+    if (object) {
+        slab->free_top = *(void**)object;
+    } else {
+        object = slab->unused;
+        slab->unused += cache->object_size;
+    }
+    slab->inuse++;
+
+    if (slab->inuse == cache->objects_per_slab) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+        cache->stats.full_slabs++;
+    }
+    cache->stats.active_objects++;
+    cache->stats.alloc_count++;
+
+    pthread_mutex_unlock(&cache->lock);
+    return object;
+}
+
+void slab_free(slab_cache_t* cache, void* object) {
+    if (object == NULL) return;
+    slab_t* slab = SLAB_OF(object);
+    if (slab->cache != cache) {
+        fprintf(stderr, "Error: %p does not belong to slab cache %s\n", object, cache->name);
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    if (slab->inuse == cache->objects_per_slab) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+        cache->stats.full_slabs--;
+    }
+
+    *(void**)object = slab->free_top;
+    slab->free_top = object;
+    slab->inuse--;
+
+    if (slab->inuse == 0) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->empty, slab);
+        slab->chunk->empty_slabs++;
+        cache->stats.empty_slabs++;
+    }
+    cache->stats.active_objects--;
+    cache->stats.free_count++;
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// すべてのスラブが空になったチャンクをヒープへ返す
+void slab_cache_shrink(slab_cache_t* cache) {
+    pthread_mutex_lock(&cache->lock);
+    slab_chunk_t** link = &cache->chunks;
+    while (*link) {
+        slab_chunk_t* chunk = *link;
+        if (chunk->empty_slabs < SLABS_PER_CHUNK) {
+            link = &chunk->next;
+            continue;
+        }
+        *link = chunk->next;
+
+        slab_t* slab = cache->empty;
+        while (slab) {
+            slab_t* next = slab->next;
+            if (slab->chunk == chunk) slab_list_remove(&cache->empty, slab);
+            slab = next;
+        }
+        cache->stats.slabs -= SLABS_PER_CHUNK;
+        cache->stats.empty_slabs -= SLABS_PER_CHUNK;
+        cache->stats.reserved_bytes -= SLAB_SIZE * SLABS_PER_CHUNK;
+        custom_free(chunk->raw);
+        custom_free(chunk);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// キャッシュを破棄する（使用中のオブジェクトもまとめて解放される）
+void slab_cache_destroy(slab_cache_t* cache) {
+    slab_chunk_t* chunk = cache->chunks;
+    while (chunk) {
+        slab_chunk_t* next = chunk->next;
+        custom_free(chunk->raw);
+        custom_free(chunk);
+        chunk = next;
+    }
+    pthread_mutex_destroy(&cache->lock);
+    custom_free(cache);
+}
+
+void slab_cache_get_stats(slab_cache_t* cache, slab_stats_t* stats) {
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void slab_cache_print_stats(slab_cache_t* cache) {
+    slab_stats_t st;
+    slab_cache_get_stats(cache, &st);
+    printf("\nSlab cache \"%s\":\n", cache->name);
+    printf("Object size: %zu bytes (%zu per slab)\n", st.object_size, st.objects_per_slab);
+    printf("Slabs: %zu (full %zu, empty %zu)\n", st.slabs, st.full_slabs, st.empty_slabs);
+    printf("Active objects: %zu\n", st.active_objects);
+    printf("Allocs / frees: %zu / %zu\n", st.alloc_count, st.free_count);
+    printf("Reserved: %zu bytes", st.reserved_bytes);
+    if (st.active_objects) {
+        printf(" (%.1f bytes per active object)", (double)st.reserved_bytes / st.active_objects);
+    }
+    printf("\n");
+}
@@ -0,0 +1,32 @@
+// 固定サイズオブジェクト用のスラブアロケータ（08_custom_malloc.c のヒープの上に載る）
+// オブジェクトサイズごとにキャッシュを作り、確保・解放はどちらも O(1)。
+// オブジェクトごとのヘッダは持たない（所属スラブはアドレスから求める）。
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+typedef struct slab_cache slab_cache_t;
+
+// キャッシュごとの統計
+typedef struct {
+    size_t object_size;      // 1オブジェクトのサイズ（アラインメント後）
+    size_t objects_per_slab; // 1スラブに入るオブジェクト数
+    size_t slabs;            // 保持しているスラブ数
+    size_t full_slabs;       // 空きのないスラブ数
+    size_t empty_slabs;      // 使用中オブジェクトがないスラブ数
+    size_t active_objects;   // 使用中のオブジェクト数
+    size_t alloc_count;      // 累計の確保回数
+    size_t free_count;       // 累計の解放回数
+    size_t reserved_bytes;   // ヒープから確保しているバイト数
+} slab_stats_t;
+
+slab_cache_t* slab_cache_create(const char* name, size_t object_size);
+void slab_cache_destroy(slab_cache_t* cache);
+void* slab_alloc(slab_cache_t* cache);
+void slab_free(slab_cache_t* cache, void* object);
+void slab_cache_shrink(slab_cache_t* cache);
+void slab_cache_get_stats(slab_cache_t* cache, slab_stats_t* stats);
+void slab_cache_print_stats(slab_cache_t* cache);
+
+#endif
@@ -1,164 +1,1563 @@
+// ページ置換アルゴリズムのシミュレーション（FIFO/LRU/OPT ほか）
+// gcc -O2 -pthread -o page_algo page_algo.c
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#define MAX_REF 100
-#define MAX_FRAME 20
+// ページ番号
+// トレースファイルはヘッダなしで u32 か u64 のページ番号が並ぶだけ（リトルエンディアン）
+typedef uint64_t page_t;
+
+#define EMPTY_FRAME UINT64_MAX  // 空きフレーム
+#define CHUNK_REFS 65536        // 一度に取り出す参照の最大数
+
+// 参照列
+// トレースファイルは全体を読み取り専用で mmap する。mmap できないときは pread で
+// 塊ごとに読むので、どちらでもメモリに載せきれない長さのトレースを扱える。
+// 対話モードで入力した参照列はメモリ上の page_t 配列をそのまま指す。
+typedef struct {
+    const void* data;   // 参照列全体（NULL なら fd から読む）
+    size_t map_size;    // mmap した大きさ（mmap していなければ 0）
+    int fd;
+    int width;          // ページ番号1つのバイト数（4 または 8）
+    size_t count;       // 参照の数
+} trace_t;
+
+// 参照列を pos から塊ごとに取り出す
+typedef struct {
+    const trace_t* trace;
+    size_t pos;         // 次に取り出す参照の番号
+    page_t* buf;        // u32 を広げたり pread したりする塊（CHUNK_REFS 個）
+} cursor_t;
+
+static void* xmalloc(size_t size) {
+    void* p = malloc(size ? size : 1);
+    if (p == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    return p;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void cursor_init(cursor_t* c, const trace_t* trace, size_t pos) {
+    c->trace = trace;
+    c->pos = pos;
+    c->buf = xmalloc(CHUNK_REFS * sizeof(page_t));
+}
+
+static void cursor_destroy(cursor_t* c) {
+    free(c->buf);
+}
+
+// 最大 max 個（CHUNK_REFS まで）の参照を *refs に取り出して、その数を返す（終わりなら 0）
+static size_t cursor_next(cursor_t* c, size_t max, const page_t** refs) {
+    const trace_t* t = c->trace;
+    size_t n = t->count - c->pos;
+    if (max > CHUNK_REFS) max = CHUNK_REFS;
+    if (n > max) n = max;
+    if (n == 0) return 0;
+
+    if (t->data != NULL && t->width == sizeof(page_t)) {
+        *refs = (const page_t*)t->data + c->pos; // そのまま使える
+    } else if (t->data != NULL) {
+        const uint32_t* src = (const uint32_t*)t->data + c->pos;
+        for (size_t i = 0; i < n; i++) c->buf[i] = src[i];
+        *refs = c->buf;
+    } else {
+        char* dst = (char*)c->buf;
+        size_t want = n * t->width, got = 0;
+        off_t offset = (off_t)(c->pos * t->width);
+        while (got < want) {
+            ssize_t r = pread(t->fd, dst + got, want - got, offset + got);
+            if (r <= 0) {
+                if (r < 0) perror("pread");
+                break;
+            }
+            got += r;
+        }
+        n = got / t->width;
+        if (t->width == 4) {
+            // 後ろから広げれば、まだ読んでいない u32 を上書きしない
+            const uint32_t* src = (const uint32_t*)c->buf;
+            for (size_t i = n; i-- > 0;) c->buf[i] = src[i];
+        }
+        *refs = c->buf;
+    }
+    c->pos += n;
+    return n;
+}
+
+static bool trace_open(trace_t* t, const char* path, int width) {
+    memset(t, 0, sizeof(*t));
+    t->width = width;
+    t->fd = open(path, O_RDONLY);
+    if (t->fd < 0) {
+        perror(path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(t->fd, &st) < 0) {
+        perror(path);
+        close(t->fd);
+        return false;
+    }
+    if (st.st_size % width != 0) {
+        fprintf(stderr, "%s: 大きさが %d の倍数ではないので末尾を無視します\n", path, width);
+    }
+    t->count = st.st_size / width;
+    if (st.st_size > 0) {
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, t->fd, 0);
+        if (p != MAP_FAILED) {
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            t->data = p;
+            t->map_size = st.st_size;
+        }
+    }
+    return true;
+}
+
+static void trace_close(trace_t* t) {
+    if (t->map_size != 0) munmap((void*)t->data, t->map_size);
+    if (t->fd >= 0) close(t->fd);
+}
 
 // コンマ区切りまたはスペース区切りのページ参照列を入力
-void input_pages(int *pages, int *n, int *frame_size) {
-    char buf[1024];
+void input_pages(trace_t* trace, size_t* frame_size) {
+    char* buf = NULL;
+    size_t len = 0;
     printf("ページ参照列をカンマまたはスペース区切りで入力（例: 0,2,1,3,5 または 0 2 1 3 5）:\n");
-    fgets(buf, sizeof(buf), stdin);
+    if (getline(&buf, &len, stdin) < 0) {
+        buf = xmalloc(1);
+        buf[0] = '\0';
+    }
 
-    int i = 0;
-    char *p = buf;
+    size_t i = 0, cap = 64;
+    page_t* pages = xmalloc(cap * sizeof(page_t));
+    char* p = buf;
     while (*p) {
         // 数字をスキップ
-        while (*p && !isdigit(*p) && *p != '-') p++;
+        while (*p && !isdigit((unsigned char)*p) && *p != '-') p++;
         if (!*p) break;
-        pages[i++] = strtol(p, &p, 10);
+        char* end;
+        long long value = strtoll(p, &end, 10);
+        if (end == p) { // "-" だけ
+            p++;
+            continue;
+        }
+        p = end;
+        if (i == cap) {
+            cap *= 2;
+            pages = realloc(pages, cap * sizeof(page_t));
+            if (pages == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        pages[i++] = (page_t)value;
         // カンマやスペースをスキップ
-        while (*p && (isspace(*p) || *p == ',')) p++;
+        while (*p && (isspace((unsigned char)*p) || *p == ',')) p++;
     }
-    *n = i;
+    free(buf);
+
+    memset(trace, 0, sizeof(*trace));
+    trace->data = pages;
+    trace->fd = -1;
+    trace->width = sizeof(page_t);
+    trace->count = i;
+
     printf("フレーム数を入力してください: \n");
-    scanf("%d", frame_size);
+    if (scanf("%zu", frame_size) != 1) *frame_size = 0;
     getchar(); // 改行消費
 }
 
 // FIFOアルゴリズム
-int fifo(int *pages, int n, int frame_size, int *final_frame) {
-    int frame[MAX_FRAME] = {0};
-    int front = 0, faults = 0;
-    for (int i = 0; i < frame_size; i++) frame[i] = -1;
-
-    for (int i = 0; i < n; i++) {
-        int found = 0;
-        for (int j = 0; j < frame_size; j++) {
-            if (frame[j] == pages[i]) {
-                found = 1;
-                break;
+size_t fifo(const trace_t* trace, size_t frame_size, page_t* final_frame) {
+    page_t* frame = final_frame; // 最後の中身がそのまま最終フレームになる
+    size_t front = 0, faults = 0;
+    for (size_t i = 0; i < frame_size; i++) frame[i] = EMPTY_FRAME;
+
+    cursor_t c;
+    cursor_init(&c, trace, 0);
+    const page_t* pages;
+    size_t n;
+    while ((n = cursor_next(&c, CHUNK_REFS, &pages)) != 0) {
+        for (size_t i = 0; i < n; i++) {
+            int found = 0;
+            for (size_t j = 0; j < frame_size; j++) {
+                if (frame[j] == pages[i]) {
+                    found = 1;
+                    break;
+                }
+            }
+            if (!found) {
+                frame[front] = pages[i];
+                front = (front + 1) % frame_size;
+                faults++;
             }
-        }
-        if (!found) {
-            frame[front] = pages[i];
-            front = (front + 1) % frame_size;
-            faults++;
         }
     }
-    for (int i = 0; i < frame_size; i++) final_frame[i] = frame[i];
+    cursor_destroy(&c);
     return faults;
 }
 
 // LRUアルゴリズム
-int lru(int *pages, int n, int frame_size, int *final_frame) {
-    int frame[MAX_FRAME] = {0};
-    int recent[MAX_FRAME] = {0};
-    int faults = 0, time = 0;
-    for (int i = 0; i < frame_size; i++) frame[i] = -1;
-
-    for (int i = 0; i < n; i++) {
-        int found = 0;
-        for (int j = 0; j < frame_size; j++) {
-            if (frame[j] == pages[i]) {
-                found = 1;
-                recent[j] = ++time;
-                break;
+size_t lru(const trace_t* trace, size_t frame_size, page_t* final_frame) {
+    page_t* frame = final_frame;
+    uint64_t* recent = xmalloc(frame_size * sizeof(uint64_t));
+    uint64_t time = 0;
+    size_t faults = 0;
+    for (size_t i = 0; i < frame_size; i++) {
+        frame[i] = EMPTY_FRAME;
+        recent[i] = 0;
+    }
+
+    cursor_t c;
+    cursor_init(&c, trace, 0);
+    const page_t* pages;
+    size_t n;
+    while ((n = cursor_next(&c, CHUNK_REFS, &pages)) != 0) {
+        for (size_t i = 0; i < n; i++) {
+            int found = 0;
+            for (size_t j = 0; j < frame_size; j++) {
+                if (frame[j] == pages[i]) {
+                    found = 1;
+                    recent[j] = ++time;
+                    break;
+                }
             }
-        }
-        if (!found) {
-            int lru_idx = 0;
-            for (int j = 1; j < frame_size; j++) {
-                if (recent[j] < recent[lru_idx]) lru_idx = j;
+            if (!found) {
+                size_t lru_idx = 0;
+                for (size_t j = 1; j < frame_size; j++) {
+                    if (recent[j] < recent[lru_idx]) lru_idx = j;
+                }
+                frame[lru_idx] = pages[i];
+                recent[lru_idx] = ++time;
+                faults++;
             }
-            frame[lru_idx] = pages[i];
-            recent[lru_idx] = ++time;
-            faults++;
         }
     }
-    for (int i = 0; i < frame_size; i++) final_frame[i] = frame[i];
+    cursor_destroy(&c);
+    free(recent);
     return faults;
 }
 
+// ページ番号 → 値のハッシュ表（開番地法、線形探査）
+// 削除は後ろの要素を詰めて戻すので墓標を残さない。ページ番号 EMPTY_FRAME は空きの印に使う。
+typedef struct {
+    page_t page;
+    uint64_t value;
+} page_slot_t;
+
+typedef struct {
+    page_slot_t* slots;
+    size_t mask;        // 容量 - 1（容量は2のべき乗）
+    size_t count;
+} page_map_t;
+
+static inline size_t page_hash(const page_map_t* m, page_t page) {
+    return (size_t)((page * 0x9E3779B97F4A7C15ULL) >> 32) & m->mask;
+}
+
+// 要素数が expected までなら大きくしなくて済むように作る
+static void page_map_init(page_map_t* m, size_t expected) {
+    size_t capacity = 16;
+    while (capacity < expected * 2) capacity *= 2;
+    m->slots = xmalloc(capacity * sizeof(page_slot_t));
+    m->mask = capacity - 1;
+    m->count = 0;
+    for (size_t i = 0; i < capacity; i++) m->slots[i].page = EMPTY_FRAME;
+}
+
+static void page_map_destroy(page_map_t* m) {
+    free(m->slots);
+}
+
+static inline uint64_t* page_map_find(const page_map_t* m, page_t page) {
+    for (size_t i = page_hash(m, page);; i = (i + 1) & m->mask) {
+        page_slot_t* s = &m->slots[i];
+        if (s->page == page) return &s->value;
+        if (s->page == EMPTY_FRAME) return NULL;
+    }
+}
+
+static void page_map_grow(page_map_t* m);
+
+// page の値を value にする（なければ加える）
+static inline void page_map_put(page_map_t* m, page_t page, uint64_t value) {
+    size_t i;
+    for (i = page_hash(m, page);; i = (i + 1) & m->mask) {
+        page_slot_t* s = &m->slots[i];
+        if (s->page == page) {
+            s->value = value;
+            return;
+        }
+        if (s->page == EMPTY_FRAME) break;
+    }
+    m->slots[i].page = page;
+    m->slots[i].value = value;
+    if (++m->count * 2 > m->mask + 1) page_map_grow(m);
+}
+
+static void page_map_grow(page_map_t* m) {
+    page_slot_t* old = m->slots;
+    size_t capacity = m->mask + 1;
+    page_map_init(m, capacity);
+    for (size_t i = 0; i < capacity; i++) {
+        if (old[i].page != EMPTY_FRAME) page_map_put(m, old[i].page, old[i].value);
+    }
+    free(old);
+}
+
+static inline void page_map_remove(page_map_t* m, page_t page) {
+    size_t i;
+    for (i = page_hash(m, page); m->slots[i].page != page; i = (i + 1) & m->mask) {
+        if (m->slots[i].page == EMPTY_FRAME) return;
+    }
+    m->count--;
+    // 空いた場所より前から探査してくる要素を詰める
+    for (size_t j = (i + 1) & m->mask; m->slots[j].page != EMPTY_FRAME; j = (j + 1) & m->mask) {
+        size_t home = page_hash(m, m->slots[j].page);
+        if (((j - home) & m->mask) >= ((j - i) & m->mask)) {
+            m->slots[i] = m->slots[j];
+            i = j;
+        }
+    }
+    m->slots[i].page = EMPTY_FRAME;
+}
+
+#define NIL_FRAME UINT32_MAX
 
-void print_result(const char *name, int faults, int *frame, int frame_size) {
-    printf("[%s] ページフォルト数: %d\n", name, faults);
+// フレームに埋め込む双方向リストのつながり（フレーム番号で指す）
+typedef struct {
+    uint32_t prev, next;
+} frame_link_t;
+
+// frame_link_t でつないだリスト（先頭が新しく、末尾が古い）
+typedef struct {
+    uint32_t head, tail;
+    size_t size;
+} frame_list_t;
+
+static inline void list_init(frame_list_t* l) {
+    l->head = l->tail = NIL_FRAME;
+    l->size = 0;
+}
+
+static inline void list_push(frame_list_t* l, frame_link_t* link, uint32_t i) {
+    link[i].prev = NIL_FRAME;
+    link[i].next = l->head;
+    if (l->head != NIL_FRAME) {
+        link[l->head].prev = i;
+    } else {
+        l->tail = i;
+    }
+    l->head = i;
+    l->size++;
+}
+
+static inline void list_remove(frame_list_t* l, frame_link_t* link, uint32_t i) {
+    if (link[i].prev != NIL_FRAME) {
+        link[link[i].prev].next = link[i].next;
+    } else {
+        l->head = link[i].next;
+    }
+    if (link[i].next != NIL_FRAME) {
+        link[link[i].next].prev = link[i].prev;
+    } else {
+        l->tail = link[i].prev;
+    }
+    l->size--;
+}
+
+static inline uint32_t list_pop_tail(frame_list_t* l, frame_link_t* link) {
+    uint32_t i = l->tail;
+    list_remove(l, link, i);
+    return i;
+}
+
+// O(1) の LRU
+// ページ番号 → フレーム番号のハッシュ表と、最近使った順のリスト（先頭が最新、末尾が置き換え対象）で、
+// ヒットも置き換えもフレーム数によらない手間で済ませる。空きフレームを番号順に埋め、置き換えでは
+// 追い出したページのフレームをそのまま使うので、lru とフォルト数も最終フレームも一致する。
+size_t lru_o1(const trace_t* trace, size_t frame_size, page_t* final_frame) {
+    page_t* frame = final_frame;
+    frame_link_t* link = xmalloc(frame_size * sizeof(frame_link_t));
+    frame_list_t recent;
+    list_init(&recent);
+    page_map_t map;
+    page_map_init(&map, frame_size);
+    size_t faults = 0, used = 0;
+    for (size_t i = 0; i < frame_size; i++) frame[i] = EMPTY_FRAME;
+
+    cursor_t c;
+    cursor_init(&c, trace, 0);
+    const page_t* pages;
+    size_t n;
+    while ((n = cursor_next(&c, CHUNK_REFS, &pages)) != 0) {
+        for (size_t i = 0; i < n; i++) {
+            uint64_t* found = page_map_find(&map, pages[i]);
+            uint32_t idx;
+            if (found != NULL) {
+                idx = (uint32_t)*found;
+                if (idx == recent.head) continue;
+                list_remove(&recent, link, idx);
+            } else {
+                faults++;
+                if (used < frame_size) {
+                    idx = (uint32_t)used++;
+                } else {
+                    // 末尾（最も長く使われていないページ）を追い出す
+                    idx = list_pop_tail(&recent, link);
+                    page_map_remove(&map, frame[idx]);
+                }
+                frame[idx] = pages[i];
+                page_map_put(&map, pages[i], idx);
+            }
+            list_push(&recent, link, idx);
+        }
+    }
+    cursor_destroy(&c);
+    page_map_destroy(&map);
+    free(link);
+    return faults;
+}
+
+void print_result(const char *name, size_t faults, const page_t *frame, size_t frame_size) {
+    printf("[%s] ページフォルト数: %zu\n", name, faults);
     printf("[%s] 最終フレーム: ", name);
-    for (int i = 0; i < frame_size; i++) {
-        if (frame[i] != -1)
-            printf("%d ", frame[i]);
+    for (size_t i = 0; i < frame_size; i++) {
+        if (frame[i] != EMPTY_FRAME)
+            printf("%lld ", (long long)frame[i]);
     }
     printf("\n");
 }
 
-// ...existing code...
-
 // OPT（最適）アルゴリズム
-int opt(int *pages, int n, int frame_size, int *final_frame) {
-    int frame[MAX_FRAME] = {0};
-    for (int i = 0; i < frame_size; i++) frame[i] = -1;
-    int faults = 0;
-
-    for (int i = 0; i < n; i++) {
-        int found = 0;
-        // すでにフレーム内にあるか確認
-        for (int j = 0; j < frame_size; j++) {
-            if (frame[j] == pages[i]) {
-                found = 1;
-                break;
+// 置き換えるページは、その先を読み進めて各フレームの次の参照を探して決める。
+// 次の参照がいちばん遠いフレーム（二度と参照されないものが複数あれば番号の小さいほう）を選ぶ。
+size_t opt(const trace_t* trace, size_t frame_size, page_t* final_frame) {
+    page_t* frame = final_frame;
+    bool* seen = xmalloc(frame_size * sizeof(bool));
+    for (size_t i = 0; i < frame_size; i++) frame[i] = EMPTY_FRAME;
+    size_t faults = 0, used = 0;
+
+    cursor_t c, ahead;
+    cursor_init(&c, trace, 0);
+    cursor_init(&ahead, trace, 0);
+    const page_t* pages;
+    size_t n, base = 0;
+    while ((n = cursor_next(&c, CHUNK_REFS, &pages)) != 0) {
+        for (size_t i = 0; i < n; i++) {
+            int found = 0;
+            // すでにフレーム内にあるか確認
+            for (size_t j = 0; j < frame_size; j++) {
+                if (frame[j] == pages[i]) {
+                    found = 1;
+                    break;
+                }
             }
-        }
-        if (!found) {
+            if (found) continue;
+            faults++;
             // 空きフレームがあればそこに入れる
-            int empty = -1;
-            for (int j = 0; j < frame_size; j++) {
-                if (frame[j] == -1) {
-                    empty = j;
-                    break;
+            if (used < frame_size) {
+                frame[used++] = pages[i];
+                continue;
+            }
+            // どのページを置き換えるか決める
+            // 先読みは近くで決まることが多いので、小さな塊から始めて倍々に広げる
+            for (size_t j = 0; j < frame_size; j++) seen[j] = false;
+            size_t remaining = frame_size, last = 0, want = 64, m;
+            const page_t* future;
+            ahead.pos = base + i + 1;
+            while (remaining > 0 && (m = cursor_next(&ahead, want, &future)) != 0) {
+                for (size_t k = 0; k < m && remaining > 0; k++) {
+                    for (size_t j = 0; j < frame_size; j++) {
+                        if (frame[j] == future[k]) {
+                            if (!seen[j]) {
+                                seen[j] = true;
+                                remaining--;
+                                last = j;
+                            }
+                            break;
+                        }
+                    }
                 }
+                want *= 2;
+            }
+            size_t idx = last;
+            if (remaining > 0) {
+                for (idx = 0; seen[idx]; idx++) {
+                }
+            }
+            frame[idx] = pages[i];
+        }
+        base += n;
+    }
+    cursor_destroy(&ahead);
+    cursor_destroy(&c);
+    free(seen);
+    return faults;
+}
+
+// 各参照の次に同じページが参照される位置を、後ろから1回なめて求める（なければ count）
+static size_t* next_use_positions(const trace_t* trace) {
+    size_t count = trace->count;
+    size_t* next_use = xmalloc(count * sizeof(size_t));
+    page_map_t last; // ページ → いま見ている位置より後ろで最初に参照される位置
+    page_map_init(&last, 1024);
+
+    cursor_t c;
+    cursor_init(&c, trace, 0);
+    for (size_t end = count; end > 0;) {
+        size_t start = end > CHUNK_REFS ? end - CHUNK_REFS : 0;
+        const page_t* pages;
+        c.pos = start;
+        if (cursor_next(&c, end - start, &pages) != end - start) {
+            fprintf(stderr, "トレースを読めませんでした\n");
+            exit(1);
+        }
+        for (size_t i = end - start; i-- > 0;) {
+            uint64_t* seen = page_map_find(&last, pages[i]);
+            if (seen != NULL) {
+                next_use[start + i] = *seen;
+                *seen = start + i;
+            } else {
+                next_use[start + i] = count;
+                page_map_put(&last, pages[i], start + i);
+            }
+        }
+        end = start;
+    }
+    cursor_destroy(&c);
+    page_map_destroy(&last);
+    return next_use;
+}
+
+// 次の参照位置をキーにしたフレームの最大ヒープ
+// キーが同じ（どちらも二度と参照されない）ならフレーム番号の小さいほうを上にして、opt と同じものを選ぶ。
+typedef struct {
+    uint32_t* heap;     // フレーム番号
+    uint32_t* pos;      // フレーム番号 → heap の中の位置
+    size_t* key;        // フレーム番号 → 中のページが次に参照される位置
+    size_t size;
+} next_heap_t;
+
+static inline bool next_heap_above(const next_heap_t* h, uint32_t a, uint32_t b) {
+    return h->key[a] > h->key[b] || (h->key[a] == h->key[b] && a < b);
+}
+
+static inline void next_heap_set(next_heap_t* h, size_t i, uint32_t frame) {
+    h->heap[i] = frame;
+    h->pos[frame] = (uint32_t)i;
+}
+
+static void next_heap_up(next_heap_t* h, size_t i) {
+    uint32_t frame = h->heap[i];
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!next_heap_above(h, frame, h->heap[parent])) break;
+        next_heap_set(h, i, h->heap[parent]);
+        i = parent;
+    }
+    next_heap_set(h, i, frame);
+}
+
+static void next_heap_down(next_heap_t* h, size_t i) {
+    uint32_t frame = h->heap[i];
+    for (;;) {
+        size_t child = i * 2 + 1;
+        if (child >= h->size) break;
+        if (child + 1 < h->size && next_heap_above(h, h->heap[child + 1], h->heap[child])) child++;
+        if (!next_heap_above(h, h->heap[child], frame)) break;
+        next_heap_set(h, i, h->heap[child]);
+        i = child;
+    }
+    next_heap_set(h, i, frame);
+}
+
+// O(n log n) の OPT
+// 先に各参照の次の参照位置を求めておき、置き換えはヒープの先頭（次の参照がいちばん遠い
+// フレーム）を選ぶ。ヒットでは次の参照位置が後ろにずれるだけなので、ヒープの上へ動かせばよい。
+// 選ぶフレームは opt と同じなので、フォルト数も最終フレームも一致する。
+// 次の参照位置の表に参照1つあたり 8 バイト使う。
+size_t opt_heap(const trace_t* trace, size_t frame_size, page_t* final_frame) {
+    page_t* frame = final_frame;
+    size_t* next_use = next_use_positions(trace);
+    next_heap_t h;
+    h.heap = xmalloc(frame_size * sizeof(uint32_t));
+    h.pos = xmalloc(frame_size * sizeof(uint32_t));
+    h.key = xmalloc(frame_size * sizeof(size_t));
+    h.size = 0;
+    page_map_t map;
+    page_map_init(&map, frame_size);
+    size_t faults = 0;
+    for (size_t i = 0; i < frame_size; i++) frame[i] = EMPTY_FRAME;
+
+    cursor_t c;
+    cursor_init(&c, trace, 0);
+    const page_t* pages;
+    size_t n, base = 0;
+    while ((n = cursor_next(&c, CHUNK_REFS, &pages)) != 0) {
+        for (size_t i = 0; i < n; i++) {
+            size_t next = next_use[base + i];
+            uint64_t* found = page_map_find(&map, pages[i]);
+            if (found != NULL) {
+                uint32_t idx = (uint32_t)*found;
+                h.key[idx] = next;
+                next_heap_up(&h, h.pos[idx]);
+                continue;
             }
-            if (empty != -1) {
-                frame[empty] = pages[i];
+            faults++;
+            uint32_t idx;
+            if (h.size < frame_size) {
+                // 空きフレームがあればそこに入れる
+                idx = (uint32_t)h.size++;
+                h.key[idx] = next;
+                next_heap_set(&h, idx, idx);
+                next_heap_up(&h, idx);
             } else {
-                // どのページを置き換えるか決める
-                int farthest = -1, idx = -1;
-                for (int j = 0; j < frame_size; j++) {
-                    int k;
-                    for (k = i + 1; k < n; k++) {
-                        if (frame[j] == pages[k]) break;
-                    }
-                    if (k > farthest) {
-                        farthest = k;
-                        idx = j;
+                idx = h.heap[0];
+                page_map_remove(&map, frame[idx]);
+                h.key[idx] = next;
+                next_heap_down(&h, 0);
+            }
+            frame[idx] = pages[i];
+            page_map_put(&map, pages[i], idx);
+        }
+        base += n;
+    }
+    cursor_destroy(&c);
+    page_map_destroy(&map);
+    free(h.heap);
+    free(h.pos);
+    free(h.key);
+    free(next_use);
+    return faults;
+}
+
+// Fenwick 木（位置 0 から始まる 0/1 の列の区間和）
+typedef struct {
+    uint32_t* tree;     // 1 始まり
+    size_t size;
+} fenwick_t;
+
+// 位置 0〜ones-1 を 1 にした木を O(size) で作る
+static void fenwick_init(fenwick_t* f, size_t size, size_t ones) {
+    f->tree = xmalloc((size + 1) * sizeof(uint32_t));
+    f->size = size;
+    f->tree[0] = 0;
+    for (size_t i = 1; i <= size; i++) f->tree[i] = i <= ones;
+    for (size_t i = 1; i <= size; i++) {
+        size_t parent = i + (i & -i);
+        if (parent <= size) f->tree[parent] += f->tree[i];
+    }
+}
+
+static inline void fenwick_add(fenwick_t* f, size_t pos, int32_t delta) {
+    for (size_t i = pos + 1; i <= f->size; i += i & -i) f->tree[i] += delta;
+}
+
+// 位置 0〜pos-1 の和
+static inline size_t fenwick_prefix(const fenwick_t* f, size_t pos) {
+    size_t sum = 0;
+    for (size_t i = pos; i > 0; i -= i & -i) sum += f->tree[i];
+    return sum;
+}
+
+static int compare_time(const void* a, const void* b) {
+    uint64_t x = **(uint64_t* const*)a, y = **(uint64_t* const*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Mattson のスタック距離
+// LRU はフレーム数 F のときの中身が、F+1 のときの中身にいつも含まれる（包含性）。そのため
+// 参照ごとに、前回の参照から今までに参照された異なるページの数 d（スタック距離、前回の
+// 参照が直前なら 1）を数えれば、d > F の参照と初めての参照がちょうど F フレームでのフォルトになる。
+// d は、各ページの最後の参照時刻に 1 を立てた Fenwick 木で前回の時刻より後ろの 1 を数えて求める。
+// 時刻が木の大きさに達したら生きている時刻（異なるページの数だけある）を詰めて振り直すので、
+// 木の大きさはトレースの長さではなく異なるページの数に比例する。
+typedef struct {
+    uint64_t* hist;     // hist[d] = スタック距離が d の参照の数
+    size_t max_distance;
+    size_t cold;        // 初めての参照の数（= 異なるページの数）
+    size_t refs;
+} stack_distance_t;
+
+static void stack_distances(const trace_t* trace, stack_distance_t* sd) {
+    page_map_t last; // ページ → 最後に参照した時刻（木の位置）
+    page_map_init(&last, 1024);
+    fenwick_t f;
+    fenwick_init(&f, 1 << 20, 0);
+    size_t now = 0, hist_cap = 1024;
+    memset(sd, 0, sizeof(*sd));
+    sd->hist = calloc(hist_cap, sizeof(uint64_t));
+    if (sd->hist == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    cursor_t c;
+    cursor_init(&c, trace, 0);
+    const page_t* pages;
+    size_t n;
+    while ((n = cursor_next(&c, CHUNK_REFS, &pages)) != 0) {
+        for (size_t i = 0; i < n; i++) {
+            if (now == f.size) {
+                // 生きている時刻を古い順に 0 から振り直す
+                size_t live = last.count, k = 0;
+                uint64_t** times = xmalloc(live * sizeof(uint64_t*));
+                for (size_t s = 0; s <= last.mask; s++) {
+                    if (last.slots[s].page != EMPTY_FRAME) times[k++] = &last.slots[s].value;
+                }
+                qsort(times, live, sizeof(uint64_t*), compare_time);
+                for (k = 0; k < live; k++) *times[k] = k;
+                free(times);
+                size_t size = f.size < live * 8 ? live * 8 : f.size;
+                free(f.tree);
+                fenwick_init(&f, size, live);
+                now = live;
+            }
+            uint64_t* seen = page_map_find(&last, pages[i]);
+            if (seen == NULL) {
+                sd->cold++;
+                page_map_put(&last, pages[i], now);
+            } else {
+                size_t d = sd->cold - fenwick_prefix(&f, *seen + 1) + 1;
+                if (d >= hist_cap) {
+                    size_t cap = hist_cap;
+                    while (cap <= d) cap *= 2;
+                    sd->hist = realloc(sd->hist, cap * sizeof(uint64_t));
+                    if (sd->hist == NULL) {
+                        perror("realloc");
+                        exit(1);
                     }
+                    memset(sd->hist + hist_cap, 0, (cap - hist_cap) * sizeof(uint64_t));
+                    hist_cap = cap;
                 }
-                frame[idx] = pages[i];
+                sd->hist[d]++;
+                if (d > sd->max_distance) sd->max_distance = d;
+                fenwick_add(&f, *seen, -1);
+                *seen = now;
+            }
+            fenwick_add(&f, now, 1);
+            now++;
+        }
+        sd->refs += n;
+    }
+    cursor_destroy(&c);
+    free(f.tree);
+    page_map_destroy(&last);
+}
+
+// CLOCK
+// フレームを輪にして針を回し、参照ビットが立っていれば下ろして次へ進み、下りているフレームを
+// 置き換える。ヒットは参照ビットを立てるだけ。ビットを下ろす回数は立てた回数を超えないので
+// 置き換えは均して O(1)。読み込んだページも参照されたものとしてビットを立てる。
+size_t clock_policy(const trace_t* trace, size_t frame_size, page_t* final_frame) {
+    page_t* frame = final_frame;
+    uint8_t* referenced = xmalloc(frame_size);
+    page_map_t map;
+    page_map_init(&map, frame_size);
+    size_t faults = 0, used = 0, hand = 0;
+    for (size_t i = 0; i < frame_size; i++) frame[i] = EMPTY_FRAME;
+
+    cursor_t c;
+    cursor_init(&c, trace, 0);
+    const page_t* pages;
+    size_t n;
+    while ((n = cursor_next(&c, CHUNK_REFS, &pages)) != 0) {
+        for (size_t i = 0; i < n; i++) {
+            uint64_t* found = page_map_find(&map, pages[i]);
+            if (found != NULL) {
+                referenced[*found] = 1;
+                continue;
+            }
+            faults++;
+            size_t idx;
+            if (used < frame_size) {
+                idx = used++;
+            } else {
+                while (referenced[hand]) {
+                    referenced[hand] = 0;
+                    if (++hand == frame_size) hand = 0;
+                }
+                idx = hand;
+                if (++hand == frame_size) hand = 0;
+                page_map_remove(&map, frame[idx]);
+            }
+            frame[idx] = pages[i];
+            referenced[idx] = 1;
+            page_map_put(&map, pages[i], idx);
+        }
+    }
+    cursor_destroy(&c);
+    page_map_destroy(&map);
+    free(referenced);
+    return faults;
+}
+
+// second-chance
+// 読み込んだ順のリストの末尾（最も古いページ）の参照ビットが立っていれば、下ろして先頭に
+// 付け直し、下りていれば置き換える。CLOCK はこれをページを動かさずに針で回したもので、
+// フォルト数も最終フレームも一致する（違うのはリストをつなぎ替える手間だけ）。
+size_t second_chance(const trace_t* trace, size_t frame_size, page_t* final_frame) {
+    page_t* frame = final_frame;
+    uint8_t* referenced = xmalloc(frame_size);
+    frame_link_t* link = xmalloc(frame_size * sizeof(frame_link_t));
+    frame_list_t queue;
+    list_init(&queue);
+    page_map_t map;
+    page_map_init(&map, frame_size);
+    size_t faults = 0, used = 0;
+    for (size_t i = 0; i < frame_size; i++) frame[i] = EMPTY_FRAME;
+
+    cursor_t c;
+    cursor_init(&c, trace, 0);
+    const page_t* pages;
+    size_t n;
+    while ((n = cursor_next(&c, CHUNK_REFS, &pages)) != 0) {
+        for (size_t i = 0; i < n; i++) {
+            uint64_t* found = page_map_find(&map, pages[i]);
+            if (found != NULL) {
+                referenced[*found] = 1;
+                continue;
+            }
+            faults++;
+            uint32_t idx;
+            if (used < frame_size) {
+                idx = (uint32_t)used++;
+            } else {
+                for (;;) {
+                    idx = list_pop_tail(&queue, link);
+                    if (!referenced[idx]) break;
+                    referenced[idx] = 0;
+                    list_push(&queue, link, idx);
+                }
+                page_map_remove(&map, frame[idx]);
+            }
+            frame[idx] = pages[i];
+            referenced[idx] = 1;
+            list_push(&queue, link, idx);
+            page_map_put(&map, pages[i], idx);
+        }
+    }
+    cursor_destroy(&c);
+    page_map_destroy(&map);
+    free(link);
+    free(referenced);
+    return faults;
+}
+
+// ゴースト（追い出したページの番号だけを覚えておくもの）
+// ハッシュ表の値は、載っているページならフレーム番号、ゴーストなら GHOST_BIT | ゴーストの番号。
+#define GHOST_BIT (1ULL << 63)
+
+typedef struct {
+    page_t* page;
+    uint8_t* which;     // どのリストにいるか（方式ごとに決める）
+    frame_link_t* link;
+    frame_list_t free;  // 使っていないゴースト
+} ghosts_t;
+
+static void ghosts_init(ghosts_t* g, size_t count) {
+    g->page = xmalloc(count * sizeof(page_t));
+    g->which = xmalloc(count);
+    g->link = xmalloc(count * sizeof(frame_link_t));
+    list_init(&g->free);
+    for (size_t i = 0; i < count; i++) list_push(&g->free, g->link, (uint32_t)i);
+}
+
+static void ghosts_destroy(ghosts_t* g) {
+    free(g->page);
+    free(g->which);
+    free(g->link);
+}
+
+// page をゴーストにしてリスト l の先頭に入れる
+static inline void ghost_add(ghosts_t* g, page_map_t* map, frame_list_t* l, uint8_t which, page_t page) {
+    uint32_t i = list_pop_tail(&g->free, g->link);
+    g->page[i] = page;
+    g->which[i] = which;
+    list_push(l, g->link, i);
+    page_map_put(map, page, GHOST_BIT | i);
+}
+
+// ゴースト i をリスト l から外して忘れる（ハッシュ表から消すかは forget で選ぶ）
+static inline void ghost_drop(ghosts_t* g, page_map_t* map, frame_list_t* l, uint32_t i, bool forget) {
+    list_remove(l, g->link, i);
+    list_push(&g->free, g->link, i);
+    if (forget) page_map_remove(map, g->page[i]);
+}
+
+// 2Q（Johnson と Shasha の full 版）
+// 初めて参照したページは FIFO の A1in（フレームの 1/4）に入れ、そこから追い出したページの番号を
+// ゴーストの A1out（フレームの 1/2）で覚えておく。A1out にいる間にもう一度参照されたページだけを
+// LRU の Am に入れるので、一度しか参照されないスキャンで Am のページが追い出されない。
+enum { Q_A1IN, Q_AM, Q_A1OUT };
+
+size_t two_queue(const trace_t* trace, size_t frame_size, page_t* final_frame) {
+    page_t* frame = final_frame;
+    size_t kin = frame_size / 4 ? frame_size / 4 : 1;
+    size_t kout = frame_size / 2 ? frame_size / 2 : 1;
+    uint8_t* which = xmalloc(frame_size);
+    frame_link_t* link = xmalloc(frame_size * sizeof(frame_link_t));
+    frame_list_t a1in, am, a1out;
+    list_init(&a1in);
+    list_init(&am);
+    list_init(&a1out);
+    ghosts_t ghosts;
+    ghosts_init(&ghosts, kout);
+    page_map_t map;
+    page_map_init(&map, frame_size + kout);
+    size_t faults = 0, used = 0;
+    for (size_t i = 0; i < frame_size; i++) frame[i] = EMPTY_FRAME;
+
+    cursor_t c;
+    cursor_init(&c, trace, 0);
+    const page_t* pages;
+    size_t n;
+    while ((n = cursor_next(&c, CHUNK_REFS, &pages)) != 0) {
+        for (size_t i = 0; i < n; i++) {
+            uint64_t* found = page_map_find(&map, pages[i]);
+            uint8_t to = Q_A1IN;
+            if (found != NULL && !(*found & GHOST_BIT)) {
+                uint32_t idx = (uint32_t)*found;
+                if (which[idx] == Q_AM) {
+                    list_remove(&am, link, idx);
+                    list_push(&am, link, idx);
+                }
+                continue; // A1in のヒットでは動かさない
+            }
+            if (found != NULL) {
+                ghost_drop(&ghosts, &map, &a1out, (uint32_t)(*found & ~GHOST_BIT), false);
+                to = Q_AM;
+            }
+            faults++;
+            uint32_t idx;
+            if (used < frame_size) {
+                idx = (uint32_t)used++;
+            } else if (a1in.size > kin || am.size == 0) {
+                idx = list_pop_tail(&a1in, link);
+                if (a1out.size == kout) ghost_drop(&ghosts, &map, &a1out, a1out.tail, true);
+                ghost_add(&ghosts, &map, &a1out, Q_A1OUT, frame[idx]);
+            } else {
+                idx = list_pop_tail(&am, link);
+                page_map_remove(&map, frame[idx]);
+            }
+            frame[idx] = pages[i];
+            which[idx] = to;
+            list_push(to == Q_AM ? &am : &a1in, link, idx);
+            page_map_put(&map, pages[i], idx);
+        }
+    }
+    cursor_destroy(&c);
+    page_map_destroy(&map);
+    ghosts_destroy(&ghosts);
+    free(link);
+    free(which);
+    return faults;
+}
+
+// ARC（Megiddo と Modha）
+// 一度だけ参照されたページの LRU の T1 と、二度以上参照されたページの LRU の T2 に
+// フレームを分け、それぞれから追い出したページの番号をゴーストの B1、B2 で覚えておく。
+// B1 のゴーストが参照されたら T1 の目標の大きさ p を増やし、B2 なら減らして、
+// 最近性と頻度のどちらを重く見るかをトレースに合わせて動かす。
+enum { ARC_T1, ARC_T2, ARC_B1, ARC_B2 };
+
+typedef struct {
+    page_t* frame;
+    uint8_t* which;
+    frame_link_t* link;
+    frame_list_t t1, t2, b1, b2;
+    ghosts_t ghosts;
+    page_map_t map;
+    size_t p;           // T1 の目標の大きさ
+} arc_t;
+
+// T1 か T2 の末尾を追い出してゴーストにし、空いたフレームを返す
+static uint32_t arc_replace(arc_t* a, bool in_b2) {
+    uint32_t idx;
+    if (a->t1.size >= 1 && ((in_b2 && a->t1.size == a->p) || a->t1.size > a->p)) {
+        idx = list_pop_tail(&a->t1, a->link);
+        ghost_add(&a->ghosts, &a->map, &a->b1, ARC_B1, a->frame[idx]);
+    } else {
+        idx = list_pop_tail(&a->t2, a->link);
+        ghost_add(&a->ghosts, &a->map, &a->b2, ARC_B2, a->frame[idx]);
+    }
+    return idx;
+}
+
+size_t arc(const trace_t* trace, size_t frame_size, page_t* final_frame) {
+    arc_t a;
+    a.frame = final_frame;
+    a.which = xmalloc(frame_size);
+    a.link = xmalloc(frame_size * sizeof(frame_link_t));
+    list_init(&a.t1);
+    list_init(&a.t2);
+    list_init(&a.b1);
+    list_init(&a.b2);
+    ghosts_init(&a.ghosts, frame_size); // キャッシュが埋まってからしか増えないので B1 + B2 <= フレーム数
+    page_map_init(&a.map, frame_size * 2);
+    a.p = 0;
+    size_t faults = 0, used = 0;
+    for (size_t i = 0; i < frame_size; i++) a.frame[i] = EMPTY_FRAME;
+
+    cursor_t c;
+    cursor_init(&c, trace, 0);
+    const page_t* pages;
+    size_t n;
+    while ((n = cursor_next(&c, CHUNK_REFS, &pages)) != 0) {
+        for (size_t i = 0; i < n; i++) {
+            uint64_t* found = page_map_find(&a.map, pages[i]);
+            uint32_t idx;
+            if (found != NULL && !(*found & GHOST_BIT)) {
+                // T1 でも T2 でも T2 の先頭へ
+                idx = (uint32_t)*found;
+                list_remove(a.which[idx] == ARC_T1 ? &a.t1 : &a.t2, a.link, idx);
+                a.which[idx] = ARC_T2;
+                list_push(&a.t2, a.link, idx);
+                continue;
             }
             faults++;
+            uint8_t to = ARC_T1;
+            if (found != NULL) {
+                // ゴーストがあるのはキャッシュが埋まっているときだけ
+                uint32_t g = (uint32_t)(*found & ~GHOST_BIT);
+                bool in_b2 = a.ghosts.which[g] == ARC_B2;
+                if (!in_b2) {
+                    size_t delta = a.b1.size >= a.b2.size ? 1 : a.b2.size / a.b1.size;
+                    a.p = a.p + delta < frame_size ? a.p + delta : frame_size;
+                    ghost_drop(&a.ghosts, &a.map, &a.b1, g, false);
+                } else {
+                    size_t delta = a.b2.size >= a.b1.size ? 1 : a.b1.size / a.b2.size;
+                    a.p = a.p > delta ? a.p - delta : 0;
+                    ghost_drop(&a.ghosts, &a.map, &a.b2, g, false);
+                }
+                idx = arc_replace(&a, in_b2);
+                to = ARC_T2;
+            } else if (a.t1.size + a.b1.size == frame_size) {
+                if (a.t1.size < frame_size) {
+                    ghost_drop(&a.ghosts, &a.map, &a.b1, a.b1.tail, true);
+                    idx = arc_replace(&a, false);
+                } else {
+                    idx = list_pop_tail(&a.t1, a.link);
+                    page_map_remove(&a.map, a.frame[idx]);
+                }
+            } else if (used < frame_size) {
+                idx = (uint32_t)used++;
+            } else {
+                if (a.t1.size + a.t2.size + a.b1.size + a.b2.size == frame_size * 2) {
+                    ghost_drop(&a.ghosts, &a.map, &a.b2, a.b2.tail, true);
+                }
+                idx = arc_replace(&a, false);
+            }
+            a.frame[idx] = pages[i];
+            a.which[idx] = to;
+            list_push(to == ARC_T2 ? &a.t2 : &a.t1, a.link, idx);
+            page_map_put(&a.map, pages[i], idx);
         }
     }
-    for (int i = 0; i < frame_size; i++) final_frame[i] = frame[i];
+    cursor_destroy(&c);
+    page_map_destroy(&a.map);
+    ghosts_destroy(&a.ghosts);
+    free(a.link);
+    free(a.which);
     return faults;
 }
 
-// ...existing code...
+typedef size_t (*policy_fn)(const trace_t* trace, size_t frame_size, page_t* final_frame);
 
-int main() {
-    int pages[MAX_REF], n, frame_size;
-    int fifo_frame[MAX_FRAME], lru_frame[MAX_FRAME], opt_frame[MAX_FRAME];
+static const struct {
+    const char* name;
+    policy_fn run;
+} policies[] = {
+    {"FIFO", fifo},
+    {"LRU", lru},
+    {"LRU-O1", lru_o1},
+    {"OPT", opt},
+    {"OPT-H", opt_heap},
+    {"CLOCK", clock_policy},
+    {"SC", second_chance},
+    {"2Q", two_queue},
+    {"ARC", arc},
+};
 
-    input_pages(pages, &n, &frame_size);
+// compare で比べる方式（フレーム数に比例する手間の fifo/lru/opt は入れない）
+#define COMPARE_POLICIES "lru-o1,clock,sc,2q,arc,opt-h"
 
-    int fifo_faults = fifo(pages, n, frame_size, fifo_frame);
-    int lru_faults = lru(pages, n, frame_size, lru_frame);
-    int opt_faults = opt(pages, n, frame_size, opt_frame);
+#define NUM_POLICIES (sizeof(policies) / sizeof(policies[0]))
+
+static int parse_width(const char* s) {
+    if (strcmp(s, "u32") == 0 || strcmp(s, "4") == 0) return 4;
+    if (strcmp(s, "u64") == 0 || strcmp(s, "8") == 0) return 8;
+    fprintf(stderr, "ページ番号の幅は u32 か u64: %s\n", s);
+    return 0;
+}
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t xorshift64(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// 合成トレースを書き出す
+// 参照の大半は全体の 1/16 のホットな範囲に集まり、その範囲は 1M 参照ごとに移る。
+// 残りは全体から一様に選び、ときどきホットな範囲と同じ長さの順次スキャンが混ざる。
+static int cmd_gen(int argc, char** argv) {
+    if (argc < 5) {
+        fprintf(stderr, "usage: %s gen <out> <refs> <pages> [u32|u64]\n", argv[0]);
+        return 1;
+    }
+    const char* path = argv[2];
+    size_t refs = strtoull(argv[3], NULL, 0);
+    uint64_t pages = strtoull(argv[4], NULL, 0);
+    int width = parse_width(argc > 5 ? argv[5] : "u32");
+    if (width == 0 || pages == 0) return 1;
+    if (width == 4 && pages - 1 > UINT32_MAX) {
+        fprintf(stderr, "u32 で表せるページ数を超えています\n");
+        return 1;
+    }
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        perror(path);
+        return 1;
+    }
+
+    uint64_t hot = pages / 16 ? pages / 16 : 1;
+    uint64_t base = 0, scan_page = 0, scan_left = 0;
+    unsigned char* buf = xmalloc(CHUNK_REFS * sizeof(page_t));
+    size_t filled = 0;
+    for (size_t i = 0; i < refs; i++) {
+        if (i % (1 << 20) == 0) base = xorshift64() % pages;
+        page_t page;
+        if (scan_left > 0) {
+            page = scan_page++ % pages;
+            scan_left--;
+        } else if (xorshift64() % (hot * 8) == 0) {
+            scan_page = xorshift64() % pages;
+            scan_left = hot - 1;
+            page = scan_page++ % pages;
+        } else if (xorshift64() % 10 != 0) {
+            page = (base + xorshift64() % hot) % pages;
+        } else {
+            page = xorshift64() % pages;
+        }
+        if (width == 4) {
+            ((uint32_t*)buf)[filled] = (uint32_t)page;
+        } else {
+            ((uint64_t*)buf)[filled] = page;
+        }
+        if (++filled == CHUNK_REFS) {
+            fwrite(buf, width, filled, file);
+            filled = 0;
+        }
+    }
+    fwrite(buf, width, filled, file);
+    free(buf);
+    if (fclose(file) != 0) {
+        perror(path);
+        return 1;
+    }
+    return 0;
+}
+
+// トレースファイルに対して方式を順に実行し、フォルト数、ヒット率と処理速度を表示する
+// run は既定で fifo,lru,opt を、compare は COMPARE_POLICIES を同じトレースで実行する。
+static int cmd_run(int argc, char** argv) {
+    bool compare = strcmp(argv[1], "compare") == 0;
+    if (argc < 4) {
+        fprintf(stderr, "usage: %s %s <trace> <frames> [u32|u64]%s\n", argv[0], argv[1],
+                compare ? "" : " [fifo,lru,opt,...]");
+        return 1;
+    }
+    const char* path = argv[2];
+    char* end;
+    size_t frame_size = strtoull(argv[3], &end, 0);
+    if (frame_size == 0 || *end != '\0') {
+        fprintf(stderr, "フレーム数は 1 以上の数で指定してください: %s\n", argv[3]);
+        return 1;
+    }
+    if (frame_size >= NIL_FRAME) {
+        fprintf(stderr, "フレーム数が多すぎます\n");
+        return 1;
+    }
+    int width = parse_width(argc > 4 ? argv[4] : "u32");
+    if (width == 0) return 1;
+
+    trace_t trace;
+    if (!trace_open(&trace, path, width)) return 1;
+    char* names = strdup(!compare && argc > 5 ? argv[5] : compare ? COMPARE_POLICIES : "fifo,lru,opt");
+    printf("trace: %s（%zu 参照, %s, %s）, frames: %zu\n", path, trace.count,
+           width == 4 ? "u32" : "u64", trace.data != NULL ? "mmap" : "pread", frame_size);
+    printf("%-6s %14s %9s %9s %12s\n", "policy", "faults", "fault%", "hit%", "refs/s");
+
+    page_t* frame = xmalloc(frame_size * sizeof(page_t));
+    for (char* name = strtok(names, ","); name != NULL; name = strtok(NULL, ",")) {
+        size_t p;
+        for (p = 0; p < NUM_POLICIES; p++) {
+            if (strcasecmp(name, policies[p].name) == 0) break;
+        }
+        if (p == NUM_POLICIES) {
+            fprintf(stderr, "不明な方式: %s\n", name);
+            continue;
+        }
+        uint64_t start = now_ns();
+        size_t faults = policies[p].run(&trace, frame_size, frame);
+        uint64_t elapsed = now_ns() - start;
+        double fault_ratio = trace.count ? 100.0 * faults / trace.count : 0.0;
+        printf("%-6s %14zu %8.3f%% %8.3f%% %12.0f\n", policies[p].name, faults,
+               fault_ratio, 100.0 - fault_ratio,
+               elapsed ? trace.count * 1e9 / elapsed : 0.0);
+        fflush(stdout);
+    }
+    free(frame);
+    free(names);
+    trace_close(&trace);
+    return 0;
+}
+
+// スタック距離から LRU の miss-ratio curve を1回で求め、CSV で標準出力に書く
+// フレーム数は 1 から max_frames（省略時はスタック距離の最大値。それより先は初めての参照だけが
+// フォルトになり変わらない）まで。
+static int cmd_mrc(int argc, char** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s mrc <trace> [u32|u64] [max_frames] > curve.csv\n", argv[0]);
+        return 1;
+    }
+    int width = parse_width(argc > 3 ? argv[3] : "u32");
+    if (width == 0) return 1;
+    trace_t trace;
+    if (!trace_open(&trace, argv[2], width)) return 1;
+
+    stack_distance_t sd;
+    uint64_t start = now_ns();
+    stack_distances(&trace, &sd);
+    uint64_t elapsed = now_ns() - start;
+    size_t max_frames = argc > 4 ? strtoull(argv[4], NULL, 0) : sd.max_distance;
+    if (max_frames == 0) max_frames = 1;
+    fprintf(stderr, "%zu 参照, %zu ページ, 最大スタック距離 %zu, %.2f 秒（%.0f refs/s）\n",
+            sd.refs, sd.cold, sd.max_distance, elapsed / 1e9,
+            elapsed ? sd.refs * 1e9 / elapsed : 0.0);
+
+    printf("frames,faults,miss_ratio\n");
+    size_t faults = sd.refs;
+    for (size_t frames = 1; frames <= max_frames; frames++) {
+        if (frames <= sd.max_distance) faults -= sd.hist[frames];
+        printf("%zu,%zu,%.6f\n", frames, faults, sd.refs ? (double)faults / sd.refs : 0.0);
+    }
+    free(sd.hist);
+    trace_close(&trace);
+    return 0;
+}
+
+// grid の1つの組み合わせ（方式 × フレーム数）
+typedef struct {
+    size_t policy;      // policies[] の番号
+    size_t frame_size;
+    size_t faults;
+    uint64_t cpu;       // このスレッドが使った CPU 時間（ns）
+} grid_job_t;
+
+typedef struct {
+    const trace_t* trace;
+    grid_job_t* jobs;
+    const size_t* order; // 取り出す順（フレーム数の多い、時間のかかりそうなものから）
+    size_t count;
+    size_t next;        // 次に取る order の位置（スレッドが __atomic で進める）
+} grid_t;
+
+// 仕事を1つずつ取って実行する。トレースは読むだけで、方式の状態は実行ごとに作るので共有しない
+static void* grid_worker(void* arg) {
+    grid_t* g = arg;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&g->next, 1, __ATOMIC_RELAXED);
+        if (i >= g->count) break;
+        grid_job_t* job = &g->jobs[g->order[i]];
+        page_t* frame = xmalloc(job->frame_size * sizeof(page_t));
+        // コアより多いスレッドで動かしても待たされた時間が入らないように、CPU 時間で測る
+        uint64_t start = thread_cpu_ns();
+        job->faults = policies[job->policy].run(g->trace, job->frame_size, frame);
+        job->cpu = thread_cpu_ns() - start;
+        free(frame);
+    }
+    return NULL;
+}
+
+static const grid_job_t* sort_jobs;
+
+static int compare_job_cost(const void* a, const void* b) {
+    const grid_job_t* x = &sort_jobs[*(const size_t*)a];
+    const grid_job_t* y = &sort_jobs[*(const size_t*)b];
+    return x->frame_size < y->frame_size ? 1 : x->frame_size > y->frame_size ? -1 : 0;
+}
+
+// フレーム数の並びを読む。"1024,4096" のような列挙に、"1024:65536"（2倍ずつ）と
+// "1000:5000:1000"（1000 ずつ）の範囲を混ぜられる
+static size_t parse_frame_list(const char* s, size_t** out) {
+    size_t count = 0, cap = 16;
+    size_t* list = xmalloc(cap * sizeof(size_t));
+    char* copy = strdup(s);
+    for (char* item = strtok(copy, ","); item != NULL; item = strtok(NULL, ",")) {
+        char* end;
+        size_t lo = strtoull(item, &end, 0), hi = lo, step = 0;
+        if (*end == ':') {
+            hi = strtoull(end + 1, &end, 0);
+            if (*end == ':') step = strtoull(end + 1, &end, 0);
+        }
+        if (lo == 0 || hi < lo || *end != '\0') {
+            fprintf(stderr, "フレーム数の指定が読めません: %s\n", item);
+            free(copy);
+            free(list);
+            return 0;
+        }
+        for (size_t f = lo; f <= hi;) {
+            if (count == cap) {
+                cap *= 2;
+                list = realloc(list, cap * sizeof(size_t));
+                if (list == NULL) {
+                    perror("realloc");
+                    exit(1);
+                }
+            }
+            list[count++] = f;
+            size_t next = step ? f + step : f * 2;
+            if (next <= f) break; // あふれ
+            f = next;
+        }
+    }
+    free(copy);
+    *out = list;
+    return count;
+}
+
+// 方式 × フレーム数の組み合わせをスレッドプールで並列に実行し、1つの表にまとめる
+// トレースは全員で同じ mmap を読むだけなので、組み合わせが多ければスレッド数に近い倍率で速くなる。
+// OPT-H は組み合わせごとに次の参照位置の表（参照1つあたり 8 バイト）を作るので、スレッド数分の
+// メモリがいる。
+static int cmd_grid(int argc, char** argv) {
+    if (argc < 4) {
+        fprintf(stderr, "usage: %s grid <trace> <frames,lo:hi,lo:hi:step,...> [u32|u64] [方式,...] [threads]\n",
+                argv[0]);
+        return 1;
+    }
+    int width = parse_width(argc > 4 ? argv[4] : "u32");
+    if (width == 0) return 1;
+    size_t* frames;
+    size_t num_frames = parse_frame_list(argv[3], &frames);
+    if (num_frames == 0) return 1;
+    for (size_t f = 0; f < num_frames; f++) {
+        if (frames[f] >= NIL_FRAME) {
+            fprintf(stderr, "フレーム数が多すぎます: %zu\n", frames[f]);
+            free(frames);
+            return 1;
+        }
+    }
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc > 6) {
+        char* end;
+        threads = strtol(argv[6], &end, 0);
+        if (threads < 1 || *end != '\0') {
+            fprintf(stderr, "スレッド数は 1 以上の数で指定してください: %s\n", argv[6]);
+            free(frames);
+            return 1;
+        }
+    }
+    if (threads < 1) threads = 1;
+
+    size_t selected[NUM_POLICIES], num_selected = 0;
+    char* names = strdup(argc > 5 ? argv[5] : COMPARE_POLICIES);
+    for (char* name = strtok(names, ","); name != NULL; name = strtok(NULL, ",")) {
+        size_t p;
+        for (p = 0; p < NUM_POLICIES; p++) {
+            if (strcasecmp(name, policies[p].name) == 0) break;
+        }
+        if (p == NUM_POLICIES) {
+            fprintf(stderr, "不明な方式: %s\n", name);
+        } else if (num_selected < NUM_POLICIES) {
+            selected[num_selected++] = p;
+        }
+    }
+    free(names);
+    if (num_selected == 0) {
+        fprintf(stderr, "実行する方式がありません\n");
+        free(frames);
+        return 1;
+    }
+
+    trace_t trace;
+    if (!trace_open(&trace, argv[2], width)) {
+        free(frames);
+        return 1;
+    }
+    grid_t g;
+    g.trace = &trace;
+    g.count = num_selected * num_frames;
+    if ((size_t)threads > g.count) threads = (long)g.count; // 仕事のないスレッドは作らない
+    g.next = 0;
+    g.jobs = xmalloc(g.count * sizeof(grid_job_t));
+    size_t* order = xmalloc(g.count * sizeof(size_t));
+    for (size_t p = 0; p < num_selected; p++) {
+        for (size_t f = 0; f < num_frames; f++) {
+            grid_job_t* job = &g.jobs[p * num_frames + f];
+            job->policy = selected[p];
+            job->frame_size = frames[f];
+            order[p * num_frames + f] = p * num_frames + f;
+        }
+    }
+    // 長くかかりそうなものから配ると、最後に1つだけ残って待つ時間が短くなる
+    sort_jobs = g.jobs;
+    qsort(order, g.count, sizeof(size_t), compare_job_cost);
+    g.order = order;
+
+    printf("trace: %s（%zu 参照, %s, %s）, %zu 通り, threads: %ld\n", argv[2], trace.count,
+           width == 4 ? "u32" : "u64", trace.data != NULL ? "mmap" : "pread", g.count, threads);
+    pthread_t* tids = xmalloc(threads * sizeof(pthread_t));
+    uint64_t start = now_ns();
+    long started;
+    for (started = 0; started < threads; started++) {
+        if (pthread_create(&tids[started], NULL, grid_worker, &g) != 0) break;
+    }
+    if (started == 0) grid_worker(&g); // スレッドを作れなければ自分で全部やる
+    for (long t = 0; t < started; t++) pthread_join(tids[t], NULL);
+    uint64_t wall = now_ns() - start;
+
+    printf("%-6s %9s %14s %9s %9s %12s %9s\n", "policy", "frames", "faults", "fault%", "hit%", "refs/s", "cpu sec");
+    uint64_t total = 0;
+    for (size_t i = 0; i < g.count; i++) {
+        const grid_job_t* job = &g.jobs[i];
+        double fault_ratio = trace.count ? 100.0 * job->faults / trace.count : 0.0;
+        printf("%-6s %9zu %14zu %8.3f%% %8.3f%% %12.0f %9.2f\n", policies[job->policy].name,
+               job->frame_size, job->faults, fault_ratio, 100.0 - fault_ratio,
+               job->cpu ? trace.count * 1e9 / job->cpu : 0.0, job->cpu / 1e9);
+        total += job->cpu;
+    }
+    printf("CPU 時間の合計 %.2f 秒を %.2f 秒で実行（%.2f 倍）\n", total / 1e9, wall / 1e9,
+           wall ? (double)total / wall : 0.0);
+
+    free(tids);
+    free(order);
+    free(g.jobs);
+    free(frames);
+    trace_close(&trace);
+    return 0;
+}
+
+// 使い方:
+//   ./page_algo                                        参照列とフレーム数を入力して FIFO/LRU/OPT を比べる
+//   ./page_algo gen <out> <refs> <pages> [u32|u64]     合成トレースを書き出す
+//   ./page_algo run <trace> <frames> [u32|u64] [方式]  トレースファイルで方式（既定 fifo,lru,opt）を実行する
+//   ./page_algo compare <trace> <frames> [u32|u64]     LRU/CLOCK/SC/2Q/ARC/OPT を同じトレースで比べる
+//   ./page_algo grid <trace> <frames,...> [u32|u64] [方式,...] [threads]
+//                                                      方式 × フレーム数をスレッドプールで並列に実行する
+//   ./page_algo mrc <trace> [u32|u64] [max_frames]     LRU の miss-ratio curve を CSV で書く
+int main(int argc, char** argv) {
+    if (argc >= 2 && strcmp(argv[1], "gen") == 0) return cmd_gen(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "run") == 0) return cmd_run(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "compare") == 0) return cmd_run(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "mrc") == 0) return cmd_mrc(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "grid") == 0) return cmd_grid(argc, argv);
+    if (argc >= 2) {
+        fprintf(stderr, "usage: %s [gen|run|compare|mrc|grid ...]\n", argv[0]);
+        return 1;
+    }
+
+    trace_t trace;
+    size_t frame_size;
+    input_pages(&trace, &frame_size);
+    if (frame_size == 0) {
+        fprintf(stderr, "フレーム数は 1 以上にしてください\n");
+        return 1;
+    }
+    page_t* fifo_frame = xmalloc(frame_size * sizeof(page_t));
+    page_t* lru_frame = xmalloc(frame_size * sizeof(page_t));
+    page_t* opt_frame = xmalloc(frame_size * sizeof(page_t));
+
+    size_t fifo_faults = fifo(&trace, frame_size, fifo_frame);
+    size_t lru_faults = lru(&trace, frame_size, lru_frame);
+    size_t opt_faults = opt(&trace, frame_size, opt_frame);
 
     print_result("FIFO", fifo_faults, fifo_frame, frame_size);
     print_result("LRU", lru_faults, lru_frame, frame_size);
     print_result("OPT", opt_faults, opt_frame, frame_size);
 
+    free(fifo_frame);
+    free(lru_frame);
+    free(opt_frame);
+    free((void*)trace.data);
     return 0;
 }
-// ...existing code...
+
+// 計測結果（gcc -O2, 1コア。refs/s は1回の実行の参照数 / 時間。ばらつきは 2〜3割ある）
+//   gen 1000万参照 / 65536 ページ（u32, 40 MB）
+//     frames 64     FIFO 1.8〜2.7 千万 refs/s   LRU 5.3〜6.2 百万 refs/s
+//     frames 1024   FIFO 1.3〜1.5 百万 refs/s   LRU 0.52〜0.58 百万 refs/s
+//   gen 10万参照 / 4096 ページ, frames 64   OPT 6900〜9000 refs/s（FIFO 1500万〜2900万, LRU 550万〜920万）
+//   mmap と pread、u32 と u64 の差は測定のばらつきに埋もれる。
+//   FIFO/LRU はフレームを線形に探すので、速さはフレーム数にほぼ反比例する。
+//   OPT はフォルトのたびに先を読み進めるので、二度と参照されないページがあると
+//   トレースの最後まで読むことになり、長いトレースでは使えない。
+// lru_o1: gen 2000万参照 / 1600万ページ（ホットな範囲 100万ページ）
+//   frames 1K     1320 万 refs/s（フォルト率 99.9%）
+//   frames 64K    640〜740 万 refs/s（95.6%）
+//   frames 1M     430 万 refs/s（69.0%）
+//   上の 1000万参照 / 65536 ページでは frames 1K で 1630〜1860 万 refs/s（lru と同じ 8201035 フォルト）、
+//   frames 64K で 4470 万 refs/s（全部載るのでヒットだけ）。2000万参照の先頭 10万参照を frames 64K で回すと lru の
+//   9951 refs/s に対して 1340 万 refs/s。フレームが増えると遅くなるのは、ハッシュ表とリストが
+//   キャッシュに収まらなくなってミスが増えるため（1M フレームで表 32 MB + リスト 8 MB）。
+// opt_heap: 10万参照 / 4096 ページで frames 64 が 930〜980 万 refs/s、frames 1000 が 1700〜2600 万 refs/s
+//   （opt は 6900〜9000 / 1400〜1700 refs/s、フォルト数はどちらも同じ）。2000万参照 / 1600万ページでは
+//   frames 1K / 64K / 1M が 420 / 260〜290 / 170 万 refs/s（フォルト率 96.6 / 77.8 / 57.2%、
+//   同じフレーム数の LRU より 3〜12 ポイント低い）。次の参照位置の表が 160 MB になり、
+//   後ろからなめるハッシュ表が実際に参照される 1035万ページ分に育つので、その分 lru_o1 より遅い。
+// mrc: 1000万参照 / 65536 ページが 1.6 秒（630 万 refs/s）で 65536 行、2000万参照 / 1600万ページ
+//   （実際に参照されたのは 1035万ページ）が 13.9 秒（144 万 refs/s）で 1035万行。どちらも lru_o1 の
+//   1K / 64K / 1M フレームのフォルト数と一致する。lru_o1 で 1フレーム数あたり 1.5〜5 秒かかるので、
+//   数百通りのフレーム数を調べるなら1回で済むこちらが圧倒的に速い。
+//   木を生きている時刻の 2 倍で振り直すと、詰め直し（qsort）が頻繁になって 1.6 倍遅かった。
+// compare（1コア。フォルト率 / 百万 refs/s）
+//                  1000万参照 / 65536 ページ                2000万参照 / 1600万ページ
+//                  frames 1K        frames 16K              frames 64K
+//     LRU-O1       82.01% / 16.3    15.01% / 47.2           95.56% / 7.4
+//     CLOCK        82.12% / 14.7    15.26% / 50.3           95.56% / 7.5
+//     SC           82.12% / 11.3    15.26% / 47.4           95.56% / 6.6
+//     2Q           80.32% / 16.4    15.25% / 26.7           97.52% / 4.0
+//     ARC          80.26% / 12.8    15.19% / 21.5           95.69% / 4.4
+//     OPT-H        49.82% / 8.3      8.85% / 13.9           77.83% / 2.9
+//   CLOCK と SC のフォルト数は同じで、SC はリストをつなぎ替える分だけ遅い。フレームが
+//   ホットな範囲より小さいと、スキャンや一度きりの参照で追い出されにくい 2Q/ARC が LRU より
+//   2ポイント近く良い。ほとんど載らない 1600万ページのトレースでは、A1in が 1/4 しかない 2Q が
+//   二度目の参照を取りこぼして LRU より悪くなり、ARC は p を動かして LRU とほぼ同じになる。
+//   ARC と 2Q はゴーストの分だけハッシュ表が大きくなるので、ヒットの多いときは LRU の半分ほどの速さ。
+// grid: 1000万参照 / 65536 ページ、LRU-O1/CLOCK/ARC/2Q/OPT-H × frames 256〜4096（2倍ずつ）の 25 通り
+//   threads 1   CPU 時間の合計 16.8 秒を 17.1 秒で実行（0.99 倍）
+//   threads 4   CPU 時間の合計 19.2 秒を 19.5 秒で実行（0.99 倍）
+//   この環境は1コアなので並列には速くならない。プールと仕事の配り方のオーバーヘッドは 1% 程度で、
+//   1コアに4スレッドを詰めると、キャッシュを取り合って CPU 時間が 1割余り増える。
+//   仕事どうしで共有するのは読み取り専用の mmap だけなので、コアが増えれば、メモリ帯域と
+//   共有キャッシュを使い切るまではコア数に近い倍率が出る見込み。